@@ -1222,6 +1222,7 @@ INCLUDEPATH += . \
 
 # Input
 HEADERS += src/activemasternode.h \
+           src/addressindex.h \
            src/addrman.h \
            src/alert.h \
            src/allocators.h \
@@ -1230,6 +1231,8 @@ HEADERS += src/activemasternode.h \
            src/base58.h \
            src/bignum.h \
            src/bip38.h \
+           src/blockmap.h \
+           src/blockstore.h \
            src/bloom.h \
            src/chain.h \
            src/chainparams.h \
@@ -1269,6 +1272,8 @@ HEADERS += src/activemasternode.h \
            src/mixTX-relay.h \
            src/mixTX.h \
            src/mruset.h \
+           src/msgqueue.h \
+           src/muhash.h \
            src/net.h \
            src/netbase.h \
            src/noui.h \
@@ -1281,11 +1286,13 @@ HEADERS += src/activemasternode.h \
            src/rpcprotocol.h \
            src/rpcserver.h \
            src/serialize.h \
+           src/spentindex.h \
            src/spork.h \
            src/streams.h \
            src/sync.h \
            src/threadsafety.h \
            src/timedata.h \
+           src/timestampindex.h \
            src/tinyformat.h \
            src/txdb.h \
            src/txmempool.h \
@@ -13890,6 +13897,8 @@ SOURCES += src/activemasternode.cpp \
            src/arith_uint256.cpp \
            src/base58.cpp \
            src/bip38.cpp \
+           src/blockmap.cpp \
+           src/blockstore.cpp \
            src/bloom.cpp \
            src/chain.cpp \
            src/chainparams.cpp \
@@ -13924,6 +13933,8 @@ SOURCES += src/activemasternode.cpp \
            src/miner.cpp \
            src/mixTX-relay.cpp \
            src/mixTX.cpp \
+           src/msgqueue.cpp \
+           src/muhash.cpp \
            src/net.cpp \
            src/netbase.cpp \
            src/noui.cpp \
@@ -14058,14 +14069,17 @@ SOURCES += src/activemasternode.cpp \
            src/script/standard.cpp \
            src/test/accounting_tests.cpp \
            src/test/alert_tests.cpp \
+           src/test/addressindex_tests.cpp \
            src/test/allocator_tests.cpp \
            src/test/arith_uint256_tests.cpp \
            src/test/base32_tests.cpp \
            src/test/base58_tests.cpp \
            src/test/base64_tests.cpp \
+           src/test/blockmap_tests.cpp \
            src/test/bip32_tests.cpp \
            src/test/bloom_tests.cpp \
            src/test/checkblock_tests.cpp \
+           src/test/checkqueue_tests.cpp \
            src/test/Checkpoints_tests.cpp \
            src/test/coins_tests.cpp \
            src/test/compress_tests.cpp \
@@ -14078,7 +14092,9 @@ SOURCES += src/activemasternode.cpp \
            src/test/mempool_tests.cpp \
            src/test/miner_tests.cpp \
            src/test/mruset_tests.cpp \
+           src/test/msgqueue_tests.cpp \
            src/test/multisig_tests.cpp \
+           src/test/net_tests.cpp \
            src/test/netbase_tests.cpp \
            src/test/pmt_tests.cpp \
            src/test/rpc_tests.cpp \
@@ -14091,8 +14107,10 @@ SOURCES += src/activemasternode.cpp \
            src/test/sighash_tests.cpp \
            src/test/sigopcount_tests.cpp \
            src/test/skiplist_tests.cpp \
+           src/test/spentindex_tests.cpp \
            src/test/test_bare.cpp \
            src/test/timedata_tests.cpp \
+           src/test/timestampindex_tests.cpp \
            src/test/transaction_tests.cpp \
            src/test/uint256_tests.cpp \
            src/test/univalue_tests.cpp \
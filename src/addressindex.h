@@ -0,0 +1,159 @@
+// Copyright (c) 2017-2019 The Bare developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_ADDRESSINDEX_H
+#define BITCOIN_ADDRESSINDEX_H
+
+#include "amount.h"
+#include "pubkey.h"
+#include "script/script.h"
+#include "script/standard.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <boost/variant/get.hpp>
+
+/** Kinds of destinations kept in the address index */
+enum AddressIndexType {
+    ADDRESS_TYPE_PUBKEYHASH = 1, //! pay to a key, by hash or by public key
+    ADDRESS_TYPE_SCRIPTHASH = 2, //! pay to a script hash
+};
+
+/**
+ * One change of an address balance: an output paying to it, or an input
+ * spending such an output. Keys sort by address, then by height and position
+ * in the block, so the history of an address is a contiguous range.
+ */
+struct CAddressIndexKey {
+    int type;
+    uint160 hashBytes;
+    int nHeight;
+    unsigned int nTxIndex;
+    uint256 txhash;
+    unsigned int nIndex;
+    bool fSpending;
+
+    CAddressIndexKey() : type(0), hashBytes(0), nHeight(0), nTxIndex(0), txhash(0), nIndex(0), fSpending(false) {}
+    CAddressIndexKey(int typeIn, const uint160& hashBytesIn, int nHeightIn, unsigned int nTxIndexIn, const uint256& txhashIn, unsigned int nIndexIn, bool fSpendingIn)
+        : type(typeIn), hashBytes(hashBytesIn), nHeight(nHeightIn), nTxIndex(nTxIndexIn), txhash(txhashIn), nIndex(nIndexIn), fSpending(fSpendingIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        unsigned char chType = type;
+        READWRITE(chType);
+        type = chType;
+        READWRITE(hashBytes);
+        READWRITE(BIGENDIAN32(nHeight));
+        READWRITE(BIGENDIAN32(nTxIndex));
+        READWRITE(txhash);
+        READWRITE(nIndex);
+        READWRITE(fSpending);
+    }
+};
+
+/** Prefix of CAddressIndexKey for seeking to the first entry of an address at or above a height */
+struct CAddressIndexIteratorKey {
+    int type;
+    uint160 hashBytes;
+    int nHeight;
+
+    CAddressIndexIteratorKey(int typeIn, const uint160& hashBytesIn, int nHeightIn = 0) : type(typeIn), hashBytes(hashBytesIn), nHeight(nHeightIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        unsigned char chType = type;
+        READWRITE(chType);
+        type = chType;
+        READWRITE(hashBytes);
+        READWRITE(BIGENDIAN32(nHeight));
+    }
+};
+
+/** An unspent output paying to an address */
+struct CAddressUnspentKey {
+    int type;
+    uint160 hashBytes;
+    uint256 txhash;
+    unsigned int nIndex;
+
+    CAddressUnspentKey() : type(0), hashBytes(0), txhash(0), nIndex(0) {}
+    CAddressUnspentKey(int typeIn, const uint160& hashBytesIn, const uint256& txhashIn, unsigned int nIndexIn)
+        : type(typeIn), hashBytes(hashBytesIn), txhash(txhashIn), nIndex(nIndexIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        unsigned char chType = type;
+        READWRITE(chType);
+        type = chType;
+        READWRITE(hashBytes);
+        READWRITE(txhash);
+        READWRITE(nIndex);
+    }
+};
+
+/** Value of an unspent output; a null value erases the entry */
+struct CAddressUnspentValue {
+    CAmount nValue;
+    CScript script;
+    int nHeight;
+
+    CAddressUnspentValue() : nValue(-1), nHeight(0) {}
+    CAddressUnspentValue(CAmount nValueIn, const CScript& scriptIn, int nHeightIn) : nValue(nValueIn), script(scriptIn), nHeight(nHeightIn) {}
+
+    bool IsNull() const { return nValue == -1; }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(nValue);
+        READWRITE(script);
+        READWRITE(nHeight);
+    }
+};
+
+/** Map a destination to its address index key; only key and script hashes are indexed */
+inline bool GetAddressIndexKey(const CTxDestination& dest, uint160& hashBytes, int& type)
+{
+    if (const CKeyID* keyID = boost::get<CKeyID>(&dest)) {
+        hashBytes = *keyID;
+        type = ADDRESS_TYPE_PUBKEYHASH;
+        return true;
+    }
+    if (const CScriptID* scriptID = boost::get<CScriptID>(&dest)) {
+        hashBytes = *scriptID;
+        type = ADDRESS_TYPE_SCRIPTHASH;
+        return true;
+    }
+    return false;
+}
+
+/** Address index key of the destination a script pays to */
+inline bool GetScriptAddressIndexKey(const CScript& script, uint160& hashBytes, int& type)
+{
+    CTxDestination dest;
+    return ExtractDestination(script, dest) && GetAddressIndexKey(dest, hashBytes, type);
+}
+
+/** Inverse of GetAddressIndexKey */
+inline CTxDestination GetAddressIndexDestination(int type, const uint160& hashBytes)
+{
+    if (type == ADDRESS_TYPE_PUBKEYHASH)
+        return CKeyID(hashBytes);
+    if (type == ADDRESS_TYPE_SCRIPTHASH)
+        return CScriptID(hashBytes);
+    return CNoDestination();
+}
+
+#endif // BITCOIN_ADDRESSINDEX_H
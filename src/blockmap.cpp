@@ -0,0 +1,93 @@
+// Copyright (c) 2017-2019 The Bare developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockmap.h"
+
+#include "random.h"
+
+#include <assert.h>
+
+/** Slots are at most this full, in eighths */
+static const size_t MAX_LOAD_EIGHTHS = 6;
+static const size_t MIN_SLOTS = 1024;
+
+size_t CBlockIndexMap::FindSlot(const uint256& key, uint64_t nHash) const
+{
+    const size_t nMask = vSlots.size() - 1;
+    const uint32_t nTag = (uint32_t)(nHash >> 32);
+    for (size_t i = (size_t)nHash & nMask;; i = (i + 1) & nMask) {
+        const Slot& slot = vSlots[i];
+        if (slot.nEntry == EMPTY)
+            return i;
+        if (slot.nTag == nTag && vEntries[slot.nEntry].first == key)
+            return i;
+    }
+}
+
+void CBlockIndexMap::Rehash(size_t nEntries)
+{
+    size_t nSlots = MIN_SLOTS;
+    while (nSlots * MAX_LOAD_EIGHTHS < nEntries * 8)
+        nSlots *= 2;
+    if (nSlots <= vSlots.size())
+        return;
+
+    if (vSlots.empty())
+        salt = GetRandHash();
+
+    Slot slotEmpty;
+    slotEmpty.nEntry = EMPTY;
+    slotEmpty.nTag = 0;
+    std::vector<Slot>(nSlots, slotEmpty).swap(vSlots);
+    for (size_t n = 0; n < vEntries.size(); n++) {
+        uint64_t nHash = HashKey(vEntries[n].first);
+        Slot& slot = vSlots[FindSlot(vEntries[n].first, nHash)];
+        slot.nEntry = n;
+        slot.nTag = (uint32_t)(nHash >> 32);
+    }
+}
+
+CBlockIndexMap::iterator CBlockIndexMap::find(const uint256& key)
+{
+    if (vEntries.empty())
+        return end();
+    const Slot& slot = vSlots[FindSlot(key, HashKey(key))];
+    return slot.nEntry == EMPTY ? end() : vEntries.begin() + slot.nEntry;
+}
+
+CBlockIndexMap::const_iterator CBlockIndexMap::find(const uint256& key) const
+{
+    if (vEntries.empty())
+        return end();
+    const Slot& slot = vSlots[FindSlot(key, HashKey(key))];
+    return slot.nEntry == EMPTY ? end() : vEntries.begin() + slot.nEntry;
+}
+
+std::pair<CBlockIndexMap::iterator, bool> CBlockIndexMap::insert(const value_type& value)
+{
+    if ((vEntries.size() + 1) * 8 > vSlots.size() * MAX_LOAD_EIGHTHS)
+        Rehash(vEntries.size() + 1);
+
+    uint64_t nHash = HashKey(value.first);
+    Slot& slot = vSlots[FindSlot(value.first, nHash)];
+    if (slot.nEntry != EMPTY)
+        return std::make_pair(vEntries.begin() + slot.nEntry, false);
+
+    assert(vEntries.size() < EMPTY);
+    slot.nEntry = vEntries.size();
+    slot.nTag = (uint32_t)(nHash >> 32);
+    vEntries.push_back(value);
+    return std::make_pair(vEntries.end() - 1, true);
+}
+
+void CBlockIndexMap::reserve(size_t nEntries)
+{
+    Rehash(nEntries);
+}
+
+void CBlockIndexMap::clear()
+{
+    vEntries.clear();
+    std::vector<Slot>().swap(vSlots);
+}
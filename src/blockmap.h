@@ -0,0 +1,81 @@
+// Copyright (c) 2017-2019 The Bare developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKMAP_H
+#define BITCOIN_BLOCKMAP_H
+
+#include "uint256.h"
+
+#include <deque>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+class CBlockIndex;
+
+/**
+ * Hash table from block hashes to block index entries.
+ *
+ * Entries are stored in a deque, so their addresses (and with them the
+ * phashBlock pointers into the keys) never change. Lookups go through a flat,
+ * linearly probed slot array indexed by a salted 64-bit hash of the block
+ * hash; every slot keeps 32 bits of that hash so the full keys only need to
+ * be compared when those bits match. Iteration is in insertion order.
+ *
+ * Entries cannot be erased. Like those of other hash maps, iterators are
+ * invalidated by insertion; pointers and references to entries are not.
+ */
+class CBlockIndexMap
+{
+public:
+    typedef uint256 key_type;
+    typedef CBlockIndex* mapped_type;
+    typedef std::pair<const uint256, CBlockIndex*> value_type;
+    typedef std::deque<value_type>::iterator iterator;
+    typedef std::deque<value_type>::const_iterator const_iterator;
+
+private:
+    struct Slot {
+        //! index into vEntries, or EMPTY
+        uint32_t nEntry;
+        //! upper half of the salted key hash
+        uint32_t nTag;
+    };
+    static const uint32_t EMPTY = 0xffffffff;
+
+    std::deque<value_type> vEntries;
+    std::vector<Slot> vSlots;
+    uint256 salt;
+
+    uint64_t HashKey(const uint256& key) const { return key.GetHash(salt); }
+
+    //! Return the slot holding key, or the empty slot where it belongs
+    size_t FindSlot(const uint256& key, uint64_t nHash) const;
+
+    //! Rebuild the slot array with room for at least nEntries
+    void Rehash(size_t nEntries);
+
+public:
+    CBlockIndexMap() {}
+
+    iterator begin() { return vEntries.begin(); }
+    iterator end() { return vEntries.end(); }
+    const_iterator begin() const { return vEntries.begin(); }
+    const_iterator end() const { return vEntries.end(); }
+
+    size_t size() const { return vEntries.size(); }
+    bool empty() const { return vEntries.empty(); }
+
+    iterator find(const uint256& key);
+    const_iterator find(const uint256& key) const;
+    size_t count(const uint256& key) const { return find(key) != end() ? 1 : 0; }
+
+    std::pair<iterator, bool> insert(const value_type& value);
+    CBlockIndex*& operator[](const uint256& key) { return insert(value_type(key, NULL)).first->second; }
+
+    void reserve(size_t nEntries);
+    void clear();
+};
+
+#endif // BITCOIN_BLOCKMAP_H
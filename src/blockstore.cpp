@@ -0,0 +1,225 @@
+// Copyright (c) 2017-2019 The Bare developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockstore.h"
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "crypto/common.h"
+#include "main.h"
+#include "streams.h"
+#include "util.h"
+
+#include <string.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+/** Bound on the number of files mapped at once; address space is scarce on 32-bit systems */
+static const unsigned int MAX_MAPPED_FILES = sizeof(void*) > 4 ? 64 : 4;
+
+/** Bytes preceding every stored block: message start and block size */
+static const unsigned int BLOCK_HEADER_SIZE = MESSAGE_START_SIZE + sizeof(unsigned int);
+
+CBlockFileReader blockFileReader;
+
+struct CBlockFileReader::CMappedFile {
+    boost::interprocess::file_mapping mapping;
+    boost::interprocess::mapped_region region;
+    uint64_t nLastUse;
+
+    CMappedFile(const std::string& strPath, size_t nSize) : mapping(strPath.c_str(), boost::interprocess::read_only),
+                                                            region(mapping, boost::interprocess::read_only, 0, nSize),
+                                                            nLastUse(0) {}
+
+    const char* data() const { return static_cast<const char*>(region.get_address()); }
+    size_t size() const { return region.get_size(); }
+};
+
+CBlockFileReader::CBlockFileReader() : nFileUseCounter(0), nCacheBytes(0), nMaxCacheBytes(DEFAULT_BLOCK_CACHE << 20) {}
+
+void CBlockFileReader::SetCacheSize(size_t nBytes)
+{
+    LOCK(cs);
+    nMaxCacheBytes = nBytes;
+    EvictCache();
+}
+
+CBlockFileReader::CMappedFilePtr CBlockFileReader::GetFile(int nFile, uint64_t nMinSize)
+{
+    AssertLockHeld(cs);
+    std::map<int, CMappedFilePtr>::iterator it = mapFiles.find(nFile);
+    if (it != mapFiles.end() && it->second->size() >= nMinSize) {
+        it->second->nLastUse = ++nFileUseCounter;
+        return it->second;
+    }
+
+    // Not mapped yet, or the file has grown since it was mapped. Readers of an
+    // old mapping keep it alive through their own reference.
+    boost::filesystem::path path = GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk");
+    try {
+        uint64_t nSize = boost::filesystem::file_size(path);
+        if (nSize < nMinSize || nSize == 0)
+            return CMappedFilePtr();
+        CMappedFilePtr file(new CMappedFile(path.string(), nSize));
+        file->nLastUse = ++nFileUseCounter;
+        mapFiles[nFile] = file;
+
+        if (mapFiles.size() > MAX_MAPPED_FILES) {
+            std::map<int, CMappedFilePtr>::iterator itOldest = mapFiles.begin();
+            for (it = mapFiles.begin(); it != mapFiles.end(); ++it) {
+                if (it->second->nLastUse < itOldest->second->nLastUse)
+                    itOldest = it;
+            }
+            mapFiles.erase(itOldest);
+        }
+        return file;
+    } catch (const std::exception& e) {
+        LogPrintf("%s : unable to map %s: %s\n", __func__, path.string(), e.what());
+        return CMappedFilePtr();
+    }
+}
+
+bool CBlockFileReader::GetBlockData(const CDiskBlockPos& pos, CBlockData& data)
+{
+    AssertLockHeld(cs);
+    if (pos.IsNull())
+        return false;
+
+    std::map<CacheKey, CacheList::iterator>::iterator it = mapCache.find(CacheKey(pos.nFile, pos.nPos));
+    if (it != mapCache.end()) {
+        listCache.splice(listCache.begin(), listCache, it->second);
+        data.raw = it->second->second;
+        data.pbegin = &(*data.raw)[0];
+        data.pend = data.pbegin + data.raw->size();
+        return true;
+    }
+
+    if (pos.nPos < BLOCK_HEADER_SIZE)
+        return error("%s : invalid block position %d:%u", __func__, pos.nFile, pos.nPos);
+    CMappedFilePtr file = GetFile(pos.nFile, pos.nPos);
+    if (!file)
+        return error("%s : unable to open block file %d", __func__, pos.nFile);
+
+    const unsigned char* pchHeader = (const unsigned char*)file->data() + pos.nPos - BLOCK_HEADER_SIZE;
+    if (memcmp(pchHeader, Params().MessageStart(), MESSAGE_START_SIZE) != 0)
+        return error("%s : no message start at %d:%u", __func__, pos.nFile, pos.nPos);
+    unsigned int nSize = ReadLE32(pchHeader + MESSAGE_START_SIZE);
+    if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+        return error("%s : invalid block size %u at %d:%u", __func__, nSize, pos.nFile, pos.nPos);
+    if ((uint64_t)pos.nPos + nSize > file->size()) {
+        file = GetFile(pos.nFile, (uint64_t)pos.nPos + nSize);
+        if (!file)
+            return error("%s : block at %d:%u exceeds its file", __func__, pos.nFile, pos.nPos);
+    }
+
+    data.file = file;
+    data.pbegin = file->data() + pos.nPos;
+    data.pend = data.pbegin + nSize;
+    return true;
+}
+
+void CBlockFileReader::EvictCache()
+{
+    AssertLockHeld(cs);
+    while (nCacheBytes > nMaxCacheBytes && !listCache.empty()) {
+        nCacheBytes -= listCache.back().second->size();
+        mapCache.erase(listCache.back().first);
+        listCache.pop_back();
+    }
+}
+
+bool CBlockFileReader::ReadRawBlock(const CDiskBlockPos& pos, CRawBlock& raw, bool& fCached)
+{
+    CBlockData data;
+    {
+        LOCK(cs);
+        if (!GetBlockData(pos, data))
+            return false;
+    }
+
+    fCached = (data.raw != NULL);
+    if (fCached)
+        raw = data.raw;
+    else
+        raw.reset(new std::vector<char>(data.pbegin, data.pend));
+    return true;
+}
+
+void CBlockFileReader::CacheRawBlock(const CDiskBlockPos& pos, const CRawBlock& raw)
+{
+    LOCK(cs);
+    if (raw->size() > nMaxCacheBytes)
+        return;
+    CacheKey key(pos.nFile, pos.nPos);
+    if (mapCache.count(key))
+        return;
+    listCache.push_front(std::make_pair(key, raw));
+    mapCache.insert(std::make_pair(key, listCache.begin()));
+    nCacheBytes += raw->size();
+    EvictCache();
+}
+
+bool CBlockFileReader::ReadBlockHeader(const CDiskBlockPos& pos, CBlockHeader& header)
+{
+    CBlockData data;
+    {
+        LOCK(cs);
+        if (!GetBlockData(pos, data))
+            return false;
+    }
+
+    try {
+        CMemoryReader reader(data.pbegin, data.pend, SER_DISK, CLIENT_VERSION);
+        reader >> header;
+    } catch (const std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    return true;
+}
+
+bool CBlockFileReader::ReadTransaction(const CDiskTxPos& pos, CBlockHeader& header, CTransaction& tx)
+{
+    CBlockData data;
+    {
+        LOCK(cs);
+        if (!GetBlockData(pos, data))
+            return false;
+    }
+
+    try {
+        CMemoryReader reader(data.pbegin, data.pend, SER_DISK, CLIENT_VERSION);
+        reader >> header;
+        reader.ignore(pos.nTxOffset);
+        reader >> tx;
+    } catch (const std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    return true;
+}
+
+void CBlockFileReader::CloseFile(int nFile)
+{
+    LOCK(cs);
+    mapFiles.erase(nFile);
+    for (CacheList::iterator it = listCache.begin(); it != listCache.end();) {
+        if (it->first.first == nFile) {
+            nCacheBytes -= it->second->size();
+            mapCache.erase(it->first);
+            it = listCache.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void CBlockFileReader::Clear()
+{
+    LOCK(cs);
+    mapFiles.clear();
+    listCache.clear();
+    mapCache.clear();
+    nCacheBytes = 0;
+}
@@ -0,0 +1,100 @@
+// Copyright (c) 2017-2019 The Bare developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKSTORE_H
+#define BITCOIN_BLOCKSTORE_H
+
+#include "chain.h"
+#include "sync.h"
+
+#include <list>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+class CTransaction;
+struct CDiskTxPos;
+
+//! -blockcache default (MiB)
+static const int64_t DEFAULT_BLOCK_CACHE = 16;
+
+/** Serialized block as stored on disk, shared between the cache and its readers */
+typedef boost::shared_ptr<const std::vector<char> > CRawBlock;
+
+/**
+ * Read-only access to the blk?????.dat files.
+ *
+ * Block files are memory-mapped on first use, so reading a stored block does
+ * not need any file system calls once its file is mapped. Recently used
+ * blocks are additionally kept as raw bytes in a size-bounded LRU cache.
+ * Callers that only need the header or a single transaction can read it in
+ * place without deserializing the rest of the block.
+ *
+ * Positions are CDiskBlockPos values as stored in the block index, i.e. they
+ * point directly behind the message start and size that precede every block.
+ */
+class CBlockFileReader
+{
+private:
+    struct CMappedFile;
+    typedef boost::shared_ptr<CMappedFile> CMappedFilePtr;
+
+    /** A stored block, pointing either into a mapped file or into the cache */
+    struct CBlockData {
+        CMappedFilePtr file;
+        CRawBlock raw;
+        const char* pbegin;
+        const char* pend;
+    };
+
+    typedef std::pair<int, unsigned int> CacheKey;
+    typedef std::list<std::pair<CacheKey, CRawBlock> > CacheList;
+
+    mutable CCriticalSection cs;
+    std::map<int, CMappedFilePtr> mapFiles;
+    uint64_t nFileUseCounter;
+    //! most recently used raw blocks first
+    CacheList listCache;
+    std::map<CacheKey, CacheList::iterator> mapCache;
+    size_t nCacheBytes;
+    size_t nMaxCacheBytes;
+
+    CMappedFilePtr GetFile(int nFile, uint64_t nMinSize);
+    bool GetBlockData(const CDiskBlockPos& pos, CBlockData& data);
+    void EvictCache();
+
+public:
+    CBlockFileReader();
+
+    //! Set the byte budget of the raw block cache; 0 disables it
+    void SetCacheSize(size_t nBytes);
+
+    /**
+     * Return the serialized block stored at pos. Only the message start and
+     * the stored length are verified. fCached is set when the block came from
+     * the cache, which only holds blocks passed to CacheRawBlock.
+     */
+    bool ReadRawBlock(const CDiskBlockPos& pos, CRawBlock& raw, bool& fCached);
+
+    //! Keep a block that was read and checked by the caller in the cache
+    void CacheRawBlock(const CDiskBlockPos& pos, const CRawBlock& raw);
+
+    //! Deserialize only the header of the block stored at pos
+    bool ReadBlockHeader(const CDiskBlockPos& pos, CBlockHeader& header);
+
+    //! Deserialize the header and one transaction of a block through a transaction index entry
+    bool ReadTransaction(const CDiskTxPos& pos, CBlockHeader& header, CTransaction& tx);
+
+    //! Forget the mapping and cached blocks of a file that is going to be truncated or removed
+    void CloseFile(int nFile);
+
+    //! Unmap all files and empty the cache
+    void Clear();
+};
+
+extern CBlockFileReader blockFileReader;
+
+#endif // BITCOIN_BLOCKSTORE_H
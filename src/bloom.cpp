@@ -4,14 +4,20 @@
 
 #include "bloom.h"
 
+#include "crypto/common.h"
 #include "hash.h"
 #include "primitives/transaction.h"
+#include "protocol.h"
+#include "random.h"
 #include "script/script.h"
 #include "script/standard.h"
 #include "streams.h"
 
+#include <algorithm>
+#include <limits>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <boost/foreach.hpp>
 
@@ -188,3 +194,136 @@ void CBloomFilter::UpdateEmptyFull()
     isFull = full;
     isEmpty = empty;
 }
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double fpRate)
+{
+    double logFpRate = log(fpRate);
+    /* The optimal number of hash functions is log(fpRate) / log(0.5), but
+     * restrict it to the range 1-50. */
+    nHashFuncs = std::max(1, std::min((int)round(logFpRate / log(0.5)), 50));
+    /* In this rolling bloom filter, we'll store between 2 and 3 generations of nElements / 2 entries. */
+    nEntriesPerGeneration = (nElements + 1) / 2;
+    uint32_t nMaxElements = nEntriesPerGeneration * 3;
+    /* The maximum fpRate = pow(1.0 - exp(-nHashFuncs * nMaxElements / nFilterBits), nHashFuncs)
+     * =>          pow(fpRate, 1.0 / nHashFuncs) = 1.0 - exp(-nHashFuncs * nMaxElements / nFilterBits)
+     * =>          1.0 - pow(fpRate, 1.0 / nHashFuncs) = exp(-nHashFuncs * nMaxElements / nFilterBits)
+     * =>          log(1.0 - pow(fpRate, 1.0 / nHashFuncs)) = -nHashFuncs * nMaxElements / nFilterBits
+     * =>          nFilterBits = -nHashFuncs * nMaxElements / log(1.0 - pow(fpRate, 1.0 / nHashFuncs))
+     * =>          nFilterBits = -nHashFuncs * nMaxElements / log(1.0 - exp(logFpRate / nHashFuncs))
+     */
+    uint32_t nFilterBits = (uint32_t)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(logFpRate / nHashFuncs)));
+    data.clear();
+    /* For each data element we need to store 2 bits. If both bits are 0, the
+     * bit is treated as unset. If the bits are (01), (10), or (11), the bit is
+     * treated as set in generation 1, 2, or 3 respectively.
+     * These bits are stored in separate integers: position P corresponds to bit
+     * (P & 63) of the integers data[(P >> 6) * 2] and data[(P >> 6) * 2 + 1]. */
+    data.resize(((nFilterBits + 63) / 64) << 1);
+    reset();
+}
+
+/* Similar to CBloomFilter::Hash, but the per-function hashes come from two
+ * MurmurHash3 values (h1 + n * h2), which keeps lookups cheap at the low
+ * false-positive rates the peer filters use. */
+static inline void RollingBloomHashes(unsigned int nTweak, const unsigned char* pch, size_t nLen, uint32_t& h1, uint32_t& h2)
+{
+    h1 = MurmurHash3(nTweak, pch, nLen);
+    // An odd step visits distinct positions for every hash function
+    h2 = MurmurHash3(nTweak ^ 0xFBA4C795, pch, nLen) | 1;
+}
+
+void CRollingBloomFilter::insert(const unsigned char* pch, size_t nLen)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration) {
+        nEntriesThisGeneration = 0;
+        nGeneration++;
+        if (nGeneration == 4) {
+            nGeneration = 1;
+        }
+        uint64_t nGenerationMask1 = 0 - (uint64_t)(nGeneration & 1);
+        uint64_t nGenerationMask2 = 0 - (uint64_t)(nGeneration >> 1);
+        /* Wipe old entries that used this generation number. */
+        for (uint32_t p = 0; p < data.size(); p += 2) {
+            uint64_t p1 = data[p], p2 = data[p + 1];
+            uint64_t mask = (p1 ^ nGenerationMask1) | (p2 ^ nGenerationMask2);
+            data[p] = p1 & mask;
+            data[p + 1] = p2 & mask;
+        }
+    }
+    nEntriesThisGeneration++;
+
+    uint32_t h1, h2;
+    RollingBloomHashes(nTweak, pch, nLen, h1, h2);
+    for (int n = 0; n < nHashFuncs; n++) {
+        uint32_t h = h1 + n * h2;
+        int bit = h & 0x3F;
+        uint32_t pos = (h >> 6) % (data.size() / 2);
+        data[pos << 1] = (data[pos << 1] & ~(((uint64_t)1) << bit)) | ((uint64_t)(nGeneration & 1)) << bit;
+        data[(pos << 1) | 1] = (data[(pos << 1) | 1] & ~(((uint64_t)1) << bit)) | ((uint64_t)(nGeneration >> 1)) << bit;
+    }
+}
+
+bool CRollingBloomFilter::contains(const unsigned char* pch, size_t nLen) const
+{
+    uint32_t h1, h2;
+    RollingBloomHashes(nTweak, pch, nLen, h1, h2);
+    for (int n = 0; n < nHashFuncs; n++) {
+        uint32_t h = h1 + n * h2;
+        int bit = h & 0x3F;
+        uint32_t pos = (h >> 6) % (data.size() / 2);
+        /* If the relevant bit is not set in either data[pos << 1] or data[(pos << 1) | 1], the filter does not contain vKey */
+        if (!(((data[pos << 1] | data[(pos << 1) | 1]) >> bit) & 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void CRollingBloomFilter::insert(const std::vector<unsigned char>& vKey)
+{
+    insert(vKey.empty() ? NULL : &vKey[0], vKey.size());
+}
+
+void CRollingBloomFilter::insert(const uint256& hash)
+{
+    insert(hash.begin(), hash.size());
+}
+
+/** Inventory is keyed by type and hash, as some types share the hash of a transaction */
+static inline void InvKey(const CInv& inv, unsigned char (&pch)[4 + 32])
+{
+    WriteLE32(pch, (uint32_t)inv.type);
+    memcpy(pch + 4, inv.hash.begin(), 32);
+}
+
+void CRollingBloomFilter::insert(const CInv& inv)
+{
+    unsigned char pch[4 + 32];
+    InvKey(inv, pch);
+    insert(pch, sizeof(pch));
+}
+
+bool CRollingBloomFilter::contains(const std::vector<unsigned char>& vKey) const
+{
+    return contains(vKey.empty() ? NULL : &vKey[0], vKey.size());
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    return contains(hash.begin(), hash.size());
+}
+
+bool CRollingBloomFilter::contains(const CInv& inv) const
+{
+    unsigned char pch[4 + 32];
+    InvKey(inv, pch);
+    return contains(pch, sizeof(pch));
+}
+
+void CRollingBloomFilter::reset()
+{
+    nTweak = GetRand(std::numeric_limits<unsigned int>::max());
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    std::fill(data.begin(), data.end(), 0);
+}
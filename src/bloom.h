@@ -9,6 +9,7 @@
 
 #include <vector>
 
+class CInv;
 class COutPoint;
 class CTransaction;
 class uint256;
@@ -97,4 +98,46 @@ public:
     void UpdateEmptyFull();
 };
 
+/**
+ * RollingBloomFilter is a probabilistic "keep track of most recently inserted" set.
+ * Construct it with the number of elements to keep track of, and a false-positive
+ * rate. Unlike CBloomFilter, it never fills up: elements are kept in generations
+ * of nElements / 2 each, and once a third generation is started the oldest one
+ * is wiped. contains(item) will always return true if item was one of the last
+ * nElements items inserted, and may return true for items inserted before that.
+ *
+ * Every entry of the filter is a 2-bit generation number, 0 meaning unset. The
+ * nHashFuncs positions of an item are derived from two MurmurHash3 values, so a
+ * lookup hashes the key twice whatever the false-positive rate.
+ *
+ * It needs around 1.8 bytes per element per factor 0.1 of false positive rate.
+ * (More accurately: 3/(log(256)*log(2)) * log(1/fpRate) * nElements bytes)
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const std::vector<unsigned char>& vKey);
+    void insert(const uint256& hash);
+    void insert(const CInv& inv);
+    bool contains(const std::vector<unsigned char>& vKey) const;
+    bool contains(const uint256& hash) const;
+    bool contains(const CInv& inv) const;
+
+    //! Forget everything, and hash with a new random tweak from now on
+    void reset();
+
+private:
+    int nEntriesPerGeneration;
+    int nEntriesThisGeneration;
+    int nGeneration;
+    std::vector<uint64_t> data;
+    unsigned int nTweak;
+    int nHashFuncs;
+
+    void insert(const unsigned char* pch, size_t nLen);
+    bool contains(const unsigned char* pch, size_t nLen) const;
+};
+
 #endif // BITCOIN_BLOOM_H
@@ -98,55 +98,51 @@ enum BlockStatus {
     BLOCK_FAILED_MASK = BLOCK_FAILED_VALID | BLOCK_FAILED_CHILD,
 };
 
+/**
+ * Block index fields that are rarely needed once a block is connected: the
+ * stake it was minted from and the coin supply accounting. They are kept out
+ * of CBlockIndex and loaded from the block tree database on demand.
+ */
+struct CBlockIndexCold {
+    int64_t nMint;
+    int64_t nMoneySupply;
+    COutPoint prevoutStake;
+    unsigned int nStakeTime;
+
+    CBlockIndexCold() : nMint(0), nMoneySupply(0), nStakeTime(0) {}
+};
+
 /** The block chain is a tree shaped structure starting with the
  * genesis block at the root, with each block potentially having multiple
  * candidates to be the next block. A blockindex may have multiple pprev pointing
  * to it, but at most one of them can be part of the currently active branch.
+ *
+ * The fields needed for chain traversal and work comparison come first so that
+ * they share a cache line.
  */
 class CBlockIndex
 {
 public:
-    //! pointer to the hash of the block, if any. memory is owned by this CBlockIndex
-    const uint256* phashBlock;
-
     //! pointer to the index of the predecessor of this block
     CBlockIndex* pprev;
 
-    //! pointer to the index of the next block
-    CBlockIndex* pnext;
-
     //! pointer to the index of some further predecessor of this block
     CBlockIndex* pskip;
 
-    //ppcoin: trust score of block chain
-    uint256 bnChainTrust;
-
     //! height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
-    //! Which # file this block is stored in (blk?????.dat)
-    int nFile;
-
-    //! Byte offset within blk?????.dat where this block's data is stored
-    unsigned int nDataPos;
+    //! Verification status of this block. See enum BlockStatus
+    unsigned int nStatus;
 
-    //! Byte offset within rev?????.dat where this block's undo data is stored
-    unsigned int nUndoPos;
+    unsigned int nTime;
+    unsigned int nBits;
 
     //! (memory only) Total amount of work (expected number of hashes) in the chain up to and including this block
     uint256 nChainWork;
 
-    //! Number of transactions in this block.
-    //! Note: in a potential headers-first mode, this number cannot be relied upon
-    unsigned int nTx;
-
-    //! (memory only) Number of transactions in the chain up to and including this block.
-    //! This value will be non-zero only if and only if transactions for this block and all its parents are available.
-    //! Change to 64-bit type when necessary; won't happen before 2030
-    unsigned int nChainTx;
-
-    //! Verification status of this block. See enum BlockStatus
-    unsigned int nStatus;
+    //! pointer to the hash of the block, if any. memory is owned by this CBlockIndex
+    const uint256* phashBlock;
 
     unsigned int nFlags; // ppcoin: block index flags
     enum {
@@ -157,20 +153,31 @@ public:
 
     // proof-of-stake specific fields
     uint256 GetBlockTrust() const;
-    uint64_t nStakeModifier;             // hash modifier for proof-of-stake
     unsigned int nStakeModifierChecksum; // checksum of index; in-memeory only
-    COutPoint prevoutStake;
-    unsigned int nStakeTime;
-    uint256 hashProofOfStake;
-    int64_t nMint;
-    int64_t nMoneySupply;
+    uint64_t nStakeModifier;             // hash modifier for proof-of-stake
+
+    //! Number of transactions in this block.
+    //! Note: in a potential headers-first mode, this number cannot be relied upon
+    unsigned int nTx;
+
+    //! (memory only) Number of transactions in the chain up to and including this block.
+    //! This value will be non-zero only if and only if transactions for this block and all its parents are available.
+    //! Change to 64-bit type when necessary; won't happen before 2030
+    unsigned int nChainTx;
+
+    //! Which # file this block is stored in (blk?????.dat)
+    int nFile;
+
+    //! Byte offset within blk?????.dat where this block's data is stored
+    unsigned int nDataPos;
+
+    //! Byte offset within rev?????.dat where this block's undo data is stored
+    unsigned int nUndoPos;
 
     //! block header
     int nVersion;
-    uint256 hashMerkleRoot;
-    unsigned int nTime;
-    unsigned int nBits;
     unsigned int nNonce;
+    uint256 hashMerkleRoot;
 
     //! (memory only) Sequential id assigned to distinguish order in which blocks are received.
     uint32_t nSequenceId;
@@ -190,13 +197,9 @@ public:
         nStatus = 0;
         nSequenceId = 0;
 
-        nMint = 0;
-        nMoneySupply = 0;
         nFlags = 0;
         nStakeModifier = 0;
         nStakeModifierChecksum = 0;
-        prevoutStake.SetNull();
-        nStakeTime = 0;
 
         nVersion = 0;
         hashMerkleRoot = uint256();
@@ -220,23 +223,8 @@ public:
         nBits = block.nBits;
         nNonce = block.nNonce;
 
-        //Proof of Stake
-        bnChainTrust = uint256();
-        nMint = 0;
-        nMoneySupply = 0;
-        nFlags = 0;
-        nStakeModifier = 0;
-        nStakeModifierChecksum = 0;
-        hashProofOfStake = uint256();
-
-        if (block.IsProofOfStake()) {
+        if (block.IsProofOfStake())
             SetProofOfStake();
-            prevoutStake = block.vtx[1].vin[0].prevout;
-            nStakeTime = block.nTime;
-        } else {
-            prevoutStake.SetNull();
-            nStakeTime = 0;
-        }
     }
 
     CDiskBlockPos GetBlockPos() const
@@ -395,15 +383,37 @@ public:
     uint256 hashPrev;
     uint256 hashNext;
 
+    int64_t nMint;
+    int64_t nMoneySupply;
+    COutPoint prevoutStake;
+    unsigned int nStakeTime;
+
     CDiskBlockIndex()
     {
         hashPrev = uint256();
         hashNext = uint256();
+        nMint = 0;
+        nMoneySupply = 0;
+        nStakeTime = 0;
     }
 
-    explicit CDiskBlockIndex(CBlockIndex* pindex) : CBlockIndex(*pindex)
+    CDiskBlockIndex(const CBlockIndex* pindex, const CBlockIndexCold& cold) : CBlockIndex(*pindex)
     {
         hashPrev = (pprev ? pprev->GetBlockHash() : uint256());
+        nMint = cold.nMint;
+        nMoneySupply = cold.nMoneySupply;
+        prevoutStake = cold.prevoutStake;
+        nStakeTime = cold.nStakeTime;
+    }
+
+    CBlockIndexCold GetCold() const
+    {
+        CBlockIndexCold cold;
+        cold.nMint = nMint;
+        cold.nMoneySupply = nMoneySupply;
+        cold.prevoutStake = prevoutStake;
+        cold.nStakeTime = nStakeTime;
+        return cold;
     }
 
     ADD_SERIALIZE_METHODS;
@@ -435,7 +445,6 @@ public:
         } else {
             const_cast<CDiskBlockIndex*>(this)->prevoutStake.SetNull();
             const_cast<CDiskBlockIndex*>(this)->nStakeTime = 0;
-            const_cast<CDiskBlockIndex*>(this)->hashProofOfStake = uint256();
         }
 
         // block header
@@ -6,9 +6,12 @@
 #define BITCOIN_CHECKQUEUE_H
 
 #include <algorithm>
+#include <deque>
+#include <stdint.h>
 #include <vector>
 
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
@@ -16,21 +19,40 @@
 template <typename T>
 class CCheckQueueControl;
 
-/** 
+/**
  * Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
-  * operator(), returning a bool.
+  * operator(), returning a bool, and a swap().
   *
   * One thread (the master) is assumed to push batches of verifications
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every worker has a queue of its own, guarded by its own lock, which the
+  * master spreads added verifications over. Workers take batches from the
+  * back of their own queue, and steal from the front of the others when
+  * it runs out, so the shared lock is only taken once per batch to account
+  * for it. Batches are half of what is left in a queue, up to nBatchSize,
+  * so they shrink as the work runs out. Once a verification fails all
+  * queued ones are dropped, and the first one that failed is kept for the
+  * master to inspect.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
-    //! Mutex to protect the inner state
+    //! Verifications queued for one worker
+    struct WorkerQueue {
+        boost::mutex mutex;
+        std::deque<T> checks;
+    };
+
+    //! The queues of the workers, the master's first. Fixed after construction;
+    //! when there are more workers than queues, workers share one.
+    std::vector<boost::shared_ptr<WorkerQueue> > vQueues;
+
+    //! Mutex to protect the state below
     boost::mutex mutex;
 
     //! Worker threads block on this when out of work
@@ -39,121 +61,200 @@ private:
     //! Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
-
-    //! The number of workers (including the master) that are idle.
-    int nIdle;
-
-    //! The total number of workers (including the master).
-    int nTotal;
+    //! The number of worker threads, excluding the master.
+    unsigned int nWorkers;
 
     //! The temporary evaluation result.
     bool fAllOk;
 
+    //! The first verification that failed in the current round
+    T checkFailed;
+
     /**
      * Number of verifications that haven't completed yet.
-     * This includes elements that are not anymore in queue, but still in
+     * This includes elements that are not anymore in a queue, but still in
      * worker's own batches.
      */
     unsigned int nTodo;
 
-    //! Whether we're shutting down.
-    bool fQuit;
+    //! Incremented whenever verifications are added, so idle workers can tell they missed none
+    uint64_t nGeneration;
+
+    //! The queue the next added verifications start at
+    size_t nNextQueue;
 
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    /**
+     * Move a batch from a queue into vChecks: from its back when it is the
+     * worker's own queue, from its front when stealing. Returns the batch size.
+     */
+    unsigned int Take(WorkerQueue& queue, std::vector<T>& vChecks, bool fSteal)
+    {
+        boost::unique_lock<boost::mutex> lock(queue.mutex);
+        if (queue.checks.empty())
+            return 0;
+        // Leave half of the queue, so its owner and thieves finish at about the same time.
+        unsigned int nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.checks.size() / 2));
+        vChecks.resize(nNow);
+        for (unsigned int i = 0; i < nNow; i++) {
+            if (fSteal) {
+                vChecks[i].swap(queue.checks.front());
+                queue.checks.pop_front();
+            } else {
+                vChecks[i].swap(queue.checks.back());
+                queue.checks.pop_back();
+            }
+        }
+        return nNow;
+    }
+
+    //! Drop all queued verifications after one failed. Returns how many were dropped.
+    unsigned int Drain()
+    {
+        // Lock order: the queue locks are taken with mutex held, never the other way around
+        unsigned int nDropped = 0;
+        BOOST_FOREACH (boost::shared_ptr<WorkerQueue>& queue, vQueues) {
+            boost::unique_lock<boost::mutex> lock(queue->mutex);
+            nDropped += queue->checks.size();
+            queue->checks.clear();
+        }
+        return nDropped;
+    }
+
     /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    bool Loop(size_t nQueue, bool fMaster = false, T* pcheckFailed = NULL)
     {
-        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
         unsigned int nNow = 0;
         bool fOk = true;
+        T checkFailedBatch;
         do {
+            uint64_t nGenerationSeen;
             {
                 boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
+                // account for the batch of the previous loop run
                 if (nNow) {
+                    if (!fOk && fAllOk)
+                        checkFailed.swap(checkFailedBatch);
                     fAllOk &= fOk;
                     nTodo -= nNow;
                     if (nTodo == 0 && !fMaster)
                         // We processed the last element; inform the master he can exit and return the result
                         condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
+                    nNow = 0;
                 }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
+                // A verification failed: the others need not run. This is done under
+                // the lock, so the master cannot start the next round meanwhile.
+                if (!fAllOk) {
+                    nTodo -= Drain();
+                    if (nTodo == 0 && !fMaster)
+                        condMaster.notify_one();
                 }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
+                nGenerationSeen = nGeneration;
+            }
+
+            // Take a batch from the own queue, or steal one
+            nNow = Take(*vQueues[nQueue], vChecks, false);
+            for (size_t i = 1; nNow == 0 && i < vQueues.size(); i++)
+                nNow = Take(*vQueues[(nQueue + i) % vQueues.size()], vChecks, true);
+            if (nNow) {
+                // execute work
+                fOk = true;
+                for (unsigned int i = 0; i < nNow && fOk; i++) {
+                    fOk = vChecks[i]();
+                    if (!fOk)
+                        checkFailedBatch.swap(vChecks[i]);
                 }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+                vChecks.clear();
+                continue;
+            }
+
+            // Nothing is queued: wait for more work, or for the batches still in progress
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (fMaster) {
+                while (nTodo != 0)
+                    condMaster.wait(lock);
+                bool fRet = fAllOk;
+                // reset the status for new work later
+                fAllOk = true;
+                T checkNone;
+                if (pcheckFailed)
+                    pcheckFailed->swap(checkFailed);
+                checkFailed.swap(checkNone);
+                // return the current status
+                return fRet;
             }
-            // execute work
-            BOOST_FOREACH (T& check, vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
+            while (nGeneration == nGenerationSeen)
+                condWorker.wait(lock);
         } while (true);
     }
 
 public:
-    //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    //! Create a new check queue, with queues for up to nMaxWorkers threads including the master
+    CCheckQueue(unsigned int nBatchSizeIn, unsigned int nMaxWorkers = 16) : nWorkers(0), fAllOk(true), nTodo(0), nGeneration(0), nNextQueue(0), nBatchSize(nBatchSizeIn)
+    {
+        for (unsigned int i = 0; i < std::max(1U, nMaxWorkers); i++)
+            vQueues.push_back(boost::shared_ptr<WorkerQueue>(new WorkerQueue()));
+    }
 
     //! Worker thread
     void Thread()
     {
-        Loop();
+        size_t nQueue = 0;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (vQueues.size() > 1)
+                nQueue = 1 + nWorkers % (vQueues.size() - 1);
+            nWorkers++;
+        }
+        Loop(nQueue);
     }
 
     //! Wait until execution finishes, and return whether all evaluations where successful.
-    bool Wait()
+    //! If not, the first verification that failed is swapped into pcheckFailed.
+    bool Wait(T* pcheckFailed = NULL)
     {
-        return Loop(true);
+        return Loop(0, true, pcheckFailed);
     }
 
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
+        if (vChecks.empty())
+            return;
+        size_t nQueues, nFirst;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            // The outcome is known once a verification failed
+            if (!fAllOk)
+                return;
+            nTodo += vChecks.size();
+            nQueues = std::min(vQueues.size(), (size_t)nWorkers + 1);
+            nFirst = nNextQueue;
+        }
+
+        // Spread the checks in runs over the queues of the workers, starting
+        // where the previous batch ended.
+        size_t nRun = (vChecks.size() + nQueues - 1) / nQueues;
+        size_t nRuns = 0;
+        for (size_t nStart = 0; nStart < vChecks.size(); nStart += nRun, nRuns++) {
+            WorkerQueue& queue = *vQueues[(nFirst + nRuns) % nQueues];
+            boost::unique_lock<boost::mutex> lock(queue.mutex);
+            for (size_t i = nStart; i < std::min(nStart + nRun, vChecks.size()); i++) {
+                queue.checks.push_back(T());
+                vChecks[i].swap(queue.checks.back());
+            }
         }
-        nTodo += vChecks.size();
-        if (vChecks.size() == 1)
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nNextQueue = (nFirst + nRuns) % nQueues;
+        nGeneration++;
+        if (nRuns == 1)
             condWorker.notify_one();
-        else if (vChecks.size() > 1)
+        else
             condWorker.notify_all();
     }
 
@@ -164,7 +265,7 @@ public:
     bool IsIdle()
     {
         boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
+        return (nTodo == 0 && fAllOk == true);
     }
 };
 
@@ -189,11 +290,11 @@ public:
         }
     }
 
-    bool Wait()
+    bool Wait(T* pcheckFailed = NULL)
     {
         if (pqueue == NULL)
             return true;
-        bool fRet = pqueue->Wait();
+        bool fRet = pqueue->Wait(pcheckFailed);
         fDone = true;
         return fRet;
     }
@@ -4,6 +4,7 @@
 
 #include "coins.h"
 
+#include "hash.h"
 #include "random.h"
 
 #include <assert.h>
@@ -57,12 +58,66 @@ bool CCoins::Spend(int nPos)
     return Spend(out, undo);
 }
 
+/** The set element committed to for one unspent output */
+static uint256 GetCoinCommitmentKey(const COutPoint& out, const CTxOut& txout, int nHeight, bool fCoinBase)
+{
+    uint32_t nCode = nHeight * 2 + (fCoinBase ? 1 : 0);
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << out;
+    ss << VARINT(nCode);
+    ss << txout;
+    return ss.GetHash();
+}
+
+/** Size of one output in the bogosize metric: txid, index, height/coinbase, amount, script length and script */
+static uint64_t GetCoinBogoSize(const CTxOut& txout)
+{
+    return 32 + 4 + 4 + 8 + 2 + txout.scriptPubKey.size();
+}
+
+void CCoinsCommitment::AddCoin(const COutPoint& out, const CTxOut& txout, int nHeight, bool fCoinBase)
+{
+    muhash.Insert(GetCoinCommitmentKey(out, txout, nHeight, fCoinBase));
+    nTransactionOutputs++;
+    nBogoSize += GetCoinBogoSize(txout);
+    nTotalAmount += txout.nValue;
+}
+
+void CCoinsCommitment::RemoveCoin(const COutPoint& out, const CTxOut& txout, int nHeight, bool fCoinBase)
+{
+    muhash.Remove(GetCoinCommitmentKey(out, txout, nHeight, fCoinBase));
+    nTransactionOutputs--;
+    nBogoSize -= GetCoinBogoSize(txout);
+    nTotalAmount -= txout.nValue;
+}
+
+CCoinsCommitment& CCoinsCommitment::operator+=(const CCoinsCommitment& delta)
+{
+    muhash *= delta.muhash;
+    nTransactions += delta.nTransactions;
+    nTransactionOutputs += delta.nTransactionOutputs;
+    nBogoSize += delta.nBogoSize;
+    nTotalAmount += delta.nTotalAmount;
+    return *this;
+}
+
+void CCoinsCommitment::GetStats(CCoinsStats& stats) const
+{
+    stats.nTransactions = nTransactions;
+    stats.nTransactionOutputs = nTransactionOutputs;
+    stats.nBogoSize = nBogoSize;
+    stats.hashMuHash = muhash.Finalize();
+    stats.nTotalAmount = nTotalAmount;
+}
+
 
 bool CCoinsView::GetCoins(const uint256& txid, CCoins& coins) const { return false; }
 bool CCoinsView::HaveCoins(const uint256& txid) const { return false; }
 uint256 CCoinsView::GetBestBlock() const { return uint256(0); }
 bool CCoinsView::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) { return false; }
 bool CCoinsView::GetStats(CCoinsStats& stats) const { return false; }
+bool CCoinsView::GetCommitment(CCoinsCommitment& commitment) const { return false; }
+void CCoinsView::SetCommitment(const CCoinsCommitment& commitment) {}
 
 
 CCoinsViewBacked::CCoinsViewBacked(CCoinsView* viewIn) : base(viewIn) {}
@@ -72,10 +127,12 @@ uint256 CCoinsViewBacked::GetBestBlock() const { return base->GetBestBlock(); }
 void CCoinsViewBacked::SetBackend(CCoinsView& viewIn) { base = &viewIn; }
 bool CCoinsViewBacked::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) { return base->BatchWrite(mapCoins, hashBlock); }
 bool CCoinsViewBacked::GetStats(CCoinsStats& stats) const { return base->GetStats(stats); }
+bool CCoinsViewBacked::GetCommitment(CCoinsCommitment& commitment) const { return base->GetCommitment(commitment); }
+void CCoinsViewBacked::SetCommitment(const CCoinsCommitment& commitment) { base->SetCommitment(commitment); }
 
 CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView* baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), hashBlock(0) {}
+CCoinsViewCache::CCoinsViewCache(CCoinsView* baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), hashBlock(0), fHaveCommitment(false) {}
 
 CCoinsViewCache::~CCoinsViewCache()
 {
@@ -198,8 +255,44 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn
     return true;
 }
 
+bool CCoinsViewCache::GetCommitment(CCoinsCommitment& commitmentOut) const
+{
+    if (!fHaveCommitment)
+        fHaveCommitment = base->GetCommitment(commitment);
+    if (fHaveCommitment)
+        commitmentOut = commitment;
+    return fHaveCommitment;
+}
+
+void CCoinsViewCache::SetCommitment(const CCoinsCommitment& commitmentIn)
+{
+    commitment = commitmentIn;
+    fHaveCommitment = true;
+}
+
+CCoinsCommitment* CCoinsViewCache::ModifyCommitment()
+{
+    if (!fHaveCommitment)
+        fHaveCommitment = base->GetCommitment(commitment);
+    return fHaveCommitment ? &commitment : NULL;
+}
+
+bool CCoinsViewCache::GetStats(CCoinsStats& stats) const
+{
+    // Without a running commitment the base view has to compute the statistics,
+    // which only reflects changes that were already flushed to it.
+    CCoinsCommitment current;
+    if (!GetCommitment(current))
+        return base->GetStats(stats);
+    stats.hashBlock = GetBestBlock();
+    current.GetStats(stats);
+    return true;
+}
+
 bool CCoinsViewCache::Flush()
 {
+    if (fHaveCommitment)
+        base->SetCommitment(commitment);
     bool fOk = base->BatchWrite(cacheCoins, hashBlock);
     cacheCoins.clear();
     return fOk;
@@ -7,6 +7,7 @@
 #define BITCOIN_COINS_H
 
 #include "compressor.h"
+#include "muhash.h"
 #include "script/standard.h"
 #include "serialize.h"
 #include "uint256.h"
@@ -322,11 +323,58 @@ struct CCoinsStats {
     uint256 hashBlock;
     uint64_t nTransactions;
     uint64_t nTransactionOutputs;
-    uint64_t nSerializedSize;
-    uint256 hashSerialized;
+    uint64_t nBogoSize;
+    uint256 hashMuHash;
     CAmount nTotalAmount;
 
-    CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0) {}
+    CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nBogoSize(0), hashMuHash(0), nTotalAmount(0) {}
+};
+
+/**
+ * Running commitment to the unspent transaction output set.
+ *
+ * Every unspent output is an element of a MuHash3072 set hash, and the totals
+ * reported by gettxoutsetinfo are kept next to it. Blocks update it as they
+ * are connected and disconnected, so the statistics never require a scan of
+ * the chainstate. A commitment built on an empty object is a delta that can
+ * be merged with +=; the counters are unsigned and wrap, so removals in a
+ * delta cancel out when merged.
+ */
+class CCoinsCommitment
+{
+public:
+    CMuHash3072 muhash;
+    uint64_t nTransactions;
+    uint64_t nTransactionOutputs;
+    //! database-independent size metric: a fixed per-output overhead plus the script size
+    uint64_t nBogoSize;
+    CAmount nTotalAmount;
+
+    CCoinsCommitment() : nTransactions(0), nTransactionOutputs(0), nBogoSize(0), nTotalAmount(0) {}
+
+    //! add an unspent output to the committed set
+    void AddCoin(const COutPoint& out, const CTxOut& txout, int nHeight, bool fCoinBase);
+
+    //! remove a spent output from the committed set
+    void RemoveCoin(const COutPoint& out, const CTxOut& txout, int nHeight, bool fCoinBase);
+
+    //! merge a delta into this commitment
+    CCoinsCommitment& operator+=(const CCoinsCommitment& delta);
+
+    //! fill in everything but the height and best block of a CCoinsStats
+    void GetStats(CCoinsStats& stats) const;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(muhash);
+        READWRITE(nTransactions);
+        READWRITE(nTransactionOutputs);
+        READWRITE(nBogoSize);
+        READWRITE(nTotalAmount);
+    }
 };
 
 
@@ -351,6 +399,12 @@ public:
     //! Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats& stats) const;
 
+    //! Retrieve the running commitment to the set as of GetBestBlock(), if one is maintained
+    virtual bool GetCommitment(CCoinsCommitment& commitment) const;
+
+    //! Replace the running commitment; it is persisted along with the next BatchWrite
+    virtual void SetCommitment(const CCoinsCommitment& commitment);
+
     //! As we use CCoinsViews polymorphically, have a virtual destructor
     virtual ~CCoinsView() {}
 };
@@ -370,6 +424,8 @@ public:
     void SetBackend(CCoinsView& viewIn);
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
     bool GetStats(CCoinsStats& stats) const;
+    bool GetCommitment(CCoinsCommitment& commitment) const;
+    void SetCommitment(const CCoinsCommitment& commitment);
 };
 
 class CCoinsViewCache;
@@ -420,6 +476,10 @@ protected:
     mutable uint256 hashBlock;
     mutable CCoinsMap cacheCoins;
 
+    /* Running commitment, fetched from the base view on first use. */
+    mutable CCoinsCommitment commitment;
+    mutable bool fHaveCommitment;
+
 public:
     CCoinsViewCache(CCoinsView* baseIn);
     ~CCoinsViewCache();
@@ -430,6 +490,15 @@ public:
     uint256 GetBestBlock() const;
     void SetBestBlock(const uint256& hashBlock);
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
+    bool GetStats(CCoinsStats& stats) const;
+    bool GetCommitment(CCoinsCommitment& commitment) const;
+    void SetCommitment(const CCoinsCommitment& commitment);
+
+    /**
+     * Return a pointer to the running commitment so that block connection
+     * can apply its changes, or NULL if the base view does not maintain one.
+     */
+    CCoinsCommitment* ModifyCommitment();
 
     /**
      * Return a pointer to CCoins in the cache, or NULL if not found. This is
@@ -374,8 +374,17 @@ bool CheckProofOfStake(const CBlock block, uint256& hashProofOfStake)
     // First try finding the previous transaction in database
     uint256 hashBlock;
     CTransaction txPrev;
-    if (!GetTransaction(txin.prevout.hash, txPrev, hashBlock, true))
-        return error("CheckProofOfStake() : INFO: read txPrev failed");
+    if (!GetTransaction(txin.prevout.hash, txPrev, hashBlock, true)) {
+        // The block holding the stake input may have been pruned; the kernel
+        // only needs the output itself, which is still in the UTXO set
+        CTxOut txOutPrev;
+        if (!fPruneMode || !GetUnspentOutput(txin.prevout, txOutPrev, hashBlock))
+            return error("CheckProofOfStake() : INFO: read txPrev failed");
+        CMutableTransaction txPrevOutputs;
+        txPrevOutputs.vout.resize(txin.prevout.n + 1);
+        txPrevOutputs.vout[txin.prevout.n] = txOutPrev;
+        txPrev = CTransaction(txPrevOutputs);
+    }
 
     //verify signature and script
     if (!VerifyScript(txin.scriptSig, txPrev.vout[txin.prevout.n].scriptPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&tx, 0)))
@@ -388,10 +397,8 @@ bool CheckProofOfStake(const CBlock block, uint256& hashProofOfStake)
     else
         return error("CheckProofOfStake() : read block failed");
 
-    // Read block header
-    CBlock blockprev;
-    if (!ReadBlockFromDisk(blockprev, pindex->GetBlockPos()))
-        return error("CheckProofOfStake(): INFO: failed to find block");
+    // Only the header of the block is used, take it from the index
+    CBlock blockprev(pindex->GetBlockHeader());
 
     unsigned int nInterval = 0;
     unsigned int nTime = block.nTime;
@@ -409,14 +416,14 @@ bool CheckCoinStakeTimestamp(int64_t nTimeBlock, int64_t nTimeTx)
 }
 
 // Get stake modifier checksum
-unsigned int GetStakeModifierChecksum(const CBlockIndex* pindex)
+unsigned int GetStakeModifierChecksum(const CBlockIndex* pindex, const uint256& hashProofOfStake)
 {
     assert(pindex->pprev || pindex->GetBlockHash() == Params().HashGenesisBlock());
     // Hash previous checksum with flags, hashProofOfStake and nStakeModifier
     CDataStream ss(SER_GETHASH, 0);
     if (pindex->pprev)
         ss << pindex->pprev->nStakeModifierChecksum;
-    ss << pindex->nFlags << pindex->hashProofOfStake << pindex->nStakeModifier;
+    ss << pindex->nFlags << hashProofOfStake << pindex->nStakeModifier;
     uint256 hashChecksum = Hash(ss.begin(), ss.end());
     hashChecksum >>= (256 - 32);
     return hashChecksum.Get64();
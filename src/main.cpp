@@ -11,6 +11,7 @@
 
 #include "addrman.h"
 #include "alert.h"
+#include "blockstore.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -20,6 +21,8 @@
 #include "masternode-payments.h"
 #include "masternodeman.h"
 #include "merkleblock.h"
+#include "masternode-sync.h"
+#include "msgqueue.h"
 #include "net.h"
 #include "Darksend.h"
 #include "pow.h"
@@ -37,6 +40,8 @@
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace boost;
@@ -54,6 +59,123 @@ CCriticalSection cs_main;
 CCriticalSection cs_mapstake;
 
 BlockMap mapBlockIndex;
+
+/**
+ * Storage for the entries of mapBlockIndex. Entries are carved out of large
+ * chunks instead of being allocated one by one, which keeps them close
+ * together in memory and makes loading the block index much cheaper.
+ */
+class CBlockIndexArena
+{
+private:
+    static const size_t CHUNK_ENTRIES = 4096;
+
+    CCriticalSection cs;
+    std::vector<CBlockIndex*> vChunks;
+    size_t nUsed;
+
+public:
+    CBlockIndexArena() : nUsed(CHUNK_ENTRIES) {}
+
+    CBlockIndex* Allocate()
+    {
+        LOCK(cs);
+        if (nUsed == CHUNK_ENTRIES) {
+            vChunks.push_back(static_cast<CBlockIndex*>(::operator new(CHUNK_ENTRIES * sizeof(CBlockIndex))));
+            nUsed = 0;
+        }
+        return new (vChunks.back() + nUsed++) CBlockIndex();
+    }
+
+    //! Release all entries; none of them may be referenced anymore
+    void Clear()
+    {
+        LOCK(cs);
+        BOOST_FOREACH (CBlockIndex* pchunk, vChunks)
+            ::operator delete(pchunk);
+        vChunks.clear();
+        nUsed = CHUNK_ENTRIES;
+    }
+};
+static CBlockIndexArena blockIndexArena;
+
+/**
+ * Cold fields of block index entries, see CBlockIndexCold. Values set during
+ * this session stay pinned until FlushStateToDisk has written their entry;
+ * values read back from the block tree database are kept in a small LRU.
+ */
+class CBlockIndexColdTable
+{
+private:
+    static const size_t MAX_LOADED = 4096;
+    typedef std::list<std::pair<const CBlockIndex*, CBlockIndexCold> > LoadedList;
+
+    CCriticalSection cs;
+    std::map<const CBlockIndex*, CBlockIndexCold> mapPinned;
+    LoadedList listLoaded;
+    std::map<const CBlockIndex*, LoadedList::iterator> mapLoaded;
+
+    void AddLoaded(const CBlockIndex* pindex, const CBlockIndexCold& cold)
+    {
+        listLoaded.push_front(std::make_pair(pindex, cold));
+        mapLoaded[pindex] = listLoaded.begin();
+        while (listLoaded.size() > MAX_LOADED) {
+            mapLoaded.erase(listLoaded.back().first);
+            listLoaded.pop_back();
+        }
+    }
+
+public:
+    CBlockIndexCold Get(const CBlockIndex* pindex)
+    {
+        LOCK(cs);
+        std::map<const CBlockIndex*, CBlockIndexCold>::const_iterator itPinned = mapPinned.find(pindex);
+        if (itPinned != mapPinned.end())
+            return itPinned->second;
+        std::map<const CBlockIndex*, LoadedList::iterator>::iterator itLoaded = mapLoaded.find(pindex);
+        if (itLoaded != mapLoaded.end()) {
+            listLoaded.splice(listLoaded.begin(), listLoaded, itLoaded->second);
+            return itLoaded->second->second;
+        }
+
+        CBlockIndexCold cold;
+        CDiskBlockIndex diskindex;
+        if (pblocktree && pblocktree->ReadBlockIndex(pindex->GetBlockHash(), diskindex))
+            cold = diskindex.GetCold();
+        AddLoaded(pindex, cold);
+        return cold;
+    }
+
+    void Set(const CBlockIndex* pindex, const CBlockIndexCold& cold)
+    {
+        LOCK(cs);
+        std::map<const CBlockIndex*, LoadedList::iterator>::iterator itLoaded = mapLoaded.find(pindex);
+        if (itLoaded != mapLoaded.end()) {
+            listLoaded.erase(itLoaded->second);
+            mapLoaded.erase(itLoaded);
+        }
+        mapPinned[pindex] = cold;
+    }
+
+    //! All entries have been written, so pinned values may be evicted now
+    void Unpin()
+    {
+        LOCK(cs);
+        for (std::map<const CBlockIndex*, CBlockIndexCold>::const_iterator it = mapPinned.begin(); it != mapPinned.end(); ++it)
+            AddLoaded(it->first, it->second);
+        mapPinned.clear();
+    }
+
+    void Clear()
+    {
+        LOCK(cs);
+        mapPinned.clear();
+        listLoaded.clear();
+        mapLoaded.clear();
+    }
+};
+static CBlockIndexColdTable blockIndexColdTable;
+
 map<uint256, uint256> mapProofOfStake;
 map<COutPoint, int> mapStakeSpent;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
@@ -67,8 +189,14 @@ int nScriptCheckThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = true;
+bool fAddressIndex = false;
+bool fSpentIndex = false;
+bool fTimestampIndex = false;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
+bool fHavePruned = false;
+bool fPruneMode = false;
+uint64_t nPruneTarget = 0;
 unsigned int nCoinCacheSize = 5000;
 bool fAlerts = DEFAULT_ALERTS;
 
@@ -83,12 +211,10 @@ int64_t nReserveBalance = 0;
 CFeeRate minRelayTxFee = CFeeRate(10000);
 CTxMemPool mempool(::minRelayTxFee);
 
-struct COrphanTx {
-    CTransaction tx;
-    NodeId fromPeer;
-};
 map<uint256, COrphanTx> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+map<NodeId, COrphanPeer> mapOrphanPeers;
+size_t nOrphanBytes = 0;
 map<uint256, int64_t> mapRejectedBlocks;
 
 
@@ -176,6 +302,149 @@ set<CBlockIndex*> setDirtyBlockIndex;
 
 /** Dirty block file entries. */
 set<int> setDirtyFileInfo;
+
+/** Global flag to indicate we should check to see if there are block/undo files that should be deleted. Set on startup or if we allocate more file space when we're in prune mode */
+bool fCheckForPruning = false;
+
+/**
+ * Block index entries of stored blocks by the position of their data, so a
+ * txindex record resolves to its block without hashing the block header.
+ * Only maintained with -txindex. Protected by cs_main.
+ */
+class CBlockPosIndex
+{
+    typedef std::pair<unsigned int, CBlockIndex*> Entry;
+    //! Per block file, its blocks sorted by position
+    std::vector<std::vector<Entry> > vFiles;
+
+    static bool PosLess(const Entry& a, const Entry& b) { return a.first < b.first; }
+
+    std::vector<Entry>* GetFile(int nFile, bool fCreate)
+    {
+        if (nFile < 0)
+            return NULL;
+        if ((size_t)nFile >= vFiles.size()) {
+            if (!fCreate)
+                return NULL;
+            vFiles.resize(nFile + 1);
+        }
+        return &vFiles[nFile];
+    }
+
+public:
+    void Add(CBlockIndex* pindex)
+    {
+        std::vector<Entry>* pfile = GetFile(pindex->nFile, true);
+        if (!pfile)
+            return;
+        Entry entry(pindex->nDataPos, pindex);
+        // Blocks are appended to their file, so this is nearly always a push_back
+        if (pfile->empty() || pfile->back().first < entry.first) {
+            pfile->push_back(entry);
+            return;
+        }
+        std::vector<Entry>::iterator it = std::lower_bound(pfile->begin(), pfile->end(), entry, PosLess);
+        if (it != pfile->end() && it->first == entry.first)
+            it->second = pindex;
+        else
+            pfile->insert(it, entry);
+    }
+
+    void Load(const BlockMap& mapIndex)
+    {
+        vFiles.clear();
+        for (BlockMap::const_iterator it = mapIndex.begin(); it != mapIndex.end(); ++it) {
+            CBlockIndex* pindex = it->second;
+            std::vector<Entry>* pfile = (pindex->nStatus & BLOCK_HAVE_DATA) ? GetFile(pindex->nFile, true) : NULL;
+            if (pfile)
+                pfile->push_back(Entry(pindex->nDataPos, pindex));
+        }
+        for (size_t n = 0; n < vFiles.size(); n++)
+            std::sort(vFiles[n].begin(), vFiles[n].end(), PosLess);
+    }
+
+    void RemoveFile(int nFile)
+    {
+        std::vector<Entry>* pfile = GetFile(nFile, false);
+        if (pfile)
+            std::vector<Entry>().swap(*pfile);
+    }
+
+    CBlockIndex* Find(const CDiskBlockPos& pos)
+    {
+        std::vector<Entry>* pfile = GetFile(pos.nFile, false);
+        if (!pfile)
+            return NULL;
+        std::vector<Entry>::const_iterator it = std::lower_bound(pfile->begin(), pfile->end(), Entry(pos.nPos, NULL), PosLess);
+        return (it != pfile->end() && it->first == pos.nPos) ? it->second : NULL;
+    }
+
+    void Clear() { vFiles.clear(); }
+} blockPosIndex;
+
+/**
+ * Recently looked up confirmed transactions with their blocks, least recently
+ * used first out. Protected by cs_main.
+ */
+class CTxLookupCache
+{
+    static const size_t MAX_CACHE_BYTES = 4 << 20;
+
+    struct CachedTx {
+        CTransaction tx;
+        CBlockIndex* pindex;
+        size_t nSize;
+    };
+    typedef std::list<std::pair<uint256, CachedTx> > CacheList;
+    CacheList listCache;
+    std::map<uint256, CacheList::iterator> mapCache;
+    size_t nCacheBytes;
+
+public:
+    CTxLookupCache() : nCacheBytes(0) {}
+
+    bool Get(const uint256& hash, CTransaction& tx, CBlockIndex*& pindex)
+    {
+        std::map<uint256, CacheList::iterator>::iterator it = mapCache.find(hash);
+        if (it == mapCache.end())
+            return false;
+        listCache.splice(listCache.begin(), listCache, it->second);
+        tx = it->second->second.tx;
+        pindex = it->second->second.pindex;
+        return true;
+    }
+
+    void Add(const uint256& hash, const CTransaction& tx, CBlockIndex* pindex)
+    {
+        size_t nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        if (nSize > MAX_CACHE_BYTES / 16)
+            return;
+        std::map<uint256, CacheList::iterator>::iterator it = mapCache.find(hash);
+        if (it != mapCache.end()) {
+            it->second->second.pindex = pindex;
+            return;
+        }
+        CachedTx entry;
+        entry.tx = tx;
+        entry.pindex = pindex;
+        entry.nSize = nSize;
+        listCache.push_front(std::make_pair(hash, entry));
+        mapCache.insert(std::make_pair(hash, listCache.begin()));
+        nCacheBytes += nSize;
+        while (nCacheBytes > MAX_CACHE_BYTES) {
+            nCacheBytes -= listCache.back().second.nSize;
+            mapCache.erase(listCache.back().first);
+            listCache.pop_back();
+        }
+    }
+
+    void Clear()
+    {
+        listCache.clear();
+        mapCache.clear();
+        nCacheBytes = 0;
+    }
+} txLookupCache;
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -348,6 +617,10 @@ void InitializeNode(NodeId nodeid, const CNode* pnode)
     state.address = pnode->addr;
 }
 
+/** Misbehavior reported while cs_main was busy, by node */
+static CCriticalSection cs_pendingMisbehavior;
+static std::map<NodeId, int> mapPendingMisbehavior;
+
 void FinalizeNode(NodeId nodeid)
 {
     LOCK(cs_main);
@@ -366,6 +639,11 @@ void FinalizeNode(NodeId nodeid)
     nPreferredDownload -= state->fPreferredDownload;
 
     mapNodeState.erase(nodeid);
+
+    {
+        LOCK(cs_pendingMisbehavior);
+        mapPendingMisbehavior.erase(nodeid);
+    }
 }
 
 // Requires cs_main.
@@ -512,7 +790,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
                 // We consider the chain that this peer is on invalid.
                 return;
             }
-            if (pindex->nStatus & BLOCK_HAVE_DATA) {
+            if (pindex->nStatus & BLOCK_HAVE_DATA || chainActive.Contains(pindex)) {
                 if (pindex->nChainTx)
                     state->pindexLastCommonBlock = pindex;
             } else if (mapBlocksInFlight.count(pindex->GetBlockHash()) == 0) {
@@ -595,32 +873,45 @@ CBlockTreeDB* pblocktree = NULL;
 // mapOrphanTransactions
 //
 
+/** Largest orphan kept, to avoid a send-big-orphans memory exhaustion attack */
+static const unsigned int MAX_ORPHAN_TX_SIZE = 5000;
+/** A single peer's orphans may take at most this fraction of the orphan byte budget */
+static const unsigned int ORPHAN_PEER_SHARE = 4;
+
+static uint64_t nOrphanSequence = 0;
+static int64_t nNextOrphanSweep = 0;
+
 bool AddOrphanTx(const CTransaction& tx, NodeId peer)
 {
     uint256 hash = tx.GetHash();
     if (mapOrphanTransactions.count(hash))
         return false;
 
-    // Ignore big transactions, to avoid a
-    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
-    // large transaction with a missing parent then we assume
-    // it will rebroadcast it later, after the parent transaction(s)
-    // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
+    // Ignore big transactions. If a peer has a legitimate large transaction
+    // with a missing parent then we assume it will rebroadcast it later,
+    // after the parent transaction(s) have been mined or received.
     unsigned int sz = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
-    if (sz > 5000) {
+    if (sz > MAX_ORPHAN_TX_SIZE) {
         LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
         return false;
     }
 
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.tx = tx;
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nTxSize = sz;
+    orphan.nSequence = nOrphanSequence++;
     BOOST_FOREACH (const CTxIn& txin, tx.vin)
         mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
-        mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
+    COrphanPeer& orphanPeer = mapOrphanPeers[peer];
+    orphanPeer.setOrphans.insert(make_pair(orphan.nSequence, hash));
+    orphanPeer.nBytes += sz;
+    nOrphanBytes += sz;
+
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u bytes %u)\n", hash.ToString(),
+        mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size(), nOrphanBytes);
     return true;
 }
 
@@ -637,39 +928,144 @@ void static EraseOrphanTx(uint256 hash)
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+
+    map<NodeId, COrphanPeer>::iterator itPeer = mapOrphanPeers.find(it->second.fromPeer);
+    if (itPeer != mapOrphanPeers.end()) {
+        itPeer->second.setOrphans.erase(make_pair(it->second.nSequence, hash));
+        itPeer->second.nBytes -= it->second.nTxSize;
+        if (itPeer->second.setOrphans.empty())
+            mapOrphanPeers.erase(itPeer);
+    }
+    nOrphanBytes -= it->second.nTxSize;
     mapOrphanTransactions.erase(it);
 }
 
 void EraseOrphansFor(NodeId peer)
 {
-    int nErased = 0;
-    map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end()) {
-        map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer) {
-            EraseOrphanTx(maybeErase->second.tx.GetHash());
-            ++nErased;
-        }
-    }
-    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
+    map<NodeId, COrphanPeer>::iterator itPeer = mapOrphanPeers.find(peer);
+    if (itPeer == mapOrphanPeers.end())
+        return;
+    // EraseOrphanTx removes the peer entry with its last orphan
+    vector<pair<uint64_t, uint256> > vErase(itPeer->second.setOrphans.begin(), itPeer->second.setOrphans.end());
+    for (unsigned int i = 0; i < vErase.size(); i++)
+        EraseOrphanTx(vErase[i].second);
+    LogPrint("mempool", "Erased %d orphan tx from peer %d\n", vErase.size(), peer);
 }
 
-
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxBytes)
 {
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans) {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
+
+    int64_t nNow = GetTime();
+    if (nNextOrphanSweep <= nNow) {
+        // Sweep out expired orphans, and come back when the next one expires
+        int64_t nMinExpire = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
+        map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
+        while (iter != mapOrphanTransactions.end()) {
+            map<uint256, COrphanTx>::iterator maybeErase = iter++;
+            if (maybeErase->second.nTimeExpire <= nNow) {
+                EraseOrphanTx(maybeErase->first);
+                ++nEvicted;
+            } else {
+                nMinExpire = std::min(maybeErase->second.nTimeExpire, nMinExpire);
+            }
+        }
+        // Sweep at most once per interval
+        nNextOrphanSweep = nMinExpire + ORPHAN_TX_EXPIRE_INTERVAL;
+        if (nEvicted > 0)
+            LogPrint("mempool", "Erased %u expired orphan tx\n", nEvicted);
+    }
+
+    // Over budget, or one peer over its share: evict the oldest orphan of the
+    // peer whose orphans take the most bytes, so a flooding peer pays first
+    while (!mapOrphanPeers.empty()) {
+        map<NodeId, COrphanPeer>::iterator itLargest = mapOrphanPeers.begin();
+        for (map<NodeId, COrphanPeer>::iterator it = mapOrphanPeers.begin(); it != mapOrphanPeers.end(); ++it) {
+            if (it->second.nBytes > itLargest->second.nBytes)
+                itLargest = it;
+        }
+        if (mapOrphanTransactions.size() <= nMaxOrphans && nOrphanBytes <= nMaxBytes &&
+            itLargest->second.nBytes <= nMaxBytes / ORPHAN_PEER_SHARE)
+            break;
+        EraseOrphanTx(itLargest->second.setOrphans.begin()->second);
         ++nEvicted;
     }
     return nEvicted;
 }
 
+/** Whether all inputs of a transaction are available in the chain or the mempool */
+static bool HaveOrphanInputs(const CTransaction& tx, CCoinsView& view)
+{
+    CCoins coins;
+    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+        if (!view.GetCoins(txin.prevout.hash, coins) || !coins.IsAvailable(txin.prevout.n))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Accept the orphans that spend outputs of the transaction hashParent, just
+ * accepted, then those that spend outputs of these, and so on, in one pass.
+ * A view of the chain and the mempool is shared by the whole pass to find
+ * the orphans that still miss other inputs; they stay in the pool without an
+ * AcceptToMemoryPool attempt.
+ */
+static void ProcessOrphanTxs(const uint256& hashParent)
+{
+    AssertLockHeld(cs_main);
+
+    CCoinsViewMemPool viewMemPool(pcoinsTip, mempool);
+    vector<uint256> vWorkQueue(1, hashParent);
+    set<uint256> setDone;
+    set<NodeId> setMisbehaving;
+    unsigned int nAccepted = 0;
+    for (unsigned int i = 0; i < vWorkQueue.size(); i++) {
+        map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
+        if (itByPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        BOOST_FOREACH (const uint256& orphanHash, itByPrev->second) {
+            if (setDone.count(orphanHash))
+                continue;
+            const COrphanTx& orphan = mapOrphanTransactions[orphanHash];
+            if (setMisbehaving.count(orphan.fromPeer))
+                continue;
+            if (!HaveOrphanInputs(orphan.tx, viewMemPool))
+                continue;
+
+            bool fMissingInputs = false;
+            // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+            // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+            // anyone relaying LegitTxX banned)
+            CValidationState stateDummy;
+            if (AcceptToMemoryPool(mempool, stateDummy, orphan.tx, true, &fMissingInputs)) {
+                LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+                RelayTransaction(orphan.tx);
+                vWorkQueue.push_back(orphanHash);
+                setDone.insert(orphanHash);
+                nAccepted++;
+            } else if (!fMissingInputs) {
+                int nDos = 0;
+                if (stateDummy.IsInvalid(nDos) && nDos > 0) {
+                    // Punish peer that gave us an invalid orphan tx
+                    Misbehaving(orphan.fromPeer, nDos);
+                    setMisbehaving.insert(orphan.fromPeer);
+                    LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+                }
+                // Has inputs but not accepted to mempool
+                // Probably non-standard or insufficient fee/priority
+                LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+                setDone.insert(orphanHash);
+            }
+        }
+    }
+
+    BOOST_FOREACH (const uint256& hash, setDone)
+        EraseOrphanTx(hash);
+    if (nAccepted > 0)
+        mempool.check(pcoinsTip);
+}
+
 bool IsStandardTx(const CTransaction& tx, string& reason)
 {
     AssertLockHeld(cs_main);
@@ -1086,8 +1482,55 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
     return nMinFee;
 }
 
+/** Expire old transactions, then evict the lowest fee ones until the pool fits -maxmempool */
+static void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age)
+{
+    int expired = pool.Expire(GetTime() - age);
+    if (expired != 0)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+    pool.TrimToSize(limit);
+}
+
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+/**
+ * CheckInputs for a loose transaction, with its script checks spread over the
+ * script check threads. These are idle here, as blocks are connected under
+ * cs_main too. When a check fails only its input is checked again, to classify
+ * the failure as CheckInputs does.
+ */
+static bool CheckInputsParallel(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& inputs, unsigned int flags, bool cacheStore)
+{
+    AssertLockHeld(cs_main);
+    if (!nScriptCheckThreads || tx.vin.size() < 2)
+        return CheckInputs(tx, state, inputs, true, flags, cacheStore);
+
+    std::vector<CScriptCheck> vChecks;
+    if (!CheckInputs(tx, state, inputs, true, flags, cacheStore, &vChecks))
+        return false;
+    CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+    control.Add(vChecks);
+    CScriptCheck checkFailed;
+    if (control.Wait(&checkFailed))
+        return true;
+
+    unsigned int nIn = checkFailed.GetInputIndex();
+    const CCoins* coins = inputs.AccessCoins(tx.vin[nIn].prevout.hash);
+    assert(coins);
+    // A check that fails on a worker but passes here is our problem, not the peer's
+    CScriptCheck check(*coins, tx, nIn, flags, cacheStore);
+    if (check())
+        return state.Invalid(error("CheckInputsParallel() : script check of %s:%d failed on a worker only", tx.GetHash().ToString(), nIn));
+    if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
+        CScriptCheck checkMandatory(*coins, tx, nIn, flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
+        if (checkMandatory())
+            return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
+    }
+    return state.DoS(100, false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
+}
+
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees, int64_t nAcceptTime)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1203,7 +1646,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         CAmount nFees = nValueIn - nValueOut;
         double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime ? nAcceptTime : GetTime(), dPriority, chainActive.Height());
         unsigned int nSize = entry.GetTxSize();
 
         // Don't accept it if it can't get into a block
@@ -1222,6 +1665,21 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
                 return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
             }
 
+            // Once the pool has been full, require a fee above that of the transactions it evicted.
+            // The pool ranks transactions by their fee with prioritisetransaction deltas, so compare that.
+            CAmount nModifiedFees = nFees;
+            {
+                double dPriorityDelta = 0;
+                CAmount nFeeDelta = 0;
+                pool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
+                nModifiedFees += nFeeDelta;
+            }
+            CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+            if (mempoolRejectFee > 0 && nModifiedFees < mempoolRejectFee)
+                return state.DoS(0, error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                                        hash.ToString(), nModifiedFees, mempoolRejectFee),
+                    REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
             // Continuously rate-limit free (really, very-low-fee) transactions
             // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
             // be annoying or make others' transactions take longer to confirm.
@@ -1253,7 +1711,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true)) {
+        if (!CheckInputsParallel(tx, state, view, STANDARD_SCRIPT_VERIFY_FLAGS, true)) {
             return error("AcceptToMemoryPool: : ConnectInputs failed %s", hash.ToString());
         }
 
@@ -1266,12 +1724,18 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true)) {
+        if (!CheckInputsParallel(tx, state, view, MANDATORY_SCRIPT_VERIFY_FLAGS, true)) {
             return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
 
         // Store transaction in memory
         pool.addUnchecked(hash, entry);
+
+        // Trim the pool back to its limit, which may evict this very transaction
+        LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+        if (!pool.exists(hash))
+            return state.DoS(0, error("AcceptToMemoryPool : mempool full, %s not kept", hash.ToString()),
+                REJECT_INSUFFICIENTFEE, "mempool full");
     }
 
     SyncWithWallets(tx, NULL);
@@ -1489,22 +1953,28 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
         }
 
         if (fTxIndex) {
+            // A transaction that is reorganized away is looked up again; its txindex record may have moved
+            CBlockIndex* pindex = NULL;
+            if (txLookupCache.Get(hash, txOut, pindex) && chainActive.Contains(pindex)) {
+                hashBlock = pindex->GetBlockHash();
+                return true;
+            }
+
             CDiskTxPos postx;
             if (pblocktree->ReadTxIndex(hash, postx)) {
-                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-                if (file.IsNull())
-                    return error("%s: OpenBlockFile failed", __func__);
                 CBlockHeader header;
-                try {
-                    file >> header;
-                    fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                    file >> txOut;
-                } catch (std::exception& e) {
-                    return error("%s : Deserialize or I/O error - %s", __func__, e.what());
-                }
-                hashBlock = header.GetHash();
+                if (!blockFileReader.ReadTransaction(postx, header, txOut))
+                    return error("%s : unable to read transaction %s", __func__, hash.ToString());
                 if (txOut.GetHash() != hash)
                     return error("%s : txid mismatch", __func__);
+                pindex = blockPosIndex.Find(postx);
+                if (pindex) {
+                    hashBlock = pindex->GetBlockHash();
+                    if (chainActive.Contains(pindex))
+                        txLookupCache.Add(hash, txOut, pindex);
+                } else {
+                    hashBlock = header.GetHash();
+                }
                 return true;
             }
         }
@@ -1539,6 +2009,78 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
 }
 
 
+bool GetAddressIndex(const uint160& hashBytes, int type, std::vector<std::pair<CAddressIndexKey, CAmount> >& vAddressIndex, int nStart, int nEnd)
+{
+    if (!fAddressIndex)
+        return error("%s : address index not enabled", __func__);
+    if (!pblocktree->ReadAddressIndex(hashBytes, type, vAddressIndex, nStart, nEnd))
+        return error("%s : unable to get txids for address", __func__);
+    return true;
+}
+
+bool GetAddressUnspent(const uint160& hashBytes, int type, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vUnspentOutputs)
+{
+    if (!fAddressIndex)
+        return error("%s : address index not enabled", __func__);
+    if (!pblocktree->ReadAddressUnspentIndex(hashBytes, type, vUnspentOutputs))
+        return error("%s : unable to get unspent outputs for address", __func__);
+    return true;
+}
+
+bool GetSpentIndex(const CSpentIndexKey& key, CSpentIndexValue& value)
+{
+    if (!fSpentIndex)
+        return false;
+    return pblocktree->ReadSpentIndex(key, value);
+}
+
+bool GetTimestampIndex(unsigned int nHigh, unsigned int nLow, bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> >& vHashes)
+{
+    if (!fTimestampIndex)
+        return error("%s : timestamp index not enabled", __func__);
+    if (!pblocktree->ReadTimestampIndex(nHigh, nLow, vHashes))
+        return error("%s : unable to get hashes for timestamps", __func__);
+
+    if (fActiveOnly) {
+        // Blocks of a reorganization in progress may still have their entries
+        LOCK(cs_main);
+        std::vector<std::pair<uint256, unsigned int> > vActive;
+        vActive.reserve(vHashes.size());
+        for (unsigned int i = 0; i < vHashes.size(); i++) {
+            BlockMap::iterator mi = mapBlockIndex.find(vHashes[i].first);
+            if (mi != mapBlockIndex.end() && chainActive.Contains(mi->second))
+                vActive.push_back(vHashes[i]);
+        }
+        vHashes.swap(vActive);
+    }
+    return true;
+}
+
+unsigned int GetLogicalTimestamp(const CBlockIndex* pindex)
+{
+    unsigned int nLogicalTime = pindex->nTime;
+    unsigned int nPrevLogicalTime;
+    if (pindex->pprev && pblocktree->ReadTimestampIndexEntry(CTimestampIndexKey(pindex->pprev->nTime, pindex->pprev->GetBlockHash()), nPrevLogicalTime) &&
+        nLogicalTime <= nPrevLogicalTime)
+        nLogicalTime = nPrevLogicalTime + 1;
+    return nLogicalTime;
+}
+
+bool GetUnspentOutput(const COutPoint& prevout, CTxOut& txOut, uint256& hashBlock)
+{
+    LOCK(cs_main);
+    const CCoins* coins = pcoinsTip->AccessCoins(prevout.hash);
+    if (!coins || !coins->IsAvailable(prevout.n))
+        return false;
+    const CBlockIndex* pindex = chainActive[coins->nHeight];
+    if (!pindex)
+        return false;
+    txOut = coins->vout[prevout.n];
+    hashBlock = pindex->GetBlockHash();
+    return true;
+}
+
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // CBlock and CBlockIndex
@@ -1565,22 +2107,31 @@ bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos)
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
+static bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, CRawBlock& raw, bool& fCached)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk : OpenBlockFile failed");
+    if (!blockFileReader.ReadRawBlock(pos, raw, fCached))
+        return error("ReadBlockFromDisk : ReadRawBlock failed");
 
     // Read block
     try {
-        filein >> block;
+        CMemoryReader reader(&(*raw)[0], &(*raw)[0] + raw->size(), SER_DISK, CLIENT_VERSION);
+        reader >> block;
     } catch (std::exception& e) {
         return error("%s : Deserialize or I/O error - %s", __func__, e.what());
     }
 
+    return true;
+}
+
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
+{
+    CRawBlock raw;
+    bool fCached = false;
+    if (!ReadBlockFromDisk(block, pos, raw, fCached))
+        return false;
+
     // Check the header
     if (block.IsProofOfWork()) {
         if (!CheckProofOfWork(block.GetHash(), block.nBits))
@@ -1592,16 +2143,28 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
 
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
 {
-    if (!ReadBlockFromDisk(block, pindex->GetBlockPos()))
+    CRawBlock raw;
+    bool fCached = false;
+    if (!ReadBlockFromDisk(block, pindex->GetBlockPos(), raw, fCached))
         return false;
-    if (block.GetHash() != pindex->GetBlockHash()) {
-        LogPrintf("%s : block=%s index=%s\n", __func__, block.GetHash().ToString().c_str(), pindex->GetBlockHash().ToString().c_str());
+
+    // Only blocks that were checked against their index entry are cached
+    if (fCached)
+        return true;
+
+    uint256 hash = block.GetHash();
+    if (block.IsProofOfWork()) {
+        if (!CheckProofOfWork(hash, block.nBits))
+            return error("ReadBlockFromDisk : Errors in block header");
+    }
+    if (hash != pindex->GetBlockHash()) {
+        LogPrintf("%s : block=%s index=%s\n", __func__, hash.ToString().c_str(), pindex->GetBlockHash().ToString().c_str());
         return error("ReadBlockFromDisk(CBlock&, CBlockIndex*) : GetHash() doesn't match index");
     }
+    blockFileReader.CacheRawBlock(pindex->GetBlockPos(), raw);
     return true;
 }
 
-
 double ConvertBitsToDouble(unsigned int nBits)
 {
     int nShift = (nBits >> 24) & 0xff;
@@ -1683,7 +2246,7 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
 	} else if (nHeight > 502 && nHeight <= 9000000) {
         ret = blockValue / 100 * 85;
 	} else if (nHeight > 9000000) {
-		int64_t nMoneySupply = chainActive.Tip()->nMoneySupply;
+		int64_t nMoneySupply = GetBlockIndexCold(chainActive.Tip()).nMoneySupply;
 
 		if(nMasternodeCount < 1) {
 			nMasternodeCount = mnodeman.stable_size();
@@ -1810,6 +2373,15 @@ void Misbehaving(NodeId pnode, int howmuch)
     if (howmuch == 0)
         return;
 
+    // The message queue workers call this holding locks of their subsystem,
+    // which must not be followed by cs_main; SendMessages applies it then.
+    TRY_LOCK(cs_main, lockMain);
+    if (!lockMain) {
+        LOCK(cs_pendingMisbehavior);
+        mapPendingMisbehavior[pnode] += howmuch;
+        return;
+    }
+
     CNodeState* state = State(pnode);
     if (state == NULL)
         return;
@@ -1983,7 +2555,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
     return true;
 }
 
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
+bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean, CIndexUpdates* pindexUpdates)
 {
     assert(pindex->GetBlockHash() == view.GetBestBlock());
 
@@ -2002,11 +2574,28 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
         return error("DisconnectBlock() : block and undo data inconsistent");
 
+    CCoinsCommitment* pcommitment = view.ModifyCommitment();
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressIndex;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vAddressUnspentIndex;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > vSpentIndex;
+
     // undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
         const CTransaction& tx = block.vtx[i];
         uint256 hash = tx.GetHash();
 
+        if (fAddressIndex) {
+            for (unsigned int k = tx.vout.size(); k-- > 0;) {
+                const CTxOut& out = tx.vout[k];
+                uint160 hashBytes;
+                int type;
+                if (!GetScriptAddressIndexKey(out.scriptPubKey, hashBytes, type))
+                    continue;
+                vAddressIndex.push_back(std::make_pair(CAddressIndexKey(type, hashBytes, pindex->nHeight, i, hash, k, false), out.nValue));
+                vAddressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(type, hashBytes, hash, k), CAddressUnspentValue()));
+            }
+        }
+
         // Check that all outputs are available and match the outputs in the block itself
         // exactly. Note that transactions with only provably unspendable outputs won't
         // have outputs available even in the block itself, so we handle that case
@@ -2025,6 +2614,14 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
             if (*outs != outsBlock)
                 fClean = fClean && error("DisconnectBlock() : added transaction mismatch? database corrupted");
 
+            if (pcommitment && !outs->IsPruned()) {
+                pcommitment->nTransactions--;
+                for (unsigned int k = 0; k < outs->vout.size(); k++) {
+                    if (!outs->vout[k].IsNull())
+                        pcommitment->RemoveCoin(COutPoint(hash, k), outs->vout[k], outs->nHeight, outs->fCoinBase);
+                }
+            }
+
             // remove outputs
             outs->Clear();
         }
@@ -2055,6 +2652,21 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
                 if (coins->vout.size() < out.n + 1)
                     coins->vout.resize(out.n + 1);
                 coins->vout[out.n] = undo.txout;
+                if (fSpentIndex)
+                    vSpentIndex.push_back(std::make_pair(CSpentIndexKey(out.hash, out.n), CSpentIndexValue()));
+                if (fAddressIndex) {
+                    uint160 hashBytes;
+                    int type;
+                    if (GetScriptAddressIndexKey(undo.txout.scriptPubKey, hashBytes, type)) {
+                        vAddressIndex.push_back(std::make_pair(CAddressIndexKey(type, hashBytes, pindex->nHeight, i, hash, j, true), undo.txout.nValue * -1));
+                        vAddressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(type, hashBytes, out.hash, out.n), CAddressUnspentValue(undo.txout.nValue, undo.txout.scriptPubKey, coins->nHeight)));
+                    }
+                }
+                if (pcommitment) {
+                    if (undo.nHeight != 0)
+                        pcommitment->nTransactions++;
+                    pcommitment->AddCoin(out, undo.txout, coins->nHeight, coins->fCoinBase);
+                }
                 {
                     LOCK(cs_mapstake);
                     // erase the spent input
@@ -2070,9 +2682,17 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
     if (pfClean) {
         *pfClean = fClean;
         return true;
-    } else {
-        return fClean;
     }
+
+    // Only a real disconnect updates the indexes; a view that is checked with pfClean is thrown away
+    if (pindexUpdates) {
+        pindexUpdates->vAddressIndexErase.insert(pindexUpdates->vAddressIndexErase.end(), vAddressIndex.begin(), vAddressIndex.end());
+        pindexUpdates->vAddressUnspentIndex.insert(pindexUpdates->vAddressUnspentIndex.end(), vAddressUnspentIndex.begin(), vAddressUnspentIndex.end());
+        pindexUpdates->vSpentIndex.insert(pindexUpdates->vSpentIndex.end(), vSpentIndex.begin(), vSpentIndex.end());
+        if (fTimestampIndex)
+            pindexUpdates->vTimestampIndexErase.push_back(CTimestampIndexKey(pindex->nTime, pindex->GetBlockHash()));
+    }
+    return fClean;
 }
 
 void static FlushBlockFile(bool fFinalize = false)
@@ -2081,6 +2701,10 @@ void static FlushBlockFile(bool fFinalize = false)
 
     CDiskBlockPos posOld(nLastBlockFile, 0);
 
+    // A mapping past the truncated end must not be touched again
+    if (fFinalize)
+        blockFileReader.CloseFile(nLastBlockFile);
+
     FILE* fileOld = OpenBlockFile(posOld);
     if (fileOld) {
         if (fFinalize)
@@ -2100,8 +2724,6 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
-
 void ThreadScriptCheck()
 {
     RenameThread("bare-scriptch");
@@ -2190,9 +2812,14 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
     std::vector<std::pair<uint256, CDiskTxPos> > vPos;
     vPos.reserve(block.vtx.size());
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressIndex;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vAddressUnspentIndex;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > vSpentIndex;
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
     CAmount nValueOut = 0;
     CAmount nValueIn = 0;
+    // Running UTXO set commitment; a view that is only checked is thrown away, so leave it alone
+    CCoinsCommitment* pcommitment = fJustCheck ? NULL : view.ModifyCommitment();
     for (unsigned int i = 0; i < block.vtx.size(); i++) {
         const CTransaction& tx = block.vtx[i];
 
@@ -2236,31 +2863,93 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             control.Add(vChecks);
         }
 
+        if (pcommitment && !tx.IsCoinBase()) {
+            BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
+                pcommitment->RemoveCoin(txin.prevout, coins->vout[txin.prevout.n], coins->nHeight, coins->fCoinBase);
+            }
+        }
+
+        if ((fAddressIndex || fSpentIndex) && !fJustCheck && !tx.IsCoinBase()) {
+            const uint256 txhash = tx.GetHash();
+            for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                const COutPoint& prevout = tx.vin[j].prevout;
+                const CTxOut& out = view.AccessCoins(prevout.hash)->vout[prevout.n];
+                uint160 hashBytes;
+                int type = 0;
+                if (!GetScriptAddressIndexKey(out.scriptPubKey, hashBytes, type))
+                    type = 0;
+                if (fSpentIndex)
+                    vSpentIndex.push_back(std::make_pair(CSpentIndexKey(prevout.hash, prevout.n), CSpentIndexValue(txhash, j, pindex->nHeight, out.nValue, type, hashBytes)));
+                if (fAddressIndex && type != 0) {
+                    vAddressIndex.push_back(std::make_pair(CAddressIndexKey(type, hashBytes, pindex->nHeight, i, txhash, j, true), out.nValue * -1));
+                    vAddressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(type, hashBytes, prevout.hash, prevout.n), CAddressUnspentValue()));
+                }
+            }
+        }
+        if (fAddressIndex && !fJustCheck) {
+            const uint256 txhash = tx.GetHash();
+            uint160 hashBytes;
+            int type;
+            for (unsigned int k = 0; k < tx.vout.size(); k++) {
+                const CTxOut& out = tx.vout[k];
+                if (!GetScriptAddressIndexKey(out.scriptPubKey, hashBytes, type))
+                    continue;
+                vAddressIndex.push_back(std::make_pair(CAddressIndexKey(type, hashBytes, pindex->nHeight, i, txhash, k, false), out.nValue));
+                vAddressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(type, hashBytes, txhash, k), CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight)));
+            }
+        }
+
         CTxUndo undoDummy;
         if (i > 0) {
             blockundo.vtxundo.push_back(CTxUndo());
         }
         UpdateCoins(tx, state, view, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight);
 
+        if (pcommitment) {
+            // Undo data only carries the metadata when the last output of a transaction is spent
+            if (i > 0) {
+                BOOST_FOREACH (const CTxInUndo& undo, blockundo.vtxundo.back().vprevout) {
+                    if (undo.nHeight != 0)
+                        pcommitment->nTransactions--;
+                }
+            }
+            const CCoins* coins = view.AccessCoins(tx.GetHash());
+            if (coins && !coins->IsPruned()) {
+                pcommitment->nTransactions++;
+                for (unsigned int k = 0; k < coins->vout.size(); k++) {
+                    if (!coins->vout[k].IsNull())
+                        pcommitment->AddCoin(COutPoint(tx.GetHash(), k), coins->vout[k], pindex->nHeight, coins->fCoinBase);
+                }
+            }
+        }
+
         vPos.push_back(std::make_pair(tx.GetHash(), pos));
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
 
-    CAmount nMoneySupplyPrev = pindex->pprev ? pindex->pprev->nMoneySupply : 0;
-    pindex->nMint = nValueOut - nValueIn + nFees;
-    pindex->nMoneySupply = nMoneySupplyPrev + nValueOut - nValueIn;
+    // The dummy index of a block template is not in the cold table
+    CBlockIndexCold cold;
+    if (!fJustCheck)
+        cold = GetBlockIndexCold(pindex);
+    CAmount nMoneySupplyPrev = pindex->pprev ? GetBlockIndexCold(pindex->pprev).nMoneySupply : 0;
+    cold.nMint = nValueOut - nValueIn + nFees;
+    cold.nMoneySupply = nMoneySupplyPrev + nValueOut - nValueIn;
 
     //lost-fee-issue
     CAmount nExpectedMint = GetBlockValue(pindex->pprev->nHeight) + nFees;
-    if (!IsBlockValueValid(block, nExpectedMint, pindex->nMint)) {
+    if (!IsBlockValueValid(block, nExpectedMint, cold.nMint)) {
         return state.DoS(100,
             error("ConnectBlock() : reward pays too much (actual=%s vs limit=%s)",
-                FormatMoney(pindex->nMint), FormatMoney(nExpectedMint)),
+                FormatMoney(cold.nMint), FormatMoney(nExpectedMint)),
             REJECT_INVALID, "bad-cb-amount");
     }
 
-    if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex)))
-        return error("Connect() : WriteBlockIndex for pindex failed");
+    if (!fJustCheck) {
+        SetBlockIndexCold(pindex, cold);
+        if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex, cold)))
+            return error("Connect() : WriteBlockIndex for pindex failed");
+    }
 
     int64_t nTime1 = GetTimeMicros();
     nTimeConnect += nTime1 - nTimeStart;
@@ -2296,6 +2985,21 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     if (fTxIndex)
         if (!pblocktree->WriteTxIndex(vPos))
             return state.Abort("Failed to write transaction index");
+
+    if (fAddressIndex) {
+        if (!pblocktree->WriteAddressIndex(vAddressIndex))
+            return state.Abort("Failed to write address index");
+        if (!pblocktree->UpdateAddressUnspentIndex(vAddressUnspentIndex))
+            return state.Abort("Failed to write address unspent index");
+    }
+
+    if (fSpentIndex)
+        if (!pblocktree->UpdateSpentIndex(vSpentIndex))
+            return state.Abort("Failed to write spent index");
+
+    if (fTimestampIndex)
+        if (!pblocktree->WriteTimestampIndex(CTimestampIndexKey(pindex->nTime, pindex->GetBlockHash()), GetLogicalTimestamp(pindex)))
+            return state.Abort("Failed to write timestamp index");
     {
         LOCK(cs_mapstake);  
         // add new entries
@@ -2343,6 +3047,129 @@ enum FlushStateMode {
     FLUSH_STATE_ALWAYS
 };
 
+int GetPruneDepth()
+{
+    // Reorganizations, coinbase maturity, the stake min age and the masternode
+    // input age checks may all need blocks up to this far below the tip.
+    int nDepth = std::max((int)MIN_BLOCKS_TO_KEEP, Params().MaxReorganizationDepth());
+    nDepth = std::max(nDepth, Params().COINBASE_MATURITY());
+    nDepth = std::max(nDepth, (int)(nStakeMinAge / Params().TargetSpacing()));
+    return std::max(nDepth, MASTERNODE_MIN_CONFIRMATIONS);
+}
+
+/** Calculate the amount of disk space the block & undo files currently use */
+static uint64_t CalculateCurrentUsage()
+{
+    uint64_t retval = 0;
+    BOOST_FOREACH (const CBlockFileInfo& file, vinfoBlockFile) {
+        retval += file.nSize + file.nUndoSize;
+    }
+    return retval;
+}
+
+/** Mark all blocks of a block file as no longer stored, and forget the file */
+static void PruneOneBlockFile(const int fileNumber)
+{
+    blockPosIndex.RemoveFile(fileNumber);
+    for (BlockMap::iterator it = mapBlockIndex.begin(); it != mapBlockIndex.end(); ++it) {
+        CBlockIndex* pindex = it->second;
+        if (pindex->nFile != fileNumber || !(pindex->nStatus & BLOCK_HAVE_MASK))
+            continue;
+        pindex->nStatus &= ~BLOCK_HAVE_MASK;
+        pindex->nFile = 0;
+        pindex->nDataPos = 0;
+        pindex->nUndoPos = 0;
+        setDirtyBlockIndex.insert(pindex);
+
+        // Prune from mapBlocksUnlinked -- any block we prune would have
+        // to be downloaded again in order to consider its chain, at which
+        // point it would be considered as a candidate for
+        // mapBlocksUnlinked or setBlockIndexCandidates.
+        std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex->pprev);
+        while (range.first != range.second) {
+            std::multimap<CBlockIndex*, CBlockIndex*>::iterator itUnlinked = range.first;
+            range.first++;
+            if (itUnlinked->second == pindex)
+                mapBlocksUnlinked.erase(itUnlinked);
+        }
+    }
+
+    vinfoBlockFile[fileNumber].SetNull();
+    setDirtyFileInfo.insert(fileNumber);
+}
+
+/** Actually unlink the specified files */
+static void UnlinkPrunedFiles(const std::set<int>& setFilesToPrune)
+{
+    for (std::set<int>::const_iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
+        CDiskBlockPos pos(*it, 0);
+        blockFileReader.CloseFile(*it);
+        boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
+        boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
+        LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
+    }
+}
+
+/**
+ * Prune block and undo files (blk???.dat and rev???.dat) so that the disk space used is less than a user-defined target.
+ * The user sets the target (in MB) on the command line or in config file.  This will be run on startup and whenever new
+ * space is allocated in a block or undo file, staying below the target. Changing back to unpruned requires a reindex
+ * (which in this case means the blockchain must be re-downloaded.)
+ *
+ * Pruning functions are called from FlushStateToDisk when the global fCheckForPruning flag has been set.
+ * Block and undo files are deleted in lock-step (when blk00003.dat is deleted, so is rev00003.dat.)
+ * Pruning cannot take place until the chain is deeper than GetPruneDepth() and block files
+ * holding any of the last GetPruneDepth() blocks are kept, as are those of the file being written to.
+ * The block index is kept in full: pruned entries only lose their data and undo positions.
+ *
+ * @param[out]   setFilesToPrune   The set of file indices that can be unlinked will be returned
+ */
+static void FindFilesToPrune(std::set<int>& setFilesToPrune)
+{
+    LOCK2(cs_main, cs_LastBlockFile);
+    if (chainActive.Tip() == NULL || nPruneTarget == 0)
+        return;
+    int nDepth = GetPruneDepth();
+    if (chainActive.Height() <= nDepth)
+        return;
+
+    unsigned int nLastBlockWeCanPrune = chainActive.Height() - nDepth;
+    uint64_t nCurrentUsage = CalculateCurrentUsage();
+    // We don't check to prune until after we've allocated new space for files,
+    // so we should leave a buffer under our target to account for another
+    // allocation before the next pruning.
+    uint64_t nBuffer = BLOCKFILE_CHUNK_SIZE + UNDOFILE_CHUNK_SIZE;
+    int count = 0;
+
+    if (nCurrentUsage + nBuffer >= nPruneTarget) {
+        for (int fileNumber = 0; fileNumber < nLastBlockFile; fileNumber++) {
+            uint64_t nBytesToPrune = vinfoBlockFile[fileNumber].nSize + vinfoBlockFile[fileNumber].nUndoSize;
+
+            if (vinfoBlockFile[fileNumber].nSize == 0)
+                continue;
+
+            // are we below our target?
+            if (nCurrentUsage + nBuffer < nPruneTarget)
+                break;
+
+            // don't prune files that could have a block within the prune depth of the main chain's tip but keep scanning
+            if (vinfoBlockFile[fileNumber].nHeightLast > nLastBlockWeCanPrune)
+                continue;
+
+            PruneOneBlockFile(fileNumber);
+            // Queue up the files for removal
+            setFilesToPrune.insert(fileNumber);
+            nCurrentUsage -= nBytesToPrune;
+            count++;
+        }
+    }
+
+    LogPrint("prune", "Prune: target=%dMiB actual=%dMiB diff=%dMiB max_prune_height=%d removed %d blk/rev pairs\n",
+        nPruneTarget / 1024 / 1024, nCurrentUsage / 1024 / 1024,
+        ((int64_t)nPruneTarget - (int64_t)nCurrentUsage) / 1024 / 1024,
+        nLastBlockWeCanPrune, count);
+}
+
 /**
  * Update the on-disk chain state.
  * The caches and indexes are flushed if either they're too large, forceWrite is set, or
@@ -2352,8 +3179,21 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
 {
     LOCK(cs_main);
     static int64_t nLastWrite = 0;
+    std::set<int> setFilesToPrune;
+    bool fFlushForPrune = false;
     try {
-        if ((mode == FLUSH_STATE_ALWAYS) ||
+        if (fPruneMode && fCheckForPruning && !fReindex) {
+            FindFilesToPrune(setFilesToPrune);
+            fCheckForPruning = false;
+            if (!setFilesToPrune.empty()) {
+                fFlushForPrune = true;
+                if (!fHavePruned) {
+                    pblocktree->WriteFlag("prunedblockfiles", true);
+                    fHavePruned = true;
+                }
+            }
+        }
+        if ((mode == FLUSH_STATE_ALWAYS) || fFlushForPrune ||
             ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
             (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
             // Typical CCoins structures on disk are around 100 bytes in size.
@@ -2378,12 +3218,16 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
                 return state.Abort("Failed to write to block index");
             }
             for (set<CBlockIndex*>::iterator it = setDirtyBlockIndex.begin(); it != setDirtyBlockIndex.end();) {
-                if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(*it))) {
+                if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(*it, GetBlockIndexCold(*it)))) {
                     return state.Abort("Failed to write to block index");
                 }
                 setDirtyBlockIndex.erase(it++);
             }
+            blockIndexColdTable.Unpin();
             pblocktree->Sync();
+            // Only remove pruned files once the index no longer refers to them.
+            if (fFlushForPrune)
+                UnlinkPrunedFiles(setFilesToPrune);
             // Finally flush the chainstate (which may refer to block index entries).
             if (!pcoinsTip->Flush())
                 return state.Abort("Failed to write to coin database");
@@ -2405,6 +3249,13 @@ void FlushStateToDisk()
     FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
 }
 
+void PruneAndFlush()
+{
+    CValidationState state;
+    fCheckForPruning = true;
+    FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
+}
+
 /** Update chainActive and related internal data structures. */
 void static UpdateTip(CBlockIndex* pindexNew)
 {
@@ -2442,48 +3293,208 @@ void static UpdateTip(CBlockIndex* pindexNew)
     }
 }
 
-/** Disconnect chainActive's tip. */
-bool static DisconnectTip(CValidationState& state)
+namespace
 {
+/** Read blocks ahead of connecting them when at least this many are to be connected */
+const int BLOCK_READ_AHEAD_MIN = 4;
+/** Bound on the blocks read ahead at once, so a stale read-ahead is not kept long */
+const int BLOCK_READ_AHEAD_MAX = 1024;
+/** Bound on the threads reading blocks ahead */
+const int BLOCK_READ_AHEAD_THREADS = 4;
+
+/** A block read and checked ahead of the caller by CBlockReadAhead */
+struct CReadAheadBlock {
+    CBlock block;
+    std::string strError;
+};
+
+/**
+ * Reads a sequence of stored blocks on a group of worker threads, so reading,
+ * deserializing and hashing them overlaps with the caller's serial work. The
+ * block hash is checked against its index entry (check level 0); VerifyDB also
+ * has the merkle root verified (part of level 1) and the undo data read back
+ * (level 2). Workers stay at most a window of blocks ahead of the caller, which
+ * consumes the results in order.
+ */
+class CBlockReadAhead
+{
+private:
+    static const size_t WINDOW = 128;
+
+    const std::vector<CBlockIndex*> vIndex;
+    const int nCheckLevel;
+    boost::thread_group threads;
+
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condResult;
+    std::vector<boost::shared_ptr<CReadAheadBlock> > vResults;
+    size_t nNextWork;
+    size_t nConsumed;
+    bool fStop;
+
+    void ThreadCheck()
+    {
+        while (true) {
+            size_t n;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && nNextWork < vIndex.size() && nNextWork >= nConsumed + WINDOW)
+                    condWorker.wait(lock);
+                if (fStop || nNextWork >= vIndex.size())
+                    return;
+                n = nNextWork++;
+            }
+
+            const CBlockIndex* pindex = vIndex[n];
+            boost::shared_ptr<CReadAheadBlock> result(new CReadAheadBlock());
+            // check level 0: read from disk
+            if (!ReadBlockFromDisk(result->block, pindex))
+                result->strError = strprintf("ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+            // check level 1: verify the merkle root, the rest of CheckBlock needs cs_main
+            if (result->strError.empty() && nCheckLevel >= 1) {
+                bool fMutated = false;
+                if (result->block.BuildMerkleTree(&fMutated) != result->block.hashMerkleRoot || fMutated)
+                    result->strError = strprintf("found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+            }
+            // check level 2: verify undo validity
+            if (result->strError.empty() && nCheckLevel >= 2) {
+                CBlockUndo undo;
+                CDiskBlockPos pos = pindex->GetUndoPos();
+                if (!pos.IsNull() && !undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
+                    result->strError = strprintf("found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            vResults[n] = result;
+            if (n == nConsumed)
+                condResult.notify_one();
+        }
+    }
+
+public:
+    CBlockReadAhead(const std::vector<CBlockIndex*>& vIndexIn, int nCheckLevelIn, int nThreads) : vIndex(vIndexIn), nCheckLevel(nCheckLevelIn), vResults(vIndexIn.size()), nNextWork(0), nConsumed(0), fStop(false)
+    {
+        for (int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&CBlockReadAhead::ThreadCheck, this));
+    }
+
+    ~CBlockReadAhead()
+    {
+        boost::this_thread::disable_interruption di;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+            condWorker.notify_all();
+        }
+        threads.join_all();
+    }
+
+    //! Wait for the checks of the n-th block; must be called in order
+    boost::shared_ptr<CReadAheadBlock> Get(size_t n)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!vResults[n])
+            condResult.wait(lock);
+        boost::shared_ptr<CReadAheadBlock> result;
+        result.swap(vResults[n]);
+        nConsumed = n + 1;
+        condWorker.notify_all();
+        return result;
+    }
+
+    //! The block Get returns next, or NULL once all have been consumed
+    const CBlockIndex* Next()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return nConsumed < vIndex.size() ? vIndex[nConsumed] : NULL;
+    }
+
+    //! The checks of the next block if it is pindex, otherwise NULL
+    boost::shared_ptr<CReadAheadBlock> GetNext(const CBlockIndex* pindex)
+    {
+        size_t n;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (nConsumed >= vIndex.size() || vIndex[nConsumed] != pindex)
+                return boost::shared_ptr<CReadAheadBlock>();
+            n = nConsumed;
+        }
+        return Get(n);
+    }
+};
+} // anon namespace
+
+/**
+ * Disconnect the active chain back to pindexFork. All blocks are undone in one
+ * coins cache and written with one chainstate flush, together with their index
+ * changes. Nothing is written if one of them fails. Wallets are told about
+ * the disconnected transactions once for the batch. The transactions to put back
+ * in the mempool are appended to vResurrect: those of the disconnected blocks,
+ * oldest first, and the mempool transactions depending on them, which are taken
+ * out until their parents are back. Pass vResurrect to ResurrectTransactions
+ * once the new tip is connected.
+ */
+static bool DisconnectTipsTo(CValidationState& state, const CBlockIndex* pindexFork, std::vector<CTransaction>& vResurrect)
+{
+    AssertLockHeld(cs_main);
     CBlockIndex* pindexDelete = chainActive.Tip();
-    assert(pindexDelete);
+    if (!pindexDelete || pindexDelete == pindexFork)
+        return true;
     mempool.check(pcoinsTip);
-    // Read block from disk.
-    CBlock block;
-    if (!ReadBlockFromDisk(block, pindexDelete))
-        return state.Abort("Failed to read block");
-    // Apply the block atomically to the chain state.
+
+    // Apply the blocks atomically to the chain state.
     int64_t nStart = GetTimeMicros();
+    std::deque<CTransaction> dequeDisconnected;
+    int nBlocks = 0;
     {
         CCoinsViewCache view(pcoinsTip);
-        if (!DisconnectBlock(block, state, pindexDelete, view))
-            return error("DisconnectTip() : DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
+        CIndexUpdates indexUpdates;
+        for (; pindexDelete != pindexFork && pindexDelete->pprev; pindexDelete = pindexDelete->pprev, nBlocks++) {
+            CBlock block;
+            if (!ReadBlockFromDisk(block, pindexDelete))
+                return state.Abort("Failed to read block");
+            if (!DisconnectBlock(block, state, pindexDelete, view, NULL, &indexUpdates))
+                return error("DisconnectTipsTo() : DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
+            BOOST_REVERSE_FOREACH (const CTransaction& tx, block.vtx)
+                dequeDisconnected.push_front(tx);
+        }
+        if (!indexUpdates.empty() && !pblocktree->WriteIndexUpdates(indexUpdates))
+            return state.Abort("Failed to write index changes of disconnected blocks");
         assert(view.Flush());
     }
-    LogPrint("bench", "- Disconnect block: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
-    // Write the chain state to disk, if necessary.
+    LogPrint("bench", "- Disconnect %d blocks: %.2fms\n", nBlocks, (GetTimeMicros() - nStart) * 0.001);
+    // Write the chain state to disk.
     if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS))
         return false;
-    // Resurrect mempool transactions from the disconnected block.
-    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
-        // ignore validation errors in resurrected transactions
-        list<CTransaction> removed;
-        CValidationState stateDummy;
-        if (tx.IsCoinBase() || tx.IsCoinStake() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
-            mempool.remove(tx, removed, true);
-    }
-    mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight);
+
+    // Take out mempool transactions spending outputs that are gone for now.
+    mempool.removeForDisconnect(dequeDisconnected, vResurrect);
+    mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight + 1);
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
-    UpdateTip(pindexDelete->pprev);
+    UpdateTip(pindexDelete);
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
-    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+    BOOST_FOREACH (const CTransaction& tx, dequeDisconnected) {
         SyncWithWallets(tx, NULL);
     }
     return true;
 }
 
+void ResurrectTransactions(const std::vector<CTransaction>& vResurrect)
+{
+    AssertLockHeld(cs_main);
+    BOOST_FOREACH (const CTransaction& tx, vResurrect) {
+        // ignore validation errors in resurrected transactions
+        list<CTransaction> removed;
+        CValidationState stateDummy;
+        if (!AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+            mempool.remove(tx, removed, true);
+    }
+    mempool.check(pcoinsTip);
+}
+
 static int64_t nTimeReadFromDisk = 0;
 static int64_t nTimeConnectTotal = 0;
 static int64_t nTimeFlush = 0;
@@ -2566,17 +3577,15 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
     return true;
 }
 
-bool DisconnectBlocksAndReprocess(int blocks)
+bool DisconnectBlocksAndReprocess(int blocks, std::vector<CTransaction>& vResurrect)
 {
     LOCK(cs_main);
 
     CValidationState state;
 
     LogPrintf("DisconnectBlocksAndReprocess: Got command to replay %d blocks\n", blocks);
-    for (int i = 0; i <= blocks; i++)
-        DisconnectTip(state);
-
-    return true;
+    const CBlockIndex* pindexFork = chainActive[std::max(0, chainActive.Height() - blocks - 1)];
+    return DisconnectTipsTo(state, pindexFork, vResurrect);
 }
 
 /*
@@ -2640,10 +3649,13 @@ bool DisconnectBlockAndInputs(CValidationState& state, CTransaction txLock)
 
     if (vDisconnect.size() > 0) {
         LogPrintf("REORGANIZE: Disconnect Conflicting Blocks %lli blocks; %s..\n", vDisconnect.size(), pindexNew->GetBlockHash().ToString());
-        BOOST_FOREACH (CBlockIndex* pindex, vDisconnect) {
+        BOOST_FOREACH (CBlockIndex* pindex, vDisconnect)
             LogPrintf(" -- disconnect %s\n", pindex->GetBlockHash().ToString());
-            DisconnectTip(state);
-        }
+        std::vector<CTransaction> vResurrect;
+        bool fDisconnected = DisconnectTipsTo(state, pindexNew, vResurrect);
+        ResurrectTransactions(vResurrect);
+        if (!fDisconnected)
+            return false;
     }
 
     return true;
@@ -2725,18 +3737,21 @@ static void PruneBlockIndexCandidates()
 /**
  * Try to make some progress towards making pindexMostWork the active block.
  * pblock is either NULL or a pointer to a CBlock corresponding to pindexMostWork.
+ * preadahead, if not NULL, may hold the blocks to connect already read from disk.
  */
-static bool ActivateBestChainStep(CValidationState& state, CBlockIndex* pindexMostWork, CBlock* pblock)
+static bool ActivateBestChainStep(CValidationState& state, CBlockIndex* pindexMostWork, CBlock* pblock, CBlockReadAhead* preadahead)
 {
     AssertLockHeld(cs_main);
     bool fInvalidFound = false;
     const CBlockIndex* pindexOldTip = chainActive.Tip();
     const CBlockIndex* pindexFork = chainActive.FindFork(pindexMostWork);
 
-    // Disconnect active blocks which are no longer in the best chain.
-    while (chainActive.Tip() && chainActive.Tip() != pindexFork) {
-        if (!DisconnectTip(state))
-            return false;
+    // Disconnect active blocks which are no longer in the best chain, in one batch. Their
+    // transactions go back to the mempool once the new blocks are connected.
+    std::vector<CTransaction> vResurrect;
+    if (!DisconnectTipsTo(state, pindexFork, vResurrect)) {
+        ResurrectTransactions(vResurrect);
+        return false;
     }
 
     // Build list of new blocks to connect.
@@ -2758,7 +3773,15 @@ static bool ActivateBestChainStep(CValidationState& state, CBlockIndex* pindexMo
 
         // Connect new blocks.
         BOOST_REVERSE_FOREACH (CBlockIndex* pindexConnect, vpindexToConnect) {
-            if (!ConnectTip(state, pindexConnect, pindexConnect == pindexMostWork ? pblock : NULL)) {
+            CBlock* pblockConnect = pindexConnect == pindexMostWork ? pblock : NULL;
+            boost::shared_ptr<CReadAheadBlock> readahead;
+            if (!pblockConnect && preadahead) {
+                // A block that failed to read ahead is read again, and reported, by ConnectTip
+                readahead = preadahead->GetNext(pindexConnect);
+                if (readahead && readahead->strError.empty())
+                    pblockConnect = &readahead->block;
+            }
+            if (!ConnectTip(state, pindexConnect, pblockConnect)) {
                 if (state.IsInvalid()) {
                     // The block violates a consensus rule.
                     if (!state.CorruptionPossible())
@@ -2769,6 +3792,7 @@ static bool ActivateBestChainStep(CValidationState& state, CBlockIndex* pindexMo
                     break;
                 } else {
                     // A system error occurred (disk space, database error, ...).
+                    ResurrectTransactions(vResurrect);
                     return false;
                 }
             } else {
@@ -2782,6 +3806,8 @@ static bool ActivateBestChainStep(CValidationState& state, CBlockIndex* pindexMo
         }
     }
 
+    ResurrectTransactions(vResurrect);
+
     // Callbacks/notifications for a new best chain.
     if (fInvalidFound)
         CheckForkWarningConditionsOnNewFork(vpindexToConnect.back());
@@ -2800,6 +3826,7 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock)
 {
     CBlockIndex* pindexNewTip = NULL;
     CBlockIndex* pindexMostWork = NULL;
+    boost::scoped_ptr<CBlockReadAhead> preadahead;
     do {
         boost::this_thread::interruption_point();
 
@@ -2817,7 +3844,24 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock)
             if (pindexMostWork == NULL || pindexMostWork == chainActive.Tip())
                 return true;
 
-            if (!ActivateBestChainStep(state, pindexMostWork, pblock && pblock->GetHash() == pindexMostWork->GetBlockHash() ? pblock : NULL))
+            CBlock* pblockMostWork = pblock && pblock->GetHash() == pindexMostWork->GetBlockHash() ? pblock : NULL;
+
+            // When catching up on a number of blocks, read them from disk ahead of connecting them.
+            const CBlockIndex* pindexTip = chainActive.Tip();
+            if (!preadahead || !preadahead->Next() || preadahead->Next()->pprev != pindexTip) {
+                preadahead.reset();
+                int nHeight = pindexTip ? pindexTip->nHeight : -1;
+                if (pindexMostWork->nHeight - nHeight >= BLOCK_READ_AHEAD_MIN && (!pindexTip || pindexMostWork->GetAncestor(nHeight) == pindexTip)) {
+                    int nEnd = std::min(pindexMostWork->nHeight - (pblockMostWork ? 1 : 0), nHeight + BLOCK_READ_AHEAD_MAX);
+                    std::vector<CBlockIndex*> vIndex(nEnd - nHeight);
+                    for (CBlockIndex* pindex = pindexMostWork->GetAncestor(nEnd); pindex && pindex->nHeight > nHeight; pindex = pindex->pprev)
+                        vIndex[pindex->nHeight - nHeight - 1] = pindex;
+                    int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency() / 2, BLOCK_READ_AHEAD_THREADS));
+                    preadahead.reset(new CBlockReadAhead(vIndex, 0, nThreads));
+                }
+            }
+
+            if (!ActivateBestChainStep(state, pindexMostWork, pblockMostWork, preadahead.get()))
                 return false;
 
             pindexNewTip = chainActive.Tip();
@@ -2860,16 +3904,19 @@ bool InvalidateBlock(CValidationState& state, CBlockIndex* pindex)
     setDirtyBlockIndex.insert(pindex);
     setBlockIndexCandidates.erase(pindex);
 
-    while (chainActive.Contains(pindex)) {
-        CBlockIndex* pindexWalk = chainActive.Tip();
-        pindexWalk->nStatus |= BLOCK_FAILED_CHILD;
-        setDirtyBlockIndex.insert(pindexWalk);
-        setBlockIndexCandidates.erase(pindexWalk);
+    if (chainActive.Contains(pindex)) {
+        for (CBlockIndex* pindexWalk = chainActive.Tip(); pindexWalk != pindex->pprev; pindexWalk = pindexWalk->pprev) {
+            pindexWalk->nStatus |= BLOCK_FAILED_CHILD;
+            setDirtyBlockIndex.insert(pindexWalk);
+            setBlockIndexCandidates.erase(pindexWalk);
+        }
         // ActivateBestChain considers blocks already in chainActive
         // unconditionally valid already, so force disconnect away from it.
-        if (!DisconnectTip(state)) {
+        std::vector<CTransaction> vResurrect;
+        bool fDisconnected = DisconnectTipsTo(state, pindex->pprev, vResurrect);
+        ResurrectTransactions(vResurrect);
+        if (!fDisconnected)
             return false;
-        }
     }
 
     // The resulting new best tip may not be in setBlockIndexCandidates anymore, so
@@ -2929,8 +3976,8 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         return it->second;
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
+    CBlockIndex* pindexNew = AllocateBlockIndex();
+    *pindexNew = CBlockIndex(block);
     // We assign the sequence id to blocks only when the full data is available,
     // to avoid miners withholding blocks but broadcasting headers, to get a
     // competitive advantage.
@@ -2938,8 +3985,13 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
     BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
 
     //mark as PoS seen
-    if (pindexNew->IsProofOfStake())
-        setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+    CBlockIndexCold cold;
+    if (block.IsProofOfStake()) {
+        cold.prevoutStake = block.vtx[1].vin[0].prevout;
+        cold.nStakeTime = block.nTime;
+        setStakeSeen.insert(make_pair(cold.prevoutStake, cold.nStakeTime));
+    }
+    SetBlockIndexCold(pindexNew, cold);
 
     pindexNew->phashBlock = &((*mi).first);
     BlockMap::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
@@ -2948,21 +4000,16 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
         pindexNew->BuildSkip();
 
-        //update previous block pointer
-        pindexNew->pprev->pnext = pindexNew;
-
-        // ppcoin: compute chain trust score
-        pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
-
         // ppcoin: compute stake entropy bit for stake modifier
         if (!pindexNew->SetStakeEntropyBit(pindexNew->GetStakeEntropyBit()))
             LogPrintf("AddToBlockIndex() : SetStakeEntropyBit() failed \n");
 
         // ppcoin: record proof-of-stake hash value
+        uint256 hashProofOfStake;
         if (pindexNew->IsProofOfStake()) {
             if (!mapProofOfStake.count(hash))
                 LogPrintf("AddToBlockIndex() : hashProofOfStake not found in map \n");
-            pindexNew->hashProofOfStake = mapProofOfStake[hash];
+            hashProofOfStake = mapProofOfStake[hash];
         }
 
         // ppcoin: compute stake modifier
@@ -2971,7 +4018,7 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         if (!ComputeNextStakeModifier(pindexNew->pprev, nStakeModifier, fGeneratedStakeModifier))
             LogPrintf("AddToBlockIndex() : ComputeNextStakeModifier() failed \n");
         pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
-        pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew);
+        pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew, hashProofOfStake);
         if (!CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
             LogPrintf("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=%s \n", pindexNew->nHeight, boost::lexical_cast<std::string>(nStakeModifier));
     }
@@ -2980,10 +4027,6 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
     if (pindexBestHeader == NULL || pindexBestHeader->nChainWork < pindexNew->nChainWork)
         pindexBestHeader = pindexNew;
 
-    //update previous block pointer
-    if (pindexNew->nHeight)
-        pindexNew->pprev->pnext = pindexNew;
-
     setDirtyBlockIndex.insert(pindexNew);
 
     return pindexNew;
@@ -3002,6 +4045,8 @@ bool ReceivedBlockTransactions(const CBlock& block, CValidationState& state, CBl
     pindexNew->nStatus |= BLOCK_HAVE_DATA;
     pindexNew->RaiseValidity(BLOCK_VALID_TRANSACTIONS);
     setDirtyBlockIndex.insert(pindexNew);
+    if (fTxIndex)
+        blockPosIndex.Add(pindexNew);
 
     if (pindexNew->pprev == NULL || pindexNew->pprev->nChainTx) {
         // If pindexNew is the genesis block or all parents are BLOCK_VALID_TRANSACTIONS.
@@ -3070,6 +4115,8 @@ bool FindBlockPos(CValidationState& state, CDiskBlockPos& pos, unsigned int nAdd
         unsigned int nOldChunks = (pos.nPos + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE;
         unsigned int nNewChunks = (vinfoBlockFile[nFile].nSize + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE;
         if (nNewChunks > nOldChunks) {
+            if (fPruneMode)
+                fCheckForPruning = true;
             if (CheckDiskSpace(nNewChunks * BLOCKFILE_CHUNK_SIZE - pos.nPos)) {
                 FILE* file = OpenBlockFile(pos);
                 if (file) {
@@ -3100,6 +4147,8 @@ bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigne
     unsigned int nOldChunks = (pos.nPos + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
     unsigned int nNewChunks = (nNewSize + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
     if (nNewChunks > nOldChunks) {
+        if (fPruneMode)
+            fCheckForPruning = true;
         if (CheckDiskSpace(nNewChunks * UNDOFILE_CHUNK_SIZE - pos.nPos)) {
             FILE* file = OpenUndoFile(pos);
             if (file) {
@@ -3445,6 +4494,9 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
         // return state.DoS(20, error("AcceptBlock() : already have block %d %s", pindex->nHeight, pindex->GetBlockHash().ToString()), REJECT_DUPLICATE, "duplicate");
         return true;
     }
+    // Blocks whose data has been pruned were fully processed before, don't store them again
+    if (pindex->nTx != 0)
+        return true;
 
     if ((!CheckBlock(block, state)) || !ContextualCheckBlock(block, state, pindex->pprev)) {
         if (state.IsInvalid() && !state.CorruptionPossible()) {
@@ -3765,20 +4817,29 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = AllocateBlockIndex();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
 
-    //mark as PoS seen
-    if (pindexNew->IsProofOfStake())
-        setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
-
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
+CBlockIndex* AllocateBlockIndex()
+{
+    return blockIndexArena.Allocate();
+}
+
+CBlockIndexCold GetBlockIndexCold(const CBlockIndex* pindex)
+{
+    return blockIndexColdTable.Get(pindex);
+}
+
+void SetBlockIndexCold(const CBlockIndex* pindex, const CBlockIndexCold& cold)
+{
+    blockIndexColdTable.Set(pindex, cold);
+}
+
 bool static LoadBlockIndexDB()
 {
     if (!pblocktree->LoadBlockIndexGuts())
@@ -3786,18 +4847,27 @@ bool static LoadBlockIndexDB()
 
     boost::this_thread::interruption_point();
 
-    // Calculate nChainWork
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
+    // Calculate nChainWork. Entries are put in height order with a counting
+    // sort, so each height is visited once and parents come before children.
+    int nMaxHeight = 0;
+    BOOST_FOREACH (const PAIRTYPE(uint256, CBlockIndex*) & item, mapBlockIndex)
+        nMaxHeight = std::max(nMaxHeight, item.second->nHeight);
+    vector<size_t> vHeightStart(nMaxHeight + 2, 0);
+    BOOST_FOREACH (const PAIRTYPE(uint256, CBlockIndex*) & item, mapBlockIndex)
+        vHeightStart[std::max(0, item.second->nHeight) + 1]++;
+    for (int nHeight = 1; nHeight <= nMaxHeight + 1; nHeight++)
+        vHeightStart[nHeight] += vHeightStart[nHeight - 1];
+    vector<pair<int, CBlockIndex*> > vSortedByHeight(mapBlockIndex.size());
     BOOST_FOREACH (const PAIRTYPE(uint256, CBlockIndex*) & item, mapBlockIndex) {
         CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        vSortedByHeight[vHeightStart[std::max(0, pindex->nHeight)]++] = make_pair(pindex->nHeight, pindex);
     }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
     BOOST_FOREACH (const PAIRTYPE(int, CBlockIndex*) & item, vSortedByHeight) {
         CBlockIndex* pindex = item.second;
         pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
-        if (pindex->nStatus & BLOCK_HAVE_DATA) {
+        // We can link the chain of blocks for which we've received transactions at some point.
+        // Pruned nodes may have deleted the block.
+        if (pindex->nTx > 0) {
             if (pindex->pprev) {
                 if (pindex->pprev->nChainTx) {
                     pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
@@ -3942,9 +5012,28 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadReindexing(fReindexing);
     fReindex |= fReindexing;
 
+    // Check whether we have ever pruned block & undo files
+    pblocktree->ReadFlag("prunedblockfiles", fHavePruned);
+    if (fHavePruned)
+        LogPrintf("LoadBlockIndexDB(): Block files have previously been pruned\n");
+
     // Check whether we have a transaction index
     pblocktree->ReadFlag("txindex", fTxIndex);
     LogPrintf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? "enabled" : "disabled");
+    if (fTxIndex)
+        blockPosIndex.Load(mapBlockIndex);
+
+    // Check whether we have an address index
+    pblocktree->ReadFlag("addressindex", fAddressIndex);
+    LogPrintf("LoadBlockIndexDB(): address index %s\n", fAddressIndex ? "enabled" : "disabled");
+
+    // Check whether we have a spent index
+    pblocktree->ReadFlag("spentindex", fSpentIndex);
+    LogPrintf("LoadBlockIndexDB(): spent index %s\n", fSpentIndex ? "enabled" : "disabled");
+
+    // Check whether we have a timestamp index
+    pblocktree->ReadFlag("timestampindex", fTimestampIndex);
+    LogPrintf("LoadBlockIndexDB(): timestamp index %s\n", fTimestampIndex ? "enabled" : "disabled");
 
     // If this is written true before the next client init, then we know the shutdown process failed
     pblocktree->WriteFlag("shutdown", false);
@@ -3993,27 +5082,40 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
     CBlockIndex* pindexFailure = NULL;
     int nGoodTransactions = 0;
     CValidationState state;
+
+    std::vector<CBlockIndex*> vIndex;
     for (CBlockIndex* pindex = chainActive.Tip(); pindex && pindex->pprev; pindex = pindex->pprev) {
-        boost::this_thread::interruption_point();
-        uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
         if (pindex->nHeight < chainActive.Height() - nCheckDepth)
             break;
-        CBlock block;
-        // check level 0: read from disk
-        if (!ReadBlockFromDisk(block, pindex))
-            return error("VerifyDB() : *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
-        // check level 1: verify block validity
-        if (nCheckLevel >= 1 && !CheckBlock(block, state))
-            return error("VerifyDB() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-        // check level 2: verify undo validity
-        if (nCheckLevel >= 2 && pindex) {
-            CBlockUndo undo;
-            CDiskBlockPos pos = pindex->GetUndoPos();
-            if (!pos.IsNull()) {
-                if (!undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
-                    return error("VerifyDB() : *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-            }
+        if (fPruneMode && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
+            // If pruning, only go back as far as we have data.
+            LogPrintf("VerifyDB(): block verification stopping at height %d (pruning, no data)\n", pindex->nHeight);
+            break;
         }
+        vIndex.push_back(pindex);
+    }
+
+    // Levels 0 to 2 are checked ahead by the reader; level 3 disconnects
+    // the blocks one by one in the order they come back.
+    CBlockReadAhead reader(vIndex, nCheckLevel, std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS)));
+    int nReportedPercent = 0;
+    for (size_t n = 0; n < vIndex.size(); n++) {
+        CBlockIndex* pindex = vIndex[n];
+        boost::this_thread::interruption_point();
+        int nPercent = std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100))));
+        uiInterface.ShowProgress(_("Verifying blocks..."), nPercent);
+        if (nPercent >= nReportedPercent + 10) {
+            nReportedPercent = nPercent - nPercent % 10;
+            LogPrintf("Verifying blocks... [%d%%]\n", nReportedPercent);
+        }
+
+        boost::shared_ptr<CReadAheadBlock> verified = reader.Get(n);
+        if (!verified->strError.empty())
+            return error("VerifyDB() : *** %s", verified->strError);
+        CBlock& block = verified->block;
+        // check level 1: the rest of the block validity checks; proof of work and merkle root are done
+        if (nCheckLevel >= 1 && !CheckBlock(block, state, false, false))
+            return error("VerifyDB() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
         if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
             bool fClean = true;
@@ -4054,7 +5156,10 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
 
 void UnloadBlockIndex()
 {
+    blockPosIndex.Clear();
+    txLookupCache.Clear();
     mapBlockIndex.clear();
+    blockIndexColdTable.Clear();
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
     pindexBestInvalid = NULL;
@@ -4079,6 +5184,18 @@ bool InitBlockIndex()
     // Use the provided setting for -txindex in the new database
     fTxIndex = GetBoolArg("-txindex", true);
     pblocktree->WriteFlag("txindex", fTxIndex);
+
+    // Use the provided setting for -addressindex in the new database
+    fAddressIndex = GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX);
+    pblocktree->WriteFlag("addressindex", fAddressIndex);
+
+    // Use the provided setting for -spentindex in the new database
+    fSpentIndex = GetBoolArg("-spentindex", DEFAULT_SPENTINDEX);
+    pblocktree->WriteFlag("spentindex", fSpentIndex);
+
+    // Use the provided setting for -timestampindex in the new database
+    fTimestampIndex = GetBoolArg("-timestampindex", DEFAULT_TIMESTAMPINDEX);
+    pblocktree->WriteFlag("timestampindex", fTimestampIndex);
     LogPrintf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -4109,6 +5226,184 @@ bool InitBlockIndex()
 }
 
 
+/** A block found in an imported file, deserialized by one of the import workers */
+struct CImportBlock {
+    uint64_t nPos;
+    unsigned int nSize;
+    std::vector<char> vRaw;
+    bool fDecoded;
+    bool fValid;
+    std::string strError;
+    CBlock block;
+    uint256 hash;
+
+    CImportBlock(uint64_t nPosIn, unsigned int nSizeIn) : nPos(nPosIn), nSize(nSizeIn), vRaw(nSizeIn), fDecoded(false), fValid(false) {}
+};
+
+/**
+ * Import of a block file in three stages. A reader thread scans the file for
+ * stored blocks, a group of workers deserializes and hashes them in parallel,
+ * and the caller takes them back in file order to connect them. The amount of
+ * data between the reader and the caller is bounded.
+ */
+class CBlockImportPipeline
+{
+private:
+    static const unsigned int MAX_BLOCKS_IN_FLIGHT = 1024;
+    static const uint64_t MAX_BYTES_IN_FLIGHT = 64 * MAX_BLOCK_SIZE;
+
+    CBufferedFile& blkdat;
+    boost::thread_group threads;
+
+    boost::mutex mutex;
+    boost::condition_variable condReader;
+    boost::condition_variable condWorker;
+    boost::condition_variable condConnect;
+    //! blocks in file order, until taken by the caller
+    std::deque<boost::shared_ptr<CImportBlock> > queueOrdered;
+    //! blocks waiting for a worker
+    std::deque<boost::shared_ptr<CImportBlock> > queueDecode;
+    uint64_t nBytesInFlight;
+    bool fEnd;
+    bool fStop;
+
+    bool Push(const boost::shared_ptr<CImportBlock>& item)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fStop && !queueOrdered.empty() &&
+               (queueOrdered.size() >= MAX_BLOCKS_IN_FLIGHT || nBytesInFlight + item->nSize > MAX_BYTES_IN_FLIGHT))
+            condReader.wait(lock);
+        if (fStop)
+            return false;
+        queueOrdered.push_back(item);
+        queueDecode.push_back(item);
+        nBytesInFlight += item->nSize;
+        condWorker.notify_one();
+        return true;
+    }
+
+    void Finish()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fEnd = true;
+        condWorker.notify_all();
+        condConnect.notify_all();
+    }
+
+    void ThreadRead()
+    {
+        try {
+            uint64_t nRewind = blkdat.GetPos();
+            while (!blkdat.eof()) {
+                blkdat.SetPos(nRewind);
+                nRewind++;         // start one byte further next time, in case of failure
+                blkdat.SetLimit(); // remove former limit
+                unsigned int nSize = 0;
+                try {
+                    // locate a header
+                    unsigned char buf[MESSAGE_START_SIZE];
+                    blkdat.FindByte(Params().MessageStart()[0]);
+                    nRewind = blkdat.GetPos() + 1;
+                    blkdat >> FLATDATA(buf);
+                    if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
+                        continue;
+                    // read size
+                    blkdat >> nSize;
+                    if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                        continue;
+                } catch (const std::exception&) {
+                    // no valid block header found; don't complain
+                    break;
+                }
+                try {
+                    // read the stored block, it is deserialized by a worker
+                    uint64_t nBlockPos = blkdat.GetPos();
+                    boost::shared_ptr<CImportBlock> item(new CImportBlock(nBlockPos, nSize));
+                    blkdat.SetLimit(nBlockPos + nSize);
+                    blkdat.read(&item->vRaw[0], nSize);
+                    nRewind = blkdat.GetPos();
+                    if (!Push(item))
+                        break;
+                } catch (const std::exception& e) {
+                    LogPrintf("%s : I/O error - %s\n", __func__, e.what());
+                }
+            }
+        } catch (const std::exception& e) {
+            LogPrintf("%s : %s\n", __func__, e.what());
+        }
+        Finish();
+    }
+
+    void ThreadDecode()
+    {
+        while (true) {
+            boost::shared_ptr<CImportBlock> item;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && !fEnd && queueDecode.empty())
+                    condWorker.wait(lock);
+                if (fStop || queueDecode.empty())
+                    return;
+                item = queueDecode.front();
+                queueDecode.pop_front();
+            }
+
+            // Deserializing computes all transaction hashes as well
+            try {
+                CMemoryReader reader(begin_ptr(item->vRaw), end_ptr(item->vRaw), SER_DISK, CLIENT_VERSION);
+                reader >> item->block;
+                item->hash = item->block.GetHash();
+                item->fValid = true;
+            } catch (const std::exception& e) {
+                item->strError = e.what();
+            }
+            std::vector<char>().swap(item->vRaw);
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            item->fDecoded = true;
+            if (!queueOrdered.empty() && item == queueOrdered.front())
+                condConnect.notify_one();
+        }
+    }
+
+public:
+    CBlockImportPipeline(CBufferedFile& blkdatIn, int nWorkers) : blkdat(blkdatIn), nBytesInFlight(0), fEnd(false), fStop(false)
+    {
+        threads.create_thread(boost::bind(&CBlockImportPipeline::ThreadRead, this));
+        for (int i = 0; i < nWorkers; i++)
+            threads.create_thread(boost::bind(&CBlockImportPipeline::ThreadDecode, this));
+    }
+
+    ~CBlockImportPipeline()
+    {
+        boost::this_thread::disable_interruption di;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+            condReader.notify_all();
+            condWorker.notify_all();
+        }
+        threads.join_all();
+    }
+
+    //! Wait for the next block in file order; false once the file is exhausted
+    bool Next(boost::shared_ptr<CImportBlock>& item)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!(fEnd && queueOrdered.empty()) && (queueOrdered.empty() || !queueOrdered.front()->fDecoded))
+            condConnect.wait(lock);
+        if (queueOrdered.empty())
+            return false;
+        item = queueOrdered.front();
+        queueOrdered.pop_front();
+        nBytesInFlight -= item->nSize;
+        condReader.notify_one();
+        if (!queueOrdered.empty() && queueOrdered.front()->fDecoded)
+            condConnect.notify_one();
+        return true;
+    }
+};
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
 {
     // Map of disk positions for blocks with unknown parent (only used for reindex)
@@ -4119,43 +5414,22 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
     try {
         // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
         CBufferedFile blkdat(fileIn, 2 * MAX_BLOCK_SIZE, MAX_BLOCK_SIZE + 8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
+        CBlockImportPipeline pipeline(blkdat, std::max(1, nScriptCheckThreads));
+        boost::shared_ptr<CImportBlock> item;
+        while (pipeline.Next(item)) {
             boost::this_thread::interruption_point();
 
-            blkdat.SetPos(nRewind);
-            nRewind++;         // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(Params().MessageStart()[0]);
-                nRewind = blkdat.GetPos() + 1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
-                break;
+            if (!item->fValid) {
+                LogPrintf("%s : Deserialize or I/O error - %s\n", __func__, item->strError);
+                continue;
             }
             try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
                 if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
+                    dbp->nPos = item->nPos;
+                CBlock& block = item->block;
 
                 // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
+                uint256 hash = item->hash;
                 if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
                     LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
                         block.hashPrevBlock.ToString());
@@ -4245,6 +5519,7 @@ void static CheckBlockIndex()
     int nHeight = 0;
     CBlockIndex* pindexFirstInvalid = NULL;         // Oldest ancestor of pindex which is invalid.
     CBlockIndex* pindexFirstMissing = NULL;         // Oldest ancestor of pindex which does not have BLOCK_HAVE_DATA.
+    CBlockIndex* pindexFirstNeverProcessed = NULL;  // Oldest ancestor of pindex for which nTx == 0.
     CBlockIndex* pindexFirstNotTreeValid = NULL;    // Oldest ancestor of pindex which does not have BLOCK_VALID_TREE (regardless of being valid or not).
     CBlockIndex* pindexFirstNotChainValid = NULL;   // Oldest ancestor of pindex which does not have BLOCK_VALID_CHAIN (regardless of being valid or not).
     CBlockIndex* pindexFirstNotScriptsValid = NULL; // Oldest ancestor of pindex which does not have BLOCK_VALID_SCRIPTS (regardless of being valid or not).
@@ -4252,6 +5527,7 @@ void static CheckBlockIndex()
         nNodes++;
         if (pindexFirstInvalid == NULL && pindex->nStatus & BLOCK_FAILED_VALID) pindexFirstInvalid = pindex;
         if (pindexFirstMissing == NULL && !(pindex->nStatus & BLOCK_HAVE_DATA)) pindexFirstMissing = pindex;
+        if (pindexFirstNeverProcessed == NULL && pindex->nTx == 0) pindexFirstNeverProcessed = pindex;
         if (pindex->pprev != NULL && pindexFirstNotTreeValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_TREE) pindexFirstNotTreeValid = pindex;
         if (pindex->pprev != NULL && pindexFirstNotChainValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_CHAIN) pindexFirstNotChainValid = pindex;
         if (pindex->pprev != NULL && pindexFirstNotScriptsValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_SCRIPTS) pindexFirstNotScriptsValid = pindex;
@@ -4262,12 +5538,19 @@ void static CheckBlockIndex()
             assert(pindex->GetBlockHash() == Params().HashGenesisBlock()); // Genesis block's hash must match.
             assert(pindex == chainActive.Genesis());                       // The current active chain's genesis block must be this block.
         }
-        // HAVE_DATA is equivalent to VALID_TRANSACTIONS and equivalent to nTx > 0 (we stored the number of transactions in the block)
-        assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
+        // VALID_TRANSACTIONS is equivalent to nTx > 0 for all nodes (whether or not pruning has occurred).
+        // HAVE_DATA is only equivalent to nTx > 0 (or VALID_TRANSACTIONS) if no pruning has occurred.
+        if (!fHavePruned) {
+            assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
+            assert(pindexFirstMissing == pindexFirstNeverProcessed);
+        } else if (pindex->nStatus & BLOCK_HAVE_DATA) {
+            assert(pindex->nTx > 0);
+        }
+        if (pindex->nStatus & BLOCK_HAVE_UNDO) assert(pindex->nStatus & BLOCK_HAVE_DATA);
         assert(((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS) == (pindex->nTx > 0));
         if (pindex->nChainTx == 0) assert(pindex->nSequenceId == 0); // nSequenceId can't be set for blocks that aren't linked
-        // All parents having data is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
-        assert((pindexFirstMissing != NULL) == (pindex->nChainTx == 0));                                             // nChainTx == 0 is used to signal that all parent block's transaction data is available.
+        // All parents having had data (at some point) is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
+        assert((pindexFirstNeverProcessed != NULL) == (pindex->nChainTx == 0));                                      // nChainTx != 0 is used to signal that all parent blocks have been processed (but may have been pruned).
         assert(pindex->nHeight == nHeight);                                                                          // nHeight must be consistent.
         assert(pindex->pprev == NULL || pindex->nChainWork >= pindex->pprev->nChainWork);                            // For every block except the genesis block, the chainwork must be larger than the parent's.
         assert(nHeight < 2 || (pindex->pskip && (pindex->pskip->nHeight < nHeight)));                                // The pskip pointer must point back for all but the first 2 blocks.
@@ -4279,11 +5562,14 @@ void static CheckBlockIndex()
             // Checks for not-invalid blocks.
             assert((pindex->nStatus & BLOCK_FAILED_MASK) == 0); // The failed mask cannot be set for blocks without invalid parents.
         }
-        if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && pindexFirstMissing == NULL) {
-            if (pindexFirstInvalid == NULL) { // If this block sorts at least as good as the current tip and is valid, it must be in setBlockIndexCandidates.
+        if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && pindexFirstNeverProcessed == NULL) {
+            // If this block sorts at least as good as the current tip, is valid and we have all data for its
+            // parents, it must be in setBlockIndexCandidates. The tip must also be there even if some data
+            // has been pruned.
+            if (pindexFirstInvalid == NULL && (pindexFirstMissing == NULL || pindex == chainActive.Tip())) {
                 assert(setBlockIndexCandidates.count(pindex));
             }
-        } else { // If this block sorts worse than the current tip, it cannot be in setBlockIndexCandidates.
+        } else { // If this block sorts worse than the current tip or some ancestor was never processed, it cannot be in setBlockIndexCandidates.
             assert(setBlockIndexCandidates.count(pindex) == 0);
         }
         // Check whether this block is in mapBlocksUnlinked.
@@ -4297,13 +5583,18 @@ void static CheckBlockIndex()
             }
             rangeUnlinked.first++;
         }
-        if (pindex->pprev && pindex->nStatus & BLOCK_HAVE_DATA && pindexFirstMissing != NULL) {
-            if (pindexFirstInvalid == NULL) { // If this block has block data available, some parent doesn't, and has no invalid parents, it must be in mapBlocksUnlinked.
+        if (pindex->pprev && pindex->nStatus & BLOCK_HAVE_DATA && pindexFirstNeverProcessed != NULL) {
+            if (pindexFirstInvalid == NULL) { // If this block has block data available, some parent was never received, and has no invalid parents, it must be in mapBlocksUnlinked.
                 assert(foundInUnlinked);
             }
-        } else { // If this block does not have block data available, or all parents do, it cannot be in mapBlocksUnlinked.
+        }
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA) || pindexFirstMissing == NULL) { // If this block does not have block data available, or all parents do, it cannot be in mapBlocksUnlinked.
             assert(!foundInUnlinked);
         }
+        if (pindex->pprev && pindex->nStatus & BLOCK_HAVE_DATA && pindexFirstNeverProcessed == NULL && pindexFirstMissing != NULL) {
+            // We have data for this block and processed all its parents at some point, but some parent's data is gone.
+            assert(fHavePruned);
+        }
         // assert(pindex->GetBlockHash() == pindex->GetBlockHeader().GetHash()); // Perhaps too slow
         // End: actual consistency checks.
 
@@ -4322,6 +5613,7 @@ void static CheckBlockIndex()
             // If pindex was the first with a certain property, unset the corresponding variable.
             if (pindex == pindexFirstInvalid) pindexFirstInvalid = NULL;
             if (pindex == pindexFirstMissing) pindexFirstMissing = NULL;
+            if (pindex == pindexFirstNeverProcessed) pindexFirstNeverProcessed = NULL;
             if (pindex == pindexFirstNotTreeValid) pindexFirstNotTreeValid = NULL;
             if (pindex == pindexFirstNotChainValid) pindexFirstNotChainValid = NULL;
             if (pindex == pindexFirstNotScriptsValid) pindexFirstNotScriptsValid = NULL;
@@ -4480,216 +5772,248 @@ void static ProcessGetData(CNode* pfrom)
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
+    // A requested block is copied straight from its block file after
+    // cs_main has been released, followed by the continuation inv if any.
+    CDiskBlockPos posRawBlock;
+    vector<CInv> vInvContinue;
 
-    while (it != pfrom->vRecvGetData.end()) {
-        // Don't bother if send buffer is too full to respond anyway
-        if (pfrom->nSendSize >= SendBufferSize())
-            break;
+    {
+        LOCK(cs_main);
 
-        const CInv& inv = *it;
-        {
-            boost::this_thread::interruption_point();
-            it++;
-
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK) {
-                bool send = false;
-                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end()) {
-                    if (chainActive.Contains(mi->second)) {
-                        send = true;
-                    } else {
-                        // To prevent fingerprinting attacks, only send blocks outside of the active
-                        // chain if they are valid, and no more than a max reorg depth than the best header
-                        // chain we know about.
-                        send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
-                               (chainActive.Height() - mi->second->nHeight < Params().MaxReorganizationDepth());
-                        if (!send) {
-                            LogPrintf("ProcessGetData(): ignoring request from peer=%i for old block that isn't in the main chain\n", pfrom->GetId());
+        while (it != pfrom->vRecvGetData.end()) {
+            // Don't bother if send buffer is too full to respond anyway
+            if (pfrom->nSendSize >= SendBufferSize())
+                break;
+
+            const CInv& inv = *it;
+            {
+                boost::this_thread::interruption_point();
+                it++;
+
+                if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK) {
+                    bool send = false;
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end()) {
+                        if (chainActive.Contains(mi->second)) {
+                            send = true;
+                        } else {
+                            // To prevent fingerprinting attacks, only send blocks outside of the active
+                            // chain if they are valid, and no more than a max reorg depth than the best header
+                            // chain we know about.
+                            send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
+                                   (chainActive.Height() - mi->second->nHeight < Params().MaxReorganizationDepth());
+                            if (!send) {
+                                LogPrintf("ProcessGetData(): ignoring request from peer=%i for old block that isn't in the main chain\n", pfrom->GetId());
+                            }
                         }
                     }
-                }
-                if (send) {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
-                    {
-                        LOCK(pfrom->cs_filter);
-                        if (pfrom->pfilter) {
-                            CMerkleBlock merkleBlock(block, *pfrom->pfilter);
-                            pfrom->PushMessage("merkleblock", merkleBlock);
-                            // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
-                            // This avoids hurting performance by pointlessly requiring a round-trip
-                            // Note that there is currently no way for a node to request any single transactions we didnt send here -
-                            // they must either disconnect and retry or request the full block.
-                            // Thus, the protocol spec specified allows for us to provide duplicate txn here,
-                            // however we MUST always provide at least what the remote peer needs
-                            typedef std::pair<unsigned int, uint256> PairType;
-                            BOOST_FOREACH (PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
-                                    pfrom->PushMessage("tx", block.vtx[pair.first]);
+                    // Pruned nodes may have deleted the block, so check whether
+                    // it's available before trying to send.
+                    if (send && !(mi->second->nStatus & BLOCK_HAVE_DATA))
+                        send = false;
+                    if (send && inv.type == MSG_BLOCK) {
+                        // The stored bytes are sent as they are once cs_main is released
+                        posRawBlock = mi->second->GetBlockPos();
+                    } else if (send) {
+                        // Send block from disk
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, (*mi).second))
+                            assert(!"cannot load block from disk");
+                        // MSG_FILTERED_BLOCK
+                        {
+                            LOCK(pfrom->cs_filter);
+                            if (pfrom->pfilter) {
+                                CMerkleBlock merkleBlock(block, *pfrom->pfilter);
+                                pfrom->PushMessage("merkleblock", merkleBlock);
+                                // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
+                                // This avoids hurting performance by pointlessly requiring a round-trip
+                                // Note that there is currently no way for a node to request any single transactions we didnt send here -
+                                // they must either disconnect and retry or request the full block.
+                                // Thus, the protocol spec specified allows for us to provide duplicate txn here,
+                                // however we MUST always provide at least what the remote peer needs
+                                typedef std::pair<unsigned int, uint256> PairType;
+                                BOOST_FOREACH (PairType& pair, merkleBlock.vMatchedTxn)
+                                    if (!pfrom->filterInventoryKnown.contains(CInv(MSG_TX, pair.second)))
+                                        pfrom->PushMessage("tx", block.vtx[pair.first]);
+                            }
+                            // else
+                            // no response
                         }
-                        // else
-                        // no response
                     }
 
                     // Trigger them to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue) {
+                    if (send && inv.hash == pfrom->hashContinue) {
                         // Bypass PushInventory, this must send even if redundant,
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
-                        vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
-                        pfrom->PushMessage("inv", vInv);
+                        vInvContinue.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
                         pfrom->hashContinue = 0;
                     }
-                }
-            } else if (inv.IsKnownType()) {
-                // Send stream from relay memory
-                bool pushed = false;
-                {
-                    LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                    if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                        pushed = true;
+                } else if (inv.IsKnownType()) {
+                    // Send stream from relay memory
+                    bool pushed = false;
+                    {
+                        LOCK(cs_mapRelay);
+                        map<CInv, CSharedPayload>::iterator mi = mapRelay.find(inv);
+                        if (mi != mapRelay.end()) {
+                            pfrom->PushSharedMessage(inv.GetCommand(), (*mi).second);
+                            pushed = true;
+                        }
                     }
-                }
 
-                if (!pushed && inv.type == MSG_TX) {
-                    CTransaction tx;
-                    if (mempool.lookup(inv.hash, tx)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << tx;
-                        pfrom->PushMessage("tx", ss);
-                        pushed = true;
+                    if (!pushed && inv.type == MSG_TX) {
+                        CTransaction tx;
+                        if (mempool.lookup(inv.hash, tx)) {
+                            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                            ss.reserve(1000);
+                            ss << tx;
+                            pfrom->PushMessage("tx", ss);
+                            pushed = true;
+                        }
                     }
-                }
-                if (!pushed && inv.type == MSG_TXLOCK_VOTE) {
-                    if (mapTxLockVote.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mapTxLockVote[inv.hash];
-                        pfrom->PushMessage("txlvote", ss);
-                        pushed = true;
+                    if (!pushed && inv.type == MSG_TXLOCK_VOTE) {
+                        if (mapTxLockVote.count(inv.hash)) {
+                            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                            ss.reserve(1000);
+                            ss << mapTxLockVote[inv.hash];
+                            pfrom->PushMessage("txlvote", ss);
+                            pushed = true;
+                        }
                     }
-                }
-                if (!pushed && inv.type == MSG_TXLOCK_REQUEST) {
-                    if (mapTxLockReq.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mapTxLockReq[inv.hash];
-                        pfrom->PushMessage("ix", ss);
-                        pushed = true;
+                    if (!pushed && inv.type == MSG_TXLOCK_REQUEST) {
+                        if (mapTxLockReq.count(inv.hash)) {
+                            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                            ss.reserve(1000);
+                            ss << mapTxLockReq[inv.hash];
+                            pfrom->PushMessage("ix", ss);
+                            pushed = true;
+                        }
                     }
-                }
-                if (!pushed && inv.type == MSG_SPORK) {
-                    if (mapSporks.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mapSporks[inv.hash];
-                        pfrom->PushMessage("spork", ss);
-                        pushed = true;
+                    if (!pushed && inv.type == MSG_SPORK) {
+                        if (mapSporks.count(inv.hash)) {
+                            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                            ss.reserve(1000);
+                            ss << mapSporks[inv.hash];
+                            pfrom->PushMessage("spork", ss);
+                            pushed = true;
+                        }
                     }
-                }
-                if (!pushed && inv.type == MSG_MASTERNODE_WINNER) {
-                    if (masternodePayments.mapMasternodePayeeVotes.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << masternodePayments.mapMasternodePayeeVotes[inv.hash];
-                        pfrom->PushMessage("mnw", ss);
-                        pushed = true;
+                    if (!pushed && inv.type == MSG_MASTERNODE_WINNER) {
+                        if (masternodePayments.mapMasternodePayeeVotes.count(inv.hash)) {
+                            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                            ss.reserve(1000);
+                            ss << masternodePayments.mapMasternodePayeeVotes[inv.hash];
+                            pfrom->PushMessage("mnw", ss);
+                            pushed = true;
+                        }
                     }
-                }
-                if (!pushed && inv.type == MSG_BUDGET_VOTE) {
-                    if (budget.mapSeenMasternodeBudgetVotes.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << budget.mapSeenMasternodeBudgetVotes[inv.hash];
-                        pfrom->PushMessage("mvote", ss);
-                        pushed = true;
+                    if (!pushed && inv.type == MSG_BUDGET_VOTE) {
+                        if (budget.mapSeenMasternodeBudgetVotes.count(inv.hash)) {
+                            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                            ss.reserve(1000);
+                            ss << budget.mapSeenMasternodeBudgetVotes[inv.hash];
+                            pfrom->PushMessage("mvote", ss);
+                            pushed = true;
+                        }
                     }
-                }
 
-                if (!pushed && inv.type == MSG_BUDGET_PROPOSAL) {
-                    if (budget.mapSeenMasternodeBudgetProposals.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << budget.mapSeenMasternodeBudgetProposals[inv.hash];
-                        pfrom->PushMessage("mprop", ss);
-                        pushed = true;
+                    if (!pushed && inv.type == MSG_BUDGET_PROPOSAL) {
+                        if (budget.mapSeenMasternodeBudgetProposals.count(inv.hash)) {
+                            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                            ss.reserve(1000);
+                            ss << budget.mapSeenMasternodeBudgetProposals[inv.hash];
+                            pfrom->PushMessage("mprop", ss);
+                            pushed = true;
+                        }
                     }
-                }
 
-                if (!pushed && inv.type == MSG_BUDGET_FINALIZED_VOTE) {
-                    if (budget.mapSeenFinalizedBudgetVotes.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << budget.mapSeenFinalizedBudgetVotes[inv.hash];
-                        pfrom->PushMessage("fbvote", ss);
-                        pushed = true;
+                    if (!pushed && inv.type == MSG_BUDGET_FINALIZED_VOTE) {
+                        if (budget.mapSeenFinalizedBudgetVotes.count(inv.hash)) {
+                            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                            ss.reserve(1000);
+                            ss << budget.mapSeenFinalizedBudgetVotes[inv.hash];
+                            pfrom->PushMessage("fbvote", ss);
+                            pushed = true;
+                        }
                     }
-                }
 
-                if (!pushed && inv.type == MSG_BUDGET_FINALIZED) {
-                    if (budget.mapSeenFinalizedBudgets.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << budget.mapSeenFinalizedBudgets[inv.hash];
-                        pfrom->PushMessage("fbs", ss);
-                        pushed = true;
+                    if (!pushed && inv.type == MSG_BUDGET_FINALIZED) {
+                        if (budget.mapSeenFinalizedBudgets.count(inv.hash)) {
+                            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                            ss.reserve(1000);
+                            ss << budget.mapSeenFinalizedBudgets[inv.hash];
+                            pfrom->PushMessage("fbs", ss);
+                            pushed = true;
+                        }
                     }
-                }
 
-                if (!pushed && inv.type == MSG_MASTERNODE_ANNOUNCE) {
-                    if (mnodeman.mapSeenMasternodeBroadcast.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mnodeman.mapSeenMasternodeBroadcast[inv.hash];
-                        pfrom->PushMessage("mnb", ss);
-                        pushed = true;
+                    if (!pushed && inv.type == MSG_MASTERNODE_ANNOUNCE) {
+                        if (mnodeman.mapSeenMasternodeBroadcast.count(inv.hash)) {
+                            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                            ss.reserve(1000);
+                            ss << mnodeman.mapSeenMasternodeBroadcast[inv.hash];
+                            pfrom->PushMessage("mnb", ss);
+                            pushed = true;
+                        }
                     }
-                }
 
-                if (!pushed && inv.type == MSG_MASTERNODE_PING) {
-                    if (mnodeman.mapSeenMasternodePing.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mnodeman.mapSeenMasternodePing[inv.hash];
-                        pfrom->PushMessage("mnp", ss);
-                        pushed = true;
+                    if (!pushed && inv.type == MSG_MASTERNODE_PING) {
+                        if (mnodeman.mapSeenMasternodePing.count(inv.hash)) {
+                            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                            ss.reserve(1000);
+                            ss << mnodeman.mapSeenMasternodePing[inv.hash];
+                            pfrom->PushMessage("mnp", ss);
+                            pushed = true;
+                        }
                     }
-                }
 
-                if (!pushed && inv.type == MSG_DSTX) {
-                    if (mapDarksendBroadcastTxes.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mapDarksendBroadcastTxes[inv.hash].tx << mapDarksendBroadcastTxes[inv.hash].vin << mapDarksendBroadcastTxes[inv.hash].vchSig << mapDarksendBroadcastTxes[inv.hash].sigTime;
+                    if (!pushed && inv.type == MSG_DSTX) {
+                        if (mapDarksendBroadcastTxes.count(inv.hash)) {
+                            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                            ss.reserve(1000);
+                            ss << mapDarksendBroadcastTxes[inv.hash].tx << mapDarksendBroadcastTxes[inv.hash].vin << mapDarksendBroadcastTxes[inv.hash].vchSig << mapDarksendBroadcastTxes[inv.hash].sigTime;
 
-                        pfrom->PushMessage("dstx", ss);
-                        pushed = true;
+                            pfrom->PushMessage("dstx", ss);
+                            pushed = true;
+                        }
                     }
-                }
 
 
-                if (!pushed) {
-                    vNotFound.push_back(inv);
+                    if (!pushed) {
+                        vNotFound.push_back(inv);
+                    }
                 }
-            }
 
-            // Track requests for our stuff.
-            g_signals.Inventory(inv.hash);
+                // Track requests for our stuff.
+                g_signals.Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
-                break;
+                if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+                    break;
+            }
+        }
+    }
+
+    if (!posRawBlock.IsNull()) {
+        // Peers fetching the same block, mostly a new tip, share its payload;
+        // only the message handler thread gets here
+        static CDiskBlockPos posLastBlock;
+        static CSharedPayload payloadLastBlock;
+        if (!payloadLastBlock || !(posLastBlock == posRawBlock)) {
+            CRawBlock raw;
+            bool fCached;
+            payloadLastBlock.reset();
+            if (blockFileReader.ReadRawBlock(posRawBlock, raw, fCached)) {
+                payloadLastBlock = boost::make_shared<CNetPayload>(raw);
+                posLastBlock = posRawBlock;
+            }
         }
+        if (payloadLastBlock)
+            pfrom->PushSharedMessage("block", payloadLastBlock);
+        else
+            LogPrintf("ProcessGetData(): unable to read block at %d:%u for peer=%i\n", posRawBlock.nFile, posRawBlock.nPos, pfrom->GetId());
     }
+    if (!vInvContinue.empty())
+        pfrom->PushMessage("inv", vInvContinue);
 
     pfrom->vRecvGetData.erase(pfrom->vRecvGetData.begin(), it);
 
@@ -4705,6 +6029,74 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+/**
+ * The masternode and budget handlers only try to lock cs_main, and give up on
+ * a message if it is taken. On a queue worker it is taken by block and
+ * transaction processing most of the time, so the workers wait for it instead
+ * of losing the gossip that payment and budget votes depend on. cs_main comes
+ * first in the lock order, and these handlers never wait for it themselves.
+ */
+static void ProcessMasternodeMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
+{
+    LOCK(cs_main);
+    mnodeman.ProcessMessage(pfrom, strCommand, vRecv);
+    masternodePayments.ProcessMessageMasternodePayments(pfrom, strCommand, vRecv);
+    masternodeSync.ProcessMessage(pfrom, strCommand, vRecv);
+}
+
+static void ProcessBudgetMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
+{
+    LOCK(cs_main);
+    budget.ProcessMessage(pfrom, strCommand, vRecv);
+}
+
+static void ProcessSporkMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
+{
+    ProcessSpork(pfrom, strCommand, vRecv);
+}
+
+static const char* const MASTERNODE_QUEUE_COMMANDS[] = {"mnb", "mnp", "dsee", "dseep", "dseg", "mnw", "mnget", "ssc"};
+static const char* const BUDGET_QUEUE_COMMANDS[] = {"mnvs", "mprop", "mvote", "fbs", "fbvote"};
+static const char* const SPORK_QUEUE_COMMANDS[] = {"spork", "getsporks"};
+
+/** The message queues, and the queue of each command they take; filled before the network starts */
+static std::vector<CMessageQueue*> vMessageQueues;
+static std::map<std::string, CMessageQueue*> mapMessageQueues;
+
+static CCriticalSection cs_statsMessageHandler;
+/** Counters of the messages handled on the message handler thread; see GetMessageQueueStats */
+static CMessageQueueStats statsMessageHandler;
+
+static void AddMessageQueue(boost::thread_group& threadGroup, const std::string& strName, MessageQueueHandler handler, const char* const* ppszCommands, size_t nCommands)
+{
+    CMessageQueue* pqueue = new CMessageQueue(strName, handler, GetArg("-msgqueuedepth", DEFAULT_MESSAGE_QUEUE_DEPTH));
+    vMessageQueues.push_back(pqueue);
+    for (size_t i = 0; i < nCommands; i++)
+        mapMessageQueues[ppszCommands[i]] = pqueue;
+    threadGroup.create_thread(boost::bind(&CMessageQueue::Thread, pqueue));
+}
+
+void StartMessageQueues(boost::thread_group& threadGroup)
+{
+    AddMessageQueue(threadGroup, "masternode", ProcessMasternodeMessage, MASTERNODE_QUEUE_COMMANDS, ARRAYLEN(MASTERNODE_QUEUE_COMMANDS));
+    AddMessageQueue(threadGroup, "budget", ProcessBudgetMessage, BUDGET_QUEUE_COMMANDS, ARRAYLEN(BUDGET_QUEUE_COMMANDS));
+    AddMessageQueue(threadGroup, "spork", ProcessSporkMessage, SPORK_QUEUE_COMMANDS, ARRAYLEN(SPORK_QUEUE_COMMANDS));
+}
+
+void GetMessageQueueStats(std::vector<CMessageQueueStats>& vStats)
+{
+    vStats.clear();
+    {
+        LOCK(cs_statsMessageHandler);
+        vStats.push_back(statsMessageHandler);
+    }
+    vStats[0].strName = "net";
+    BOOST_FOREACH (const CMessageQueue* pqueue, vMessageQueues) {
+        vStats.push_back(CMessageQueueStats());
+        pqueue->GetStats(vStats.back());
+    }
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     RandAddSeedPerfmon();
@@ -4864,7 +6256,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 {
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
+                    // at a time so the filterAddrKnowns of the chosen nodes prevent repeats
                     static uint256 hashSalt;
                     if (hashSalt == 0)
                         hashSalt = GetRandHash();
@@ -4985,6 +6377,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 LogPrint("net", "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
                 break;
             }
+            // If pruning, don't inv blocks unless we have them on disk and are likely to still have
+            // them for some reasonable time window (1 hour) that block relay might require.
+            const int nPrunedBlocksLikelyToHave = GetPruneDepth() - 3600 / Params().TargetSpacing();
+            if (fPruneMode && (!(pindex->nStatus & BLOCK_HAVE_DATA) || pindex->nHeight <= chainActive.Height() - nPrunedBlocksLikelyToHave)) {
+                LogPrint("net", "  getblocks stopping, pruned or too old block at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+                break;
+            }
             pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
             if (--nLimit <= 0) {
                 // When this block is requested, we'll send an inv that'll make them
@@ -5036,8 +6435,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
 
     else if (strCommand == "tx" || strCommand == "dstx") {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
 
         //masternode signed transaction
@@ -5099,64 +6496,21 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs, false, ignoreFees)) {
             mempool.check(pcoinsTip);
             RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
 
             LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s : accepted %s (poolsz %u)\n",
                 pfrom->id, pfrom->cleanSubVer,
                 tx.GetHash().ToString(),
                 mempool.mapTx.size());
 
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++) {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi) {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2)) {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    } else if (!fMissingInputs2) {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0) {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
-
-            BOOST_FOREACH (uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+            // Process the orphan transactions that depended on this one
+            ProcessOrphanTxs(inv.hash);
         } else if (fMissingInputs) {
             AddOrphanTx(tx, pfrom->GetId());
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
             unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+            size_t nMaxOrphanBytes = (size_t)std::max((int64_t)0, GetArg("-maxorphansize", DEFAULT_MAX_ORPHAN_POOL_SIZE)) * 1000;
+            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx, nMaxOrphanBytes);
             if (nEvicted > 0)
                 LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
         } else if (pfrom->fWhitelisted) {
@@ -5501,13 +6855,21 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
     } else {
         //probably one the extensions
-        DarKsendPool.ProcessMessageDarksend(pfrom, strCommand, vRecv);
-        mnodeman.ProcessMessage(pfrom, strCommand, vRecv);
-        budget.ProcessMessage(pfrom, strCommand, vRecv);
-        masternodePayments.ProcessMessageMasternodePayments(pfrom, strCommand, vRecv);
-        ProcessMessageInstantX(pfrom, strCommand, vRecv);
-        ProcessSpork(pfrom, strCommand, vRecv);
-        masternodeSync.ProcessMessage(pfrom, strCommand, vRecv);
+        std::map<std::string, CMessageQueue*>::iterator itQueue = mapMessageQueues.find(strCommand);
+        if (itQueue != mapMessageQueues.end()) {
+            // Masternode, budget and spork gossip is handled by the queue workers,
+            // so that it does not hold up blocks and transactions
+            itQueue->second->Push(pfrom, strCommand, vRecv, nTimeReceived);
+        } else {
+            // InstantX and Obfuscation work on the mempool like transactions do
+            DarKsendPool.ProcessMessageDarksend(pfrom, strCommand, vRecv);
+            ProcessMessageInstantX(pfrom, strCommand, vRecv);
+            if (mapMessageQueues.empty()) {
+                ProcessMasternodeMessage(pfrom, strCommand, vRecv);
+                ProcessBudgetMessage(pfrom, strCommand, vRecv);
+                ProcessSporkMessage(pfrom, strCommand, vRecv);
+            }
+        }
     }
 
 
@@ -5606,6 +6968,7 @@ bool ProcessMessages(CNode* pfrom)
 
         // Process message
         bool fRet = false;
+        int64_t nTimeStart = GetTimeMicros();
         try {
             fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
             boost::this_thread::interruption_point();
@@ -5628,6 +6991,16 @@ bool ProcessMessages(CNode* pfrom)
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
 
+        int64_t nTimeEnd = GetTimeMicros();
+        {
+            LOCK(cs_statsMessageHandler);
+            statsMessageHandler.nProcessed++;
+            statsMessageHandler.nWaitTotal += nTimeStart - msg.nTime;
+            statsMessageHandler.nWaitMax = std::max(statsMessageHandler.nWaitMax, nTimeStart - msg.nTime);
+            statsMessageHandler.nTimeTotal += nTimeEnd - nTimeStart;
+            statsMessageHandler.nTimeMax = std::max(statsMessageHandler.nTimeMax, nTimeEnd - nTimeStart);
+        }
+
         if (!fRet)
             LogPrintf("ProcessMessage(%s, %u bytes) FAILED peer=%d\n", SanitizeString(strCommand), nMessageSize, pfrom->id);
 
@@ -5687,9 +7060,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (!IsInitialBlockDownload() && (GetTime() - nLastRebroadcast > 24 * 60 * 60)) {
             LOCK(cs_vNodes);
             BOOST_FOREACH (CNode* pnode, vNodes) {
-                // Periodically clear setAddrKnown to allow refresh broadcasts
+                // Periodically clear filterAddrKnown to allow refresh broadcasts
                 if (nLastRebroadcast)
-                    pnode->setAddrKnown.clear();
+                    pnode->filterAddrKnown.reset();
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -5705,8 +7078,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH (const CAddress& addr, pto->vAddrToSend) {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second) {
+                if (!pto->filterAddrKnown.contains(addr.GetKey())) {
+                    pto->filterAddrKnown.insert(addr.GetKey());
                     vAddr.push_back(addr);
                     // receiver rejects addr messages larger than 1000
                     if (vAddr.size() >= 1000) {
@@ -5720,6 +7093,17 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 pto->PushMessage("addr", vAddr);
         }
 
+        int nPendingMisbehavior = 0;
+        {
+            LOCK(cs_pendingMisbehavior);
+            std::map<NodeId, int>::iterator it = mapPendingMisbehavior.find(pto->GetId());
+            if (it != mapPendingMisbehavior.end()) {
+                nPendingMisbehavior = it->second;
+                mapPendingMisbehavior.erase(it);
+            }
+        }
+        Misbehaving(pto->GetId(), nPendingMisbehavior);
+
         CNodeState& state = *State(pto->GetId());
         if (state.fShouldBan) {
             if (pto->fWhitelisted)
@@ -5772,7 +7156,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInv.reserve(pto->vInventoryToSend.size());
             vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH (const CInv& inv, pto->vInventoryToSend) {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv))
                     continue;
 
                 // trickle out tx inv to protect privacy
@@ -5791,8 +7175,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second) {
+                if (!pto->filterInventoryKnown.contains(inv)) {
+                    pto->filterInventoryKnown.insert(inv);
                     vInv.push_back(inv);
                     if (vInv.size() >= 1000) {
                         pto->PushMessage("inv", vInv);
@@ -5927,6 +7311,126 @@ std::string CBlockFileInfo::ToString() const
     return strprintf("CBlockFileInfo(blocks=%u, size=%u, heights=%u...%u, time=%s...%s)", nBlocks, nSize, nHeightFirst, nHeightLast, DateTimeStrFormat("%Y-%m-%d", nTimeFirst), DateTimeStrFormat("%Y-%m-%d", nTimeLast));
 }
 
+/** Version of the mempool.dat format */
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+/** Saved transactions accepted per cs_main acquisition while loading the mempool */
+static const unsigned int MEMPOOL_LOAD_BATCH = 100;
+
+bool LoadMempool()
+{
+    int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    boost::filesystem::path path = GetDataDir() / "mempool.dat";
+    CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull()) {
+        LogPrintf("%s : no saved mempool at %s\n", __func__, path.string());
+        return false;
+    }
+
+    // Read the whole file first, so cs_main is only held while validating
+    std::vector<std::pair<CTransaction, int64_t> > vEntries;
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    try {
+        uint64_t nVersion;
+        filein >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("%s : unknown mempool file version %u", __func__, nVersion);
+        uint64_t nEntries;
+        filein >> nEntries;
+        vEntries.reserve(std::min(nEntries, (uint64_t)1000000));
+        for (uint64_t i = 0; i < nEntries; i++) {
+            vEntries.push_back(std::make_pair(CTransaction(), 0));
+            filein >> vEntries.back().first >> vEntries.back().second;
+        }
+        filein >> mapDeltas;
+    } catch (const std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+
+    // Restore the deltas first, so the fee checks of the entries see them
+    for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); ++it)
+        mempool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+
+    // The entries were saved parents first, so they can be accepted in order
+    int64_t nNow = GetTime();
+    unsigned int nAccepted = 0, nFailed = 0, nExpired = 0, nAlready = 0;
+    size_t i = 0;
+    while (i < vEntries.size()) {
+        {
+            LOCK(cs_main);
+            for (size_t nEnd = std::min(i + MEMPOOL_LOAD_BATCH, vEntries.size()); i < nEnd; i++) {
+                const CTransaction& tx = vEntries[i].first;
+                int64_t nTime = vEntries[i].second;
+                if (nTime + nExpiryTimeout <= nNow) {
+                    nExpired++;
+                } else if (mempool.exists(tx.GetHash())) {
+                    nAlready++;
+                } else {
+                    CValidationState state;
+                    if (AcceptToMemoryPool(mempool, state, tx, false, NULL, false, false, nTime))
+                        nAccepted++;
+                    else
+                        nFailed++;
+                }
+            }
+        }
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            return false;
+    }
+
+    LogPrintf("%s : %u transactions accepted, %u failed, %u expired, %u already in the mempool\n", __func__, nAccepted, nFailed, nExpired, nAlready);
+    return true;
+}
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMicros();
+
+    std::vector<std::pair<CTransaction, int64_t> > vEntries;
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    {
+        LOCK(mempool.cs);
+        // Order the entries by their number of in-pool ancestors, which puts
+        // every parent before its children
+        std::multimap<size_t, CTxMemPool::txiter> mapByDepth;
+        for (CTxMemPool::txiter it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it) {
+            CTxMemPool::setEntries setAncestors;
+            mempool.CalculateAncestors(it, setAncestors);
+            mapByDepth.insert(std::make_pair(setAncestors.size(), it));
+        }
+        vEntries.reserve(mapByDepth.size());
+        for (std::multimap<size_t, CTxMemPool::txiter>::const_iterator it = mapByDepth.begin(); it != mapByDepth.end(); ++it)
+            vEntries.push_back(std::make_pair(it->second->GetTx(), it->second->GetTime()));
+        mapDeltas = mempool.mapDeltas;
+    }
+
+    int64_t nMid = GetTimeMicros();
+
+    boost::filesystem::path path = GetDataDir() / "mempool.dat";
+    boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+    try {
+        CAutoFile fileout(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        if (fileout.IsNull())
+            return error("%s : failed to open %s", __func__, pathTmp.string());
+
+        fileout << MEMPOOL_DUMP_VERSION;
+        fileout << (uint64_t)vEntries.size();
+        for (std::vector<std::pair<CTransaction, int64_t> >::const_iterator it = vEntries.begin(); it != vEntries.end(); ++it)
+            fileout << it->first << it->second;
+        fileout << mapDeltas;
+        FileCommit(fileout.Get());
+        fileout.fclose();
+    } catch (const std::exception& e) {
+        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+    }
+    if (!RenameOver(pathTmp, path))
+        return error("%s : failed to rename %s", __func__, pathTmp.string());
+
+    int64_t nLast = GetTimeMicros();
+    LogPrintf("%s : %u transactions saved, %.3fs to copy, %.3fs to write\n", __func__, vEntries.size(), (nMid - nStart) * 0.000001, (nLast - nMid) * 0.000001);
+    return true;
+}
+
 
 class CMainCleanup
 {
@@ -5935,13 +7439,12 @@ public:
     ~CMainCleanup()
     {
         // block headers
-        BlockMap::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        blockIndexArena.Clear();
 
         // orphan transactions
         mapOrphanTransactions.clear();
         mapOrphanTransactionsByPrev.clear();
+        mapOrphanPeers.clear();
     }
 } instance_of_cmaincleanup;
@@ -14,7 +14,9 @@
 #include "config/bare-config.h"
 #endif
 
+#include "addressindex.h"
 #include "amount.h"
+#include "blockmap.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "coins.h"
@@ -25,6 +27,8 @@
 #include "script/script.h"
 #include "script/sigcache.h"
 #include "script/standard.h"
+#include "spentindex.h"
+#include "timestampindex.h"
 #include "sync.h"
 #include "tinyformat.h"
 #include "txmempool.h"
@@ -51,8 +55,15 @@ class CValidationInterface;
 class CValidationState;
 
 struct CBlockTemplate;
+struct CIndexUpdates;
+struct CMessageQueueStats;
 struct CNodeStateStats;
 
+namespace boost
+{
+class thread_group;
+} // namespace boost
+
 /** Masternode Amount **/
 static const int MASTERNODEAMOUNT = 1000;
 
@@ -72,7 +83,19 @@ static const unsigned int MAX_P2SH_SIGOPS = 15;
 /** The maximum number of sigops we're willing to relay/mine in a single tx */
 static const unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS / 5;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
-static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 1000;
+/** Default for -maxorphansize, maximum kilobytes of orphan transactions kept in memory */
+static const unsigned int DEFAULT_MAX_ORPHAN_POOL_SIZE = 5000;
+/** Seconds an orphan transaction is kept waiting for its parents */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum seconds between two sweeps for expired orphan transactions */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+/** Default for -maxmempool, maximum megabytes of mempool memory usage */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Default for -persistmempool, saving the memory pool at shutdown and loading it at startup */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -103,6 +126,19 @@ static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
 static const unsigned int DATABASE_WRITE_INTERVAL = 3600;
 /** Maximum length of reject messages. */
 static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
+/** Block files containing a block-height within MIN_BLOCKS_TO_KEEP of chainActive.Tip() will not be pruned. */
+static const unsigned int MIN_BLOCKS_TO_KEEP = 288;
+/** Require that user allocate at least 550MB for block & undo files (blk???.dat and rev???.dat).
+ *  At 1MB per block, 288 blocks = 288MB; add undo data and room for a file that is still
+ *  being filled (two block chunks and an undo chunk). */
+static const uint64_t MIN_DISK_SPACE_FOR_BLOCK_FILES = 550 * 1024 * 1024;
+
+/** Default for -addressindex */
+static const bool DEFAULT_ADDRESSINDEX = false;
+/** Default for -spentindex */
+static const bool DEFAULT_SPENTINDEX = false;
+/** Default for -timestampindex */
+static const bool DEFAULT_TIMESTAMPINDEX = false;
 
 /** Enable bloom filter */
  static const bool DEFAULT_PEERBLOOMFILTERS = true;
@@ -117,14 +153,10 @@ static const unsigned char REJECT_DUST = 0x41;
 static const unsigned char REJECT_INSUFFICIENTFEE = 0x42;
 static const unsigned char REJECT_CHECKPOINT = 0x43;
 
-struct BlockHasher {
-    size_t operator()(const uint256& hash) const { return hash.GetLow64(); }
-};
-
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
-typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+typedef CBlockIndexMap BlockMap;
 extern BlockMap mapBlockIndex;
 extern uint64_t nLastBlockTx;
 extern uint64_t nLastBlockSize;
@@ -136,12 +168,22 @@ extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
+extern bool fAddressIndex;
+extern bool fSpentIndex;
+extern bool fTimestampIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
 extern unsigned int nCoinCacheSize;
 extern CFeeRate minRelayTxFee;
 extern bool fAlerts;
 
+/** True if any block files have ever been pruned. */
+extern bool fHavePruned;
+/** True if we're running in -prune mode. */
+extern bool fPruneMode;
+/** Number of bytes of block and undo files that we're trying to stay below. */
+extern uint64_t nPruneTarget;
+
 extern bool fLargeWorkForkFound;
 extern bool fLargeWorkInvalidChainFound;
 
@@ -215,6 +257,13 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/**
+ * Start the worker threads of the masternode, budget and spork message
+ * queues, which take these messages off the message handler thread.
+ */
+void StartMessageQueues(boost::thread_group& threadGroup);
+/** Counters of the message handler thread, then of each message queue */
+void GetMessageQueueStats(std::vector<CMessageQueueStats>& vStats);
 
 // ***TODO*** probably not the right place for these 2
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
@@ -226,10 +275,21 @@ bool IsInitialBlockDownload();
 std::string GetWarnings(std::string strFor);
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
 bool GetTransaction(const uint256& hash, CTransaction& tx, uint256& hashBlock, bool fAllowSlow = false);
+/** Read the balance changes of an address from the address index, optionally limited to the heights [nStart, nEnd] */
+bool GetAddressIndex(const uint160& hashBytes, int type, std::vector<std::pair<CAddressIndexKey, CAmount> >& vAddressIndex, int nStart = 0, int nEnd = 0);
+/** Read the unspent outputs of an address from the address index */
+bool GetAddressUnspent(const uint160& hashBytes, int type, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vUnspentOutputs);
+/** Look up the input spending an output in the spent index; false if it is unspent or the index is disabled */
+bool GetSpentIndex(const CSpentIndexKey& key, CSpentIndexValue& value);
+/** Read the hashes of the active chain blocks with timestamps in [nLow, nHigh) from the timestamp index */
+/** Hashes and logical times of the blocks with timestamps in [nLow, nHigh), only those of chainActive if fActiveOnly */
+bool GetTimestampIndex(unsigned int nHigh, unsigned int nLow, bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> >& vHashes);
+/** The logical time of a block for the timestamp index; needs the entry of its predecessor */
+unsigned int GetLogicalTimestamp(const CBlockIndex* pindex);
+/** Retrieve an unspent output and the hash of the block that created it from the UTXO set, without reading that block */
+bool GetUnspentOutput(const COutPoint& prevout, CTxOut& txOut, uint256& hashBlock);
 /** Find the best known block, and make it the tip of the block chain */
 
-bool DisconnectBlocksAndReprocess(int blocks);
-
 // ***TODO***
 double ConvertBitsToDouble(unsigned int nBits);
 int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCount = 0);
@@ -240,6 +300,12 @@ CAmount GetBlockValue(int nHeight);
 
 /** Create a new block index entry for a given block hash */
 CBlockIndex* InsertBlockIndex(uint256 hash);
+/** Allocate an empty block index entry that is not yet in mapBlockIndex; entries are only freed at shutdown */
+CBlockIndex* AllocateBlockIndex();
+/** Return the cold fields of a block index entry, reading them from the block tree database if needed */
+CBlockIndexCold GetBlockIndexCold(const CBlockIndex* pindex);
+/** Set the cold fields of a block index entry; they are kept in memory until the entry has been flushed */
+void SetBlockIndexCold(const CBlockIndex* pindex, const CBlockIndexCold& cold);
 /** Abort with a message */
 bool AbortNode(const std::string& msg, const std::string& userMessage = "");
 /** Get statistics from node state */
@@ -248,10 +314,19 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats& stats);
 void Misbehaving(NodeId nodeid, int howmuch);
 /** Flush all state, indexes and buffers to disk. */
 void FlushStateToDisk();
+/** Prune block files and flush state to disk. */
+void PruneAndFlush();
+/** Number of blocks below the tip whose block and undo data are never pruned */
+int GetPruneDepth();
 
 
-/** (try to) add transaction to memory pool **/
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool ignoreFees = false);
+/** (try to) add transaction to memory pool; nAcceptTime, if set, is used as its entry time **/
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool ignoreFees = false, int64_t nAcceptTime = 0);
+
+/** Load the transactions saved by DumpMempool into the memory pool */
+bool LoadMempool();
+/** Save the memory pool to disk */
+bool DumpMempool();
 
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool isDSTX = false);
 
@@ -267,6 +342,23 @@ struct CNodeStateStats {
     std::vector<int> vHeightInFlight;
 };
 
+/** A transaction whose inputs are not yet known, held until its parents arrive */
+struct COrphanTx {
+    CTransaction tx;
+    NodeId fromPeer;
+    int64_t nTimeExpire;
+    unsigned int nTxSize;
+    uint64_t nSequence; //! order of arrival
+};
+
+/** The orphans of one peer by arrival, and the bytes they take */
+struct COrphanPeer {
+    std::set<std::pair<uint64_t, uint256> > setOrphans;
+    size_t nBytes;
+
+    COrphanPeer() : nBytes(0) {}
+};
+
 struct CDiskTxPos : public CDiskBlockPos {
     unsigned int nTxOffset; // after header
 
@@ -415,6 +507,7 @@ public:
     }
 
     ScriptError GetScriptError() const { return error; }
+    unsigned int GetInputIndex() const { return nIn; }
 };
 
 
@@ -429,11 +522,18 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
 /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
  *  In case pfClean is provided, operation will try to be tolerant about errors, and *pfClean
  *  will be true if no problems were found. Otherwise, the return value will be false in case
- *  of problems. Note that in any case, coins may be modified. */
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL);
-
-/** Reprocess a number of blocks to try and get on the correct chain again **/
-bool DisconnectBlocksAndReprocess(int blocks);
+ *  of problems. Note that in any case, coins may be modified. The index changes are appended
+ *  to pindexUpdates, for the caller to write once it commits coins; none are collected if
+ *  pfClean is provided. */
+bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL, CIndexUpdates* pindexUpdates = NULL);
+
+/** Reprocess a number of blocks to try and get on the correct chain again: disconnect them,
+ *  and append the transactions to put back in the mempool to vResurrect. Pass those to
+ *  ResurrectTransactions once the best chain is active again. **/
+bool DisconnectBlocksAndReprocess(int blocks, std::vector<CTransaction>& vResurrect);
+
+/** Put transactions of disconnected blocks back in the mempool, ignoring the ones that are no longer valid */
+void ResurrectTransactions(const std::vector<CTransaction>& vResurrect);
 
 /** Apply the effects of this block (with given index) on the UTXO set represented by coins */
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck = false);
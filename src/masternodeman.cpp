@@ -982,7 +982,11 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             // should be at least not earlier than block when 1000 BARE tx got MASTERNODE_MIN_CONFIRMATIONS
             uint256 hashBlock = 0;
             CTransaction tx2;
-            GetTransaction(vin.prevout.hash, tx2, hashBlock, true);
+            if (!GetTransaction(vin.prevout.hash, tx2, hashBlock, true) && fPruneMode) {
+                // the collateral's block may have been pruned
+                CTxOut txOut;
+                GetUnspentOutput(vin.prevout, txOut, hashBlock);
+            }
             BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
             if (mi != mapBlockIndex.end() && (*mi).second) {
                 CBlockIndex* pMNIndex = (*mi).second;                                                        // block for 1000 BARE tx -> 1 confirmation
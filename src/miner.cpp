@@ -25,8 +25,10 @@
 #endif
 #include "masternode-payments.h"
 
+#include <queue>
+
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
 
 using namespace std;
 
@@ -35,51 +37,30 @@ using namespace std;
 // BareMiner
 //
 
-//
-// Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
-//
-class COrphan
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+int64_t nLastCoinStakeSearchInterval = 0;
+
+// The priority area of a block is filled by priority, so:
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
+class TxCoinAgePriorityCompare
 {
 public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
-
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b)
     {
+        if (a.first == b.first)
+            return CompareTxMemPoolEntryByScore()(*(b.second), *(a.second)); // Reverse order to make sort less than
+        return a.first < b.first;
     }
 };
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
-int64_t nLastCoinStakeSearchInterval = 0;
-
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
+// The rest of it by fee rate, in the order of the mempool's mining score index:
+class ScoreCompare
 {
-    bool byFee;
-
 public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) {}
-
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    bool operator()(const CTxMemPool::txiter a, const CTxMemPool::txiter b)
     {
-        if (byFee) {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
-        } else {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
-        }
+        return CompareTxMemPoolEntryByScore()(*b, *a); // Convert to less than
     }
 };
 
@@ -92,6 +73,259 @@ void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
         pblock->nBits = GetNextWorkRequired(pindexPrev, pblock);
 }
 
+/** Seconds after which the transaction selection is built anew instead of extended */
+static const int64_t TX_SELECTION_REBUILD_INTERVAL = 60;
+
+/**
+ * The transactions selected for the next block, kept between calls of
+ * CreateNewBlock so that staking attempts and getblocktemplate do not walk and
+ * verify the whole mempool every time. While the tip stays the same the
+ * selection is only extended with the transactions that entered the pool
+ * since; it is built anew when the tip changes, when one of its transactions
+ * left the pool, and every TX_SELECTION_REBUILD_INTERVAL seconds so that new
+ * transactions can displace worse ones. Guarded by cs_main.
+ */
+struct CTxSelection {
+    uint256 hashPrevBlock;
+    int nHeight;
+    const CCoinsViewCache* pcoinsBase;
+    unsigned int nTransactionsUpdated;
+    int64_t nTimeBuilt;
+    int64_t nTimeUpdated;
+    //! A transaction was left out for its lock time, which may end without the pool changing
+    bool fSkippedNonFinal;
+
+    std::vector<CTransaction> vtx;
+    std::vector<CAmount> vTxFees;
+    std::vector<int64_t> vTxSigOps;
+    uint64_t nBlockSize;
+    int nBlockSigOps;
+    CAmount nFees;
+
+    //! The coins of the tip with the selected transactions applied
+    boost::scoped_ptr<CCoinsViewCache> pview;
+
+    CTxSelection() : nHeight(0), pcoinsBase(NULL), nTransactionsUpdated(0), nTimeBuilt(0), nTimeUpdated(0), fSkippedNonFinal(false),
+                     nBlockSize(0), nBlockSigOps(0), nFees(0) {}
+};
+static CTxSelection txSelection;
+
+/** Bring txSelection up to date with the mempool for a block on top of pindexPrev */
+static void UpdateTxSelection(const CBlockIndex* pindexPrev, unsigned int nBlockMaxSize, unsigned int nBlockPrioritySize, unsigned int nBlockMinSize)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(mempool.cs);
+
+    CTxSelection& sel = txSelection;
+    const int nHeight = pindexPrev->nHeight + 1;
+    const int64_t nNow = GetTime();
+    const int64_t nAdjustedTime = GetAdjustedTime();
+
+    bool fRebuild = !sel.pview || sel.pcoinsBase != pcoinsTip || sel.hashPrevBlock != pindexPrev->GetBlockHash() ||
+                    sel.nHeight != nHeight || nNow - sel.nTimeBuilt >= TX_SELECTION_REBUILD_INTERVAL;
+    if (!fRebuild && sel.nTransactionsUpdated == mempool.GetTransactionsUpdated() &&
+        !(sel.fSkippedNonFinal && sel.nTimeUpdated != nAdjustedTime))
+        return;
+
+    // Extending the selection needs all its transactions to still be in the pool
+    CTxMemPool::setEntries setInBlock;
+    if (!fRebuild) {
+        BOOST_FOREACH (const CTransaction& tx, sel.vtx) {
+            CTxMemPool::txiter it = mempool.mapTx.find(tx.GetHash());
+            if (it == mempool.mapTx.end()) {
+                fRebuild = true;
+                break;
+            }
+            setInBlock.insert(it);
+        }
+    }
+    if (fRebuild) {
+        setInBlock.clear();
+        sel.hashPrevBlock = pindexPrev->GetBlockHash();
+        sel.nHeight = nHeight;
+        sel.pcoinsBase = pcoinsTip;
+        sel.nTimeBuilt = nNow;
+        sel.vtx.clear();
+        sel.vTxFees.clear();
+        sel.vTxSigOps.clear();
+        sel.nBlockSize = 1000;
+        sel.nBlockSigOps = 100;
+        sel.nFees = 0;
+        sel.pview.reset(new CCoinsViewCache(pcoinsTip));
+    }
+    sel.nTransactionsUpdated = mempool.GetTransactionsUpdated();
+    sel.nTimeUpdated = nAdjustedTime;
+    sel.fSkippedNonFinal = false;
+    CCoinsViewCache& view = *sel.pview;
+
+    bool fPrintPriority = GetBoolArg("-printpriority", false);
+
+    // The priority area is filled by priority; that needs all transactions sorted by it.
+    // An extended selection only adds to the rest.
+    vector<TxCoinAgePriority> vecPriority;
+    TxCoinAgePriorityCompare pricomparer;
+    if (fRebuild && nBlockPrioritySize > 0) {
+        vecPriority.reserve(mempool.mapTx.size());
+        for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
+             mi != mempool.mapTx.end(); ++mi) {
+            double dPriority = mi->GetPriority(nHeight);
+            CAmount dummy;
+            mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+            vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+        }
+        std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+    }
+
+    // The rest is filled walking the fee rate index. Transactions whose
+    // parents are not in the block yet wait for them; once the last one
+    // is added they join clearedTxs, and are taken from there when they
+    // pay more than the next transaction of the index.
+    CTxMemPool::setEntries setWaiting;
+    std::priority_queue<CTxMemPool::txiter, std::vector<CTxMemPool::txiter>, ScoreCompare> clearedTxs;
+    CTxMemPool::indexed_transaction_set::index<mining_score>::type::iterator mi = mempool.mapTx.get<mining_score>().begin();
+    CTxMemPool::indexed_transaction_set::index<mining_score>::type::iterator miEnd = mempool.mapTx.get<mining_score>().end();
+
+    // Collect transactions into block
+    uint64_t nBlockSize = sel.nBlockSize;
+    int nBlockSigOps = sel.nBlockSigOps;
+    CAmount nFees = sel.nFees;
+    bool fPriorityBlock = !vecPriority.empty();
+
+    while (fPriorityBlock || mi != miEnd || !clearedTxs.empty()) {
+        CTxMemPool::txiter iter;
+        bool fPriorityTx = false;
+        double dPriority = 0;
+        if (fPriorityBlock && !vecPriority.empty()) {
+            // Take highest priority transaction off the priority queue:
+            fPriorityTx = true;
+            dPriority = vecPriority.front().first;
+            iter = vecPriority.front().second;
+            std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+            vecPriority.pop_back();
+        } else if (!clearedTxs.empty() && (mi == miEnd || !CompareTxMemPoolEntryByScore()(*mi, *clearedTxs.top()))) {
+            fPriorityBlock = false;
+            iter = clearedTxs.top();
+            clearedTxs.pop();
+        } else if (mi != miEnd) {
+            fPriorityBlock = false;
+            iter = mempool.mapTx.project<0>(mi);
+            ++mi;
+        } else {
+            fPriorityBlock = false;
+            continue;
+        }
+
+        if (setInBlock.count(iter))
+            continue;
+
+        const CTransaction& tx = iter->GetTx();
+        if (tx.IsCoinBase() || tx.IsCoinStake())
+            continue;
+        if (!IsFinalTx(tx, nHeight)) {
+            sel.fSkippedNonFinal = true;
+            continue;
+        }
+
+        // Parents in the pool have to be in the block first
+        bool fParentsInBlock = true;
+        BOOST_FOREACH (CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter)) {
+            if (!setInBlock.count(parent)) {
+                fParentsInBlock = false;
+                break;
+            }
+        }
+        if (!fParentsInBlock) {
+            if (!fPriorityTx)
+                setWaiting.insert(iter);
+            continue;
+        }
+
+        // Size limits
+        unsigned int nTxSize = iter->GetTxSize();
+        if (nBlockSize + nTxSize >= nBlockMaxSize)
+            continue;
+
+        // Legacy limits on sigOps:
+        unsigned int nTxSigOps = GetLegacySigOpCount(tx);
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            continue;
+
+        // The modified fee includes any fee delta set with prioritisetransaction
+        const uint256& hash = tx.GetHash();
+        CFeeRate feeRate(iter->GetModifiedFee(), nTxSize);
+        if (!fPriorityTx && feeRate < ::minRelayTxFee) {
+            // Past the minimum block size, skip free transactions. The
+            // index is sorted by fee rate, so all following ones are too.
+            if (nBlockSize >= nBlockMinSize)
+                break;
+            if (nBlockSize + nTxSize >= nBlockMinSize)
+                continue;
+        }
+
+        // Prioritise by fee once past the priority size or we run out of high-priority
+        // transactions:
+        if (fPriorityTx && ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority))) {
+            fPriorityBlock = false;
+            // Leave it to the fee rate index, which reaches it in its turn
+            continue;
+        }
+
+        if (!view.HaveInputs(tx))
+            continue;
+
+        CAmount nTxFees = view.GetValueIn(tx) - tx.GetValueOut();
+
+        nTxSigOps += GetP2SHSigOpCount(tx, view);
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            continue;
+
+        // Note that flags: we don't want to set mempool/IsStandard()
+        // policy here, but we still have to ensure that the block we
+        // create only contains transactions that are valid in new blocks.
+        CValidationState state;
+        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+            continue;
+
+        CTxUndo txundo;
+        UpdateCoins(tx, state, view, txundo, nHeight);
+
+        // Added
+        sel.vtx.push_back(tx);
+        sel.vTxFees.push_back(nTxFees);
+        sel.vTxSigOps.push_back(nTxSigOps);
+        nBlockSize += nTxSize;
+        nBlockSigOps += nTxSigOps;
+        nFees += nTxFees;
+        setInBlock.insert(iter);
+
+        if (fPrintPriority) {
+            LogPrintf("priority %.1f fee %s txid %s\n",
+                iter->GetPriority(nHeight), feeRate.ToString(), hash.ToString());
+        }
+
+        // Release the children waiting for this transaction whose parents are all in now
+        BOOST_FOREACH (CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter)) {
+            if (!setWaiting.count(child))
+                continue;
+            bool fReady = true;
+            BOOST_FOREACH (CTxMemPool::txiter parent, mempool.GetMemPoolParents(child)) {
+                if (!setInBlock.count(parent)) {
+                    fReady = false;
+                    break;
+                }
+            }
+            if (fReady) {
+                setWaiting.erase(child);
+                clearedTxs.push(child);
+            }
+        }
+    }
+
+    sel.nBlockSize = nBlockSize;
+    sel.nBlockSigOps = nBlockSigOps;
+    sel.nFees = nFees;
+}
+
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet, bool fProofOfStake)
 {
     CReserveKey reservekey(pwallet);
@@ -121,6 +355,21 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
     pblocktemplate->vTxFees.push_back(-1);   // updated at end
     pblocktemplate->vTxSigOps.push_back(-1); // updated at end
 
+    // Largest block you're willing to create:
+    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE - 1000), nBlockMaxSize));
+
+    // How much of the block should be dedicated to high-priority transactions,
+    // included regardless of the fees they pay
+    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+
+    // Minimum block size you want to create; block will be filled with free transactions
+    // until there are no more or the block reaches this size:
+    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+
     // ppcoin: if coinstake available add coinstake tx
     static int64_t nLastCoinStakeSearchTime = GetAdjustedTime(); // only initialized at startup
 
@@ -132,6 +381,13 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
         CMutableTransaction txCoinStake;
         int64_t nSearchTime = pblock->nTime; // search to current time
         bool fStakeFound = false;
+
+        // Bring the transaction selection up to date first, so that a found kernel does not wait for it
+        {
+            LOCK2(cs_main, mempool.cs);
+            UpdateTxSelection(chainActive.Tip(), nBlockMaxSize, nBlockPrioritySize, nBlockMinSize);
+        }
+
         if (nSearchTime >= nLastCoinStakeSearchTime) {
             unsigned int nTxNewTime = 0;
             if (pwallet->CreateCoinStake(*pwallet, pblock->nBits, nSearchTime - nLastCoinStakeSearchTime, txCoinStake, nTxNewTime)) {
@@ -148,21 +404,6 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
             return NULL;
     }
 
-    // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
-    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
-    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE - 1000), nBlockMaxSize));
-
-    // How much of the block should be dedicated to high-priority transactions,
-    // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
-    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
-
-    // Minimum block size you want to create; block will be filled with free transactions
-    // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
-    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
-
     // Collect memory pool transactions into the block
     CAmount nFees = 0;
 
@@ -171,171 +412,13 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
 
         CBlockIndex* pindexPrev = chainActive.Tip();
         const int nHeight = pindexPrev->nHeight + 1;
-        CCoinsViewCache view(pcoinsTip);
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi) {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash)) {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash)) {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
 
-                    // Has to wait for dependencies
-                    if (!porphan) {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
-
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = nHeight - coins->nHeight;
-
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
-
-            CFeeRate feeRate(nTotalIn - tx.GetValueOut(), nTxSize);
-
-            if (porphan) {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
-            } else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
-        }
-
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty()) {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority))) {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            if (!view.HaveInputs(tx))
-                continue;
-
-            CAmount nTxFees = view.GetValueIn(tx) - tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
-                continue;
-
-            CTxUndo txundo;
-            UpdateCoins(tx, state, view, txundo, nHeight);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fPrintPriority) {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash)) {
-                BOOST_FOREACH (COrphan* porphan, mapDependers[hash]) {
-                    if (!porphan->setDependsOn.empty()) {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty()) {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
+        UpdateTxSelection(pindexPrev, nBlockMaxSize, nBlockPrioritySize, nBlockMinSize);
+        const CTxSelection& sel = txSelection;
+        pblock->vtx.insert(pblock->vtx.end(), sel.vtx.begin(), sel.vtx.end());
+        pblocktemplate->vTxFees.insert(pblocktemplate->vTxFees.end(), sel.vTxFees.begin(), sel.vTxFees.end());
+        pblocktemplate->vTxSigOps.insert(pblocktemplate->vTxSigOps.end(), sel.vTxSigOps.begin(), sel.vTxSigOps.end());
+        nFees = sel.nFees;
 
         //Masternode and general budget payments
         FillBlockPayee(txNew, nFees, fProofOfStake);
@@ -350,9 +433,9 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
             }
         }
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
-        LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
+        nLastBlockTx = sel.vtx.size();
+        nLastBlockSize = sel.nBlockSize;
+        LogPrintf("CreateNewBlock(): total size %u\n", sel.nBlockSize);
 
 
         // Compute final coinbase transaction.
@@ -373,6 +456,8 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
         CValidationState state;
         if (!TestBlockValidity(state, *pblock, pindexPrev, false, false)) {
             LogPrintf("CreateNewBlock() : TestBlockValidity failed\n");
+            // Do not offer the same selection again
+            txSelection.pview.reset();
             return NULL;
         }
     }
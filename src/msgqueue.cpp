@@ -0,0 +1,123 @@
+// Copyright (c) 2017-2019 The Bare developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "msgqueue.h"
+
+#include "util.h"
+#include "utilstrencodings.h"
+#include "utiltime.h"
+
+#include <algorithm>
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/thread.hpp>
+
+CMessageQueue::CMessageQueue(const std::string& strNameIn, MessageQueueHandler handlerIn, size_t nMaxDepthIn)
+    : strName(strNameIn), handler(handlerIn), nMaxDepth(std::max(nMaxDepthIn, (size_t)1))
+{
+    stats.strName = strName;
+    stats.nDepth = 0;
+    stats.nMaxDepth = nMaxDepth;
+    stats.nPeakDepth = 0;
+    stats.nProcessed = 0;
+    stats.nDropped = 0;
+    stats.nWaitTotal = 0;
+    stats.nWaitMax = 0;
+    stats.nTimeTotal = 0;
+    stats.nTimeMax = 0;
+}
+
+bool CMessageQueue::Push(CNode* pfrom, const std::string& strCommand, const CDataStream& vRecv, int64_t nTimeReceived)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    size_t& nPeerDepth = mapPeerDepth[pfrom->GetId()];
+    if (queue.size() >= nMaxDepth || nPeerDepth >= std::max(nMaxDepth / MESSAGE_QUEUE_PEER_SHARE, (size_t)1)) {
+        if (nPeerDepth == 0)
+            mapPeerDepth.erase(pfrom->GetId());
+        stats.nDropped++;
+        LogPrint("net", "%s queue full, dropped %s peer=%d\n", strName, SanitizeString(strCommand), pfrom->id);
+        return false;
+    }
+
+    {
+        LOCK(cs_vNodes);
+        pfrom->AddRef();
+    }
+    nPeerDepth++;
+    queue.push_back(CQueuedMessage(pfrom, strCommand, vRecv, nTimeReceived));
+    stats.nPeakDepth = std::max(stats.nPeakDepth, queue.size());
+    cond.notify_one();
+    return true;
+}
+
+bool CMessageQueue::ProcessNext(bool fWait)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (queue.empty()) {
+        if (!fWait)
+            return false;
+        cond.wait(lock);
+    }
+    CQueuedMessage msg = queue.front();
+    queue.pop_front();
+    std::map<NodeId, size_t>::iterator it = mapPeerDepth.find(msg.pfrom->GetId());
+    if (it != mapPeerDepth.end() && --it->second == 0)
+        mapPeerDepth.erase(it);
+    lock.unlock();
+
+    int64_t nTimeStart = GetTimeMicros();
+    try {
+        // Handlers ignore messages of peers that are going away anyway
+        if (!msg.pfrom->fDisconnect)
+            handler(msg.pfrom, msg.strCommand, msg.vRecv);
+    } catch (boost::thread_interrupted) {
+        LOCK(cs_vNodes);
+        msg.pfrom->Release();
+        throw;
+    } catch (std::ios_base::failure& e) {
+        // Malformed messages are what the message handler rejects as well
+        LogPrintf("%s queue: Exception '%s' caught handling %s peer=%d\n", strName, e.what(), SanitizeString(msg.strCommand), msg.pfrom->id);
+    } catch (std::exception& e) {
+        PrintExceptionContinue(&e, "CMessageQueue::ProcessNext()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "CMessageQueue::ProcessNext()");
+    }
+    int64_t nTimeEnd = GetTimeMicros();
+
+    {
+        LOCK(cs_vNodes);
+        msg.pfrom->Release();
+    }
+
+    lock.lock();
+    int64_t nWait = nTimeStart - msg.nTimeReceived;
+    int64_t nTime = nTimeEnd - nTimeStart;
+    stats.nProcessed++;
+    stats.nWaitTotal += nWait;
+    stats.nWaitMax = std::max(stats.nWaitMax, nWait);
+    stats.nTimeTotal += nTime;
+    stats.nTimeMax = std::max(stats.nTimeMax, nTime);
+    return true;
+}
+
+void CMessageQueue::Thread()
+{
+    std::string strThreadName = "bare-mq-" + strName;
+    RenameThread(strThreadName.c_str());
+    while (true)
+        ProcessNext(true);
+}
+
+size_t CMessageQueue::size() const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return queue.size();
+}
+
+void CMessageQueue::GetStats(CMessageQueueStats& statsOut) const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    statsOut = stats;
+    statsOut.nDepth = queue.size();
+}
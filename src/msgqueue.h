@@ -0,0 +1,100 @@
+// Copyright (c) 2017-2019 The Bare developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MSGQUEUE_H
+#define BITCOIN_MSGQUEUE_H
+
+#include "net.h"
+#include "streams.h"
+
+#include <deque>
+#include <map>
+#include <stdint.h>
+#include <string>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+/** Default for -msgqueuedepth, the most messages waiting in one message queue */
+static const unsigned int DEFAULT_MESSAGE_QUEUE_DEPTH = 5000;
+/** A peer may fill at most this fraction of a message queue */
+static const unsigned int MESSAGE_QUEUE_PEER_SHARE = 4;
+
+/** Handles one message of a subsystem; the same signature as the subsystem ProcessMessage functions */
+typedef void (*MessageQueueHandler)(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
+
+/** Counters of a message queue. Times are in microseconds. */
+struct CMessageQueueStats {
+    std::string strName;
+    size_t nDepth;
+    size_t nMaxDepth;
+    size_t nPeakDepth;
+    uint64_t nProcessed;
+    uint64_t nDropped;
+    int64_t nWaitTotal; //! time from receipt of a message to handling it
+    int64_t nWaitMax;
+    int64_t nTimeTotal; //! time spent in the handler
+    int64_t nTimeMax;
+};
+
+/**
+ * Messages of one subsystem, handled in arrival order by a worker thread of
+ * their own so that a flood of them does not hold up the message handler
+ * thread. The queue holds at most nMaxDepth messages, and one peer at most
+ * 1/MESSAGE_QUEUE_PEER_SHARE of them; further messages are dropped, as the
+ * gossip these queues carry is announced again. A queued message holds a
+ * reference to its node.
+ */
+class CMessageQueue
+{
+private:
+    struct CQueuedMessage {
+        CNode* pfrom;
+        std::string strCommand;
+        CDataStream vRecv;
+        int64_t nTimeReceived;
+
+        CQueuedMessage(CNode* pfromIn, const std::string& strCommandIn, const CDataStream& vRecvIn, int64_t nTimeReceivedIn)
+            : pfrom(pfromIn), strCommand(strCommandIn), vRecv(vRecvIn), nTimeReceived(nTimeReceivedIn) {}
+    };
+
+    const std::string strName;
+    const MessageQueueHandler handler;
+    const size_t nMaxDepth;
+
+    //! Protects the state below
+    mutable boost::mutex mutex;
+    //! The worker waits on this for messages
+    boost::condition_variable cond;
+
+    std::deque<CQueuedMessage> queue;
+    //! Queued messages per peer
+    std::map<NodeId, size_t> mapPeerDepth;
+    CMessageQueueStats stats;
+
+public:
+    CMessageQueue(const std::string& strNameIn, MessageQueueHandler handlerIn, size_t nMaxDepthIn = DEFAULT_MESSAGE_QUEUE_DEPTH);
+
+    const std::string& GetName() const { return strName; }
+
+    /**
+     * Queue a message for the worker; nTimeReceived is when it came in, in
+     * microseconds. Returns false if it was dropped because the queue is full.
+     */
+    bool Push(CNode* pfrom, const std::string& strCommand, const CDataStream& vRecv, int64_t nTimeReceived);
+
+    /**
+     * Handle the oldest queued message, waiting for one if fWait is set.
+     * Returns false if there was none.
+     */
+    bool ProcessNext(bool fWait);
+
+    /** Worker thread: handle messages until interrupted */
+    void Thread();
+
+    size_t size() const;
+    void GetStats(CMessageQueueStats& statsOut) const;
+};
+
+#endif // BITCOIN_MSGQUEUE_H
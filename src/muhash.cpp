@@ -0,0 +1,182 @@
+// Copyright (c) 2017-2019 The Bare developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "muhash.h"
+
+#include "crypto/sha256.h"
+#include "crypto/sha512.h"
+
+#include <limits>
+
+namespace
+{
+typedef CNum3072::limb_t limb_t;
+typedef CNum3072::double_limb_t double_limb_t;
+
+/** 2^3072 - MAX_PRIME_DIFF is the largest 3072-bit safe prime */
+const limb_t MAX_PRIME_DIFF = 1103717;
+const limb_t MAX_LIMB = std::numeric_limits<limb_t>::max();
+
+/** Map a 32-byte element key to a group element by expanding it with SHA-512. */
+CNum3072 ToNum3072(const uint256& key)
+{
+    unsigned char data[CNum3072::BYTE_SIZE];
+    for (unsigned char i = 0; i < CNum3072::BYTE_SIZE / CSHA512::OUTPUT_SIZE; i++)
+        CSHA512().Write(key.begin(), key.size()).Write(&i, 1).Finalize(data + i * CSHA512::OUTPUT_SIZE);
+    return CNum3072(data);
+}
+} // anon namespace
+
+CNum3072::CNum3072(const unsigned char data[BYTE_SIZE])
+{
+    for (int i = 0; i < LIMBS; i++) {
+        limbs[i] = 0;
+        for (int j = 0; j < LIMB_SIZE / 8; j++)
+            limbs[i] |= (limb_t)data[i * LIMB_SIZE / 8 + j] << (8 * j);
+    }
+}
+
+void CNum3072::SetToOne()
+{
+    limbs[0] = 1;
+    for (int i = 1; i < LIMBS; i++)
+        limbs[i] = 0;
+}
+
+void CNum3072::ToBytes(unsigned char out[BYTE_SIZE]) const
+{
+    for (int i = 0; i < LIMBS; i++) {
+        for (int j = 0; j < LIMB_SIZE / 8; j++)
+            out[i * LIMB_SIZE / 8 + j] = (unsigned char)(limbs[i] >> (8 * j));
+    }
+}
+
+bool CNum3072::IsOverflow() const
+{
+    if (limbs[0] <= MAX_LIMB - MAX_PRIME_DIFF)
+        return false;
+    for (int i = 1; i < LIMBS; i++) {
+        if (limbs[i] != MAX_LIMB)
+            return false;
+    }
+    return true;
+}
+
+void CNum3072::FullReduce()
+{
+    // Subtracting the modulus is the same as adding MAX_PRIME_DIFF and
+    // dropping the 2^3072 bit.
+    double_limb_t carry = MAX_PRIME_DIFF;
+    for (int i = 0; i < LIMBS; i++) {
+        carry += limbs[i];
+        limbs[i] = (limb_t)carry;
+        carry >>= LIMB_SIZE;
+    }
+}
+
+void CNum3072::Multiply(const CNum3072& a)
+{
+    // Schoolbook multiplication into a double-width product. Only the
+    // temporary is written while reading, so a.Multiply(a) is safe.
+    limb_t tmp[2 * LIMBS];
+    for (int i = 0; i < 2 * LIMBS; i++)
+        tmp[i] = 0;
+    for (int i = 0; i < LIMBS; i++) {
+        double_limb_t carry = 0;
+        for (int j = 0; j < LIMBS; j++) {
+            double_limb_t cur = (double_limb_t)limbs[i] * a.limbs[j] + tmp[i + j] + carry;
+            tmp[i + j] = (limb_t)cur;
+            carry = cur >> LIMB_SIZE;
+        }
+        tmp[i + LIMBS] = (limb_t)carry;
+    }
+
+    // As 2^3072 = MAX_PRIME_DIFF (mod p), fold the upper half into the lower one.
+    double_limb_t carry = 0;
+    for (int i = 0; i < LIMBS; i++) {
+        double_limb_t cur = (double_limb_t)tmp[LIMBS + i] * MAX_PRIME_DIFF + tmp[i] + carry;
+        limbs[i] = (limb_t)cur;
+        carry = cur >> LIMB_SIZE;
+    }
+
+    // The remaining carry is at most MAX_PRIME_DIFF; fold it in the same way.
+    carry *= MAX_PRIME_DIFF;
+    for (int i = 0; i < LIMBS && carry; i++) {
+        carry += limbs[i];
+        limbs[i] = (limb_t)carry;
+        carry >>= LIMB_SIZE;
+    }
+    if (carry) {
+        // Wrapped past 2^3072, which leaves a small value behind; add the
+        // residue of the dropped bit.
+        carry = MAX_PRIME_DIFF;
+        for (int i = 0; i < LIMBS && carry; i++) {
+            carry += limbs[i];
+            limbs[i] = (limb_t)carry;
+            carry >>= LIMB_SIZE;
+        }
+    }
+
+    if (IsOverflow())
+        FullReduce();
+}
+
+CNum3072 CNum3072::GetInverse() const
+{
+    // Fermat's little theorem: a^(p-2) = a^-1 (mod p). All limbs of p - 2
+    // are set except for the lowest one.
+    CNum3072 r;
+    for (int i = LIMBS - 1; i >= 0; i--) {
+        limb_t e = i == 0 ? MAX_LIMB - MAX_PRIME_DIFF - 1 : MAX_LIMB;
+        for (int b = LIMB_SIZE - 1; b >= 0; b--) {
+            r.Multiply(r);
+            if ((e >> b) & 1)
+                r.Multiply(*this);
+        }
+    }
+    return r;
+}
+
+void CNum3072::Divide(const CNum3072& a)
+{
+    Multiply(a.GetInverse());
+}
+
+CMuHash3072& CMuHash3072::Insert(const uint256& key)
+{
+    numerator.Multiply(ToNum3072(key));
+    return *this;
+}
+
+CMuHash3072& CMuHash3072::Remove(const uint256& key)
+{
+    denominator.Multiply(ToNum3072(key));
+    return *this;
+}
+
+CMuHash3072& CMuHash3072::operator*=(const CMuHash3072& mul)
+{
+    numerator.Multiply(mul.numerator);
+    denominator.Multiply(mul.denominator);
+    return *this;
+}
+
+CMuHash3072& CMuHash3072::operator/=(const CMuHash3072& div)
+{
+    numerator.Multiply(div.denominator);
+    denominator.Multiply(div.numerator);
+    return *this;
+}
+
+uint256 CMuHash3072::Finalize() const
+{
+    CNum3072 value = numerator;
+    value.Divide(denominator);
+
+    unsigned char data[CNum3072::BYTE_SIZE];
+    value.ToBytes(data);
+    uint256 hash;
+    CSHA256().Write(data, sizeof(data)).Finalize(hash.begin());
+    return hash;
+}
@@ -0,0 +1,103 @@
+// Copyright (c) 2017-2019 The Bare developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MUHASH_H
+#define BITCOIN_MUHASH_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <stdint.h>
+
+/** A 3072-bit number modulo the prime 2^3072 - 1103717. */
+class CNum3072
+{
+public:
+#ifdef __SIZEOF_INT128__
+    typedef unsigned __int128 double_limb_t;
+    typedef uint64_t limb_t;
+    static const int LIMB_SIZE = 64;
+#else
+    typedef uint64_t double_limb_t;
+    typedef uint32_t limb_t;
+    static const int LIMB_SIZE = 32;
+#endif
+    static const int LIMBS = 3072 / LIMB_SIZE;
+    static const size_t BYTE_SIZE = 384;
+
+    limb_t limbs[LIMBS];
+
+    CNum3072() { SetToOne(); }
+    explicit CNum3072(const unsigned char data[BYTE_SIZE]);
+
+    void SetToOne();
+    void Multiply(const CNum3072& a);
+    void Divide(const CNum3072& a);
+    void ToBytes(unsigned char out[BYTE_SIZE]) const;
+
+private:
+    bool IsOverflow() const;
+    void FullReduce();
+    CNum3072 GetInverse() const;
+};
+
+/**
+ * Multiplicative set hash over the group of integers modulo a 3072-bit prime.
+ *
+ * Elements are mapped into the group by expanding their 32-byte key with
+ * SHA-512, and the set is the product of its elements. Inserting and removing
+ * commute, so the hash of a set does not depend on the order in which it was
+ * built, and two hashes can be combined into the hash of the union. Removals
+ * are collected in a separate denominator so the expensive modular inverse is
+ * only needed in Finalize().
+ */
+class CMuHash3072
+{
+private:
+    CNum3072 numerator;
+    CNum3072 denominator;
+
+public:
+    CMuHash3072() {}
+
+    //! Add an element to the set
+    CMuHash3072& Insert(const uint256& key);
+
+    //! Remove an element from the set
+    CMuHash3072& Remove(const uint256& key);
+
+    //! Merge another set hash into this one (set union)
+    CMuHash3072& operator*=(const CMuHash3072& mul);
+
+    //! Subtract another set hash from this one (set difference)
+    CMuHash3072& operator/=(const CMuHash3072& div);
+
+    //! Return the 256-bit digest of the set
+    uint256 Finalize() const;
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 2 * CNum3072::BYTE_SIZE;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        unsigned char data[2 * CNum3072::BYTE_SIZE];
+        numerator.ToBytes(data);
+        denominator.ToBytes(data + CNum3072::BYTE_SIZE);
+        s.write((const char*)data, sizeof(data));
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        unsigned char data[2 * CNum3072::BYTE_SIZE];
+        s.read((char*)data, sizeof(data));
+        numerator = CNum3072(data);
+        denominator = CNum3072(data + CNum3072::BYTE_SIZE);
+    }
+};
+
+#endif // BITCOIN_MUHASH_H
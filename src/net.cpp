@@ -26,6 +26,11 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
 #endif
 
 #ifdef USE_UPNP
@@ -36,6 +41,7 @@
 #endif
 
 #include <boost/filesystem.hpp>
+#include <boost/make_shared.hpp>
 #include <boost/thread.hpp>
 
 // Dump addresses to peers.dat every 15 minutes (900s)
@@ -86,11 +92,12 @@ uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
 CAddrMan addrman;
 int nMaxConnections = 125;
+SocketEventsMode socketEventsMode = SOCKETEVENTS_SELECT;
 bool fAddressesInitialized = false;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSharedPayload> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -378,6 +385,62 @@ CNode* FindNode(const CService& addr)
     return NULL;
 }
 
+#ifdef HAVE_SYS_EPOLL_H
+static int hEpoll = -1;
+#endif
+
+std::vector<std::string> GetSocketEventsModes()
+{
+    std::vector<std::string> vModes;
+#ifdef HAVE_SYS_EPOLL_H
+    vModes.push_back("epoll");
+#endif
+    vModes.push_back("select");
+    return vModes;
+}
+
+bool SetSocketEventsMode(const std::string& strMode)
+{
+    if (strMode == "select") {
+        socketEventsMode = SOCKETEVENTS_SELECT;
+        return true;
+    }
+#ifdef HAVE_SYS_EPOLL_H
+    if (strMode == "epoll") {
+        if (hEpoll == -1)
+            hEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (hEpoll == -1) {
+            LogPrintf("epoll_create1 failed: %s, using select\n", NetworkErrorString(errno));
+            socketEventsMode = SOCKETEVENTS_SELECT;
+        } else {
+            socketEventsMode = SOCKETEVENTS_EPOLL;
+        }
+        return true;
+    }
+#endif
+    return false;
+}
+
+/** Whether the socket handler can wait for events of a socket */
+static bool IsServiceableSocket(SOCKET hSocket)
+{
+    return socketEventsMode != SOCKETEVENTS_SELECT || IsSelectableSocket(hSocket);
+}
+
+/** Watch a socket for edge-triggered events, which carry ptr; a no-op with select */
+static void RegisterSocketEvents(SOCKET hSocket, void* ptr)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (socketEventsMode != SOCKETEVENTS_EPOLL || hSocket == INVALID_SOCKET)
+        return;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = ptr;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hSocket, &event) != 0)
+        LogPrintf("epoll_ctl failed: %s\n", NetworkErrorString(errno));
+#endif
+}
+
 CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool DarKsendMaster)
 {
     if (pszDest == NULL) {
@@ -406,7 +469,7 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool DarKsendMaste
     bool proxyConnectionFailed = false;
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed)) {
-        if (!IsSelectableSocket(hSocket)) {
+        if (!IsServiceableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -422,6 +485,7 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool DarKsendMaste
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        RegisterSocketEvents(hSocket, pnode);
 
         pnode->nTimeConnected = GetTime();
         if (DarKsendMaster) pnode->fDarKsendMaster = true;
@@ -659,25 +723,85 @@ int CNetMessage::readData(const char* pch, unsigned int nBytes)
 
 
 // requires LOCK(cs_vSend)
+static unsigned int PayloadChecksum(const std::vector<char>& data)
+{
+    uint256 hash = Hash(data.begin(), data.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    return nChecksum;
+}
+
+CNetPayload::CNetPayload(const boost::shared_ptr<const std::vector<char> >& dataIn) : data(dataIn), nChecksum(PayloadChecksum(*dataIn))
+{
+}
+
+CSharedPayload MakeSharedPayload(CDataStream::const_iterator pbegin, CDataStream::const_iterator pend)
+{
+    // A plain vector: unlike CSerializeData it is not cleared when freed,
+    // which network data needs no more than it needs the copies
+    boost::shared_ptr<const std::vector<char> > data(new std::vector<char>(pbegin, pend));
+    return boost::make_shared<CNetPayload>(data);
+}
+
+/** Most buffers passed to one sendmsg call */
+static const int MAX_SEND_BUFFERS = 64;
+
 void SocketSendData(CNode* pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSendMessage>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData& data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        // Gather the unsent rest of the queued headers and payloads
+        const char* vpch[MAX_SEND_BUFFERS];
+        size_t vnLen[MAX_SEND_BUFFERS];
+        int nBuffers = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (std::deque<CSendMessage>::iterator itMsg = it; itMsg != pnode->vSendMsg.end() && nBuffers + 2 <= MAX_SEND_BUFFERS; itMsg++) {
+            const CSendMessage& msg = *itMsg;
+            assert(msg.size() > nOffset);
+            if (nOffset < CMessageHeader::HEADER_SIZE) {
+                vpch[nBuffers] = msg.pchHeader + nOffset;
+                vnLen[nBuffers++] = CMessageHeader::HEADER_SIZE - nOffset;
+                nOffset = 0;
+            } else {
+                nOffset -= CMessageHeader::HEADER_SIZE;
+            }
+            if (msg.payload->size() > nOffset) {
+                vpch[nBuffers] = &(*msg.payload->data)[nOffset];
+                vnLen[nBuffers++] = msg.payload->size() - nOffset;
+            }
+            nOffset = 0;
+        }
+
+#ifdef WIN32
+        int nBytes = send(pnode->hSocket, vpch[0], vnLen[0], MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        struct iovec iov[MAX_SEND_BUFFERS];
+        for (int i = 0; i < nBuffers; i++) {
+            iov[i].iov_base = (void*)vpch[i];
+            iov[i].iov_len = vnLen[i];
+        }
+        struct msghdr msghdr;
+        memset(&msghdr, 0, sizeof(msghdr));
+        msghdr.msg_iov = iov;
+        msghdr.msg_iovlen = nBuffers;
+        ssize_t nBytes = sendmsg(pnode->hSocket, &msghdr, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            // Drop the messages that went out completely
+            size_t nSent = nBytes;
+            while (nSent > 0 && nSent >= it->size() - pnode->nSendOffset) {
+                nSent -= it->size() - pnode->nSendOffset;
+                pnode->nSendSize -= it->size();
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
                 it++;
-            } else {
+            }
+            if (nSent > 0) {
                 // could not send full message; stop sending more
+                pnode->nSendOffset += nSent;
                 break;
             }
         } else {
@@ -703,65 +827,326 @@ void SocketSendData(CNode* pnode)
 
 static list<CNode*> vNodesDisconnected;
 
-void ThreadSocketHandler()
+/** Whether a node has room to receive more; requires LOCK(cs_vRecvMsg) */
+static bool HasRecvSpace(CNode* pnode)
+{
+    return pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+           pnode->GetTotalRecvSize() <= ReceiveFloodSize();
+}
+
+/**
+ * Receive what the socket of a node has, up to 64 KiB; requires
+ * LOCK(cs_vRecvMsg). Returns false if nothing could be read without blocking.
+ */
+static bool SocketRecvData(CNode* pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0) {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+    } else if (nBytes == 0) {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    } else if (nBytes < 0) {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr == WSAEWOULDBLOCK)
+            return false;
+        if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return true;
+}
+
+/** Accept a connection on a listening socket. Returns false if there was none to accept. */
+static bool AcceptConnection(const ListenSocket& hListenSocket)
 {
-    unsigned int nPrevNodeCount = 0;
-    while (true) {
-        //
-        // Disconnect nodes
-        //
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+    bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
+        return false;
+    } else if (!IsServiceableSocket(hSocket)) {
+        LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
+        LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else if (CNode::IsBanned(addr) && !whitelisted) {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else {
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        pnode->fWhitelisted = whitelisted;
+
         {
             LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH (CNode* pnode, vNodesCopy) {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty())) {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+            vNodes.push_back(pnode);
+        }
+        RegisterSocketEvents(hSocket, pnode);
+    }
+    return true;
+}
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+/** Disconnect a node that has been silent, or has not answered a ping, for too long */
+static void InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60) {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0) {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        } else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL) {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        } else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90 * 60)) {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        } else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros()) {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+/**
+ * Disconnect the nodes flagged for it or no longer referenced, delete the
+ * disconnected ones no thread uses anymore, and report the node count.
+ */
+static void DisconnectNodes()
+{
+    static unsigned int nPrevNodeCount = 0;
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+    {
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH (CNode* pnode, vNodesCopy) {
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty())) {
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
+
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
+
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
-        {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH (CNode* pnode, vNodesDisconnectedCopy) {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0) {
-                    bool fDelete = false;
-                    {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend) {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv) {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH (CNode* pnode, vNodesDisconnectedCopy) {
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0) {
+                bool fDelete = false;
+                {
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend) {
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv) {
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete) {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
                 }
+                if (fDelete) {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
+                }
+            }
+        }
+    }
+    if (vNodes.size() != nPrevNodeCount) {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/** Most events taken from the kernel per round */
+static const int MAX_SOCKET_EVENTS = 256;
+
+/** Nodes with readiness not acted upon yet, each holding a reference */
+static vector<CNode*> vNodesReady;
+
+// requires LOCK(cs_vNodes)
+static void QueueReadyNode(CNode* pnode)
+{
+    if (pnode->fSocketQueued)
+        return;
+    pnode->fSocketQueued = true;
+    pnode->AddRef();
+    vNodesReady.push_back(pnode);
+}
+
+/**
+ * One round of the socket handler with edge-triggered epoll. Events only mark
+ * their sockets ready; then the nodes with pending readiness are serviced,
+ * and keep it until a read or write would block. Timeouts are checked,
+ * nodes with queued data retried, and disconnected nodes removed in a sweep
+ * over all peers once a second, or right after a round closed a socket; the
+ * other rounds only touch the nodes that have events.
+ */
+static void ServiceSocketEvents()
+{
+    static bool fProgress = false;
+    static int64_t nLastSweep = 0;
+    bool fSweep = false;
+
+    struct epoll_event events[MAX_SOCKET_EVENTS];
+    // Do not sleep while the last round could read or write
+    int nEvents = epoll_wait(hEpoll, events, MAX_SOCKET_EVENTS, fProgress ? 0 : 50);
+    boost::this_thread::interruption_point();
+    if (nEvents < 0) {
+        if (errno != EINTR)
+            LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(errno));
+        nEvents = 0;
+    }
+
+    vector<const ListenSocket*> vListenReady;
+    {
+        LOCK(cs_vNodes);
+        for (int i = 0; i < nEvents; i++) {
+            const void* ptr = events[i].data.ptr;
+            if (!vhListenSocket.empty() && ptr >= &vhListenSocket.front() && ptr <= &vhListenSocket.back()) {
+                vListenReady.push_back(static_cast<const ListenSocket*>(ptr));
+                continue;
+            }
+            CNode* pnode = static_cast<CNode*>(events[i].data.ptr);
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                pnode->fSocketRecvReady = true;
+            if (events[i].events & EPOLLOUT)
+                pnode->fSocketSendReady = true;
+            QueueReadyNode(pnode);
+        }
+
+        int64_t nNow = GetTime();
+        if (nNow != nLastSweep) {
+            nLastSweep = nNow;
+            fSweep = true;
+            BOOST_FOREACH (CNode* pnode, vNodes) {
+                InactivityCheck(pnode);
+                // Data left over by a write that raced with an event
+                if (pnode->nSendSize > 0) {
+                    pnode->fSocketSendReady = true;
+                    QueueReadyNode(pnode);
+                }
+            }
+        }
+    }
+
+    // Accept until the backlog is empty; there is no new event before that
+    BOOST_FOREACH (const ListenSocket* pListenSocket, vListenReady)
+        while (AcceptConnection(*pListenSocket)) {
+        }
+
+    fProgress = false;
+    vector<CNode*> vNodesDone;
+    for (unsigned int i = 0; i < vNodesReady.size();) {
+        CNode* pnode = vNodesReady[i];
+        boost::this_thread::interruption_point();
+
+        if (pnode->hSocket != INVALID_SOCKET && pnode->fSocketRecvReady) {
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (lockRecv && HasRecvSpace(pnode)) {
+                if (SocketRecvData(pnode))
+                    fProgress = true;
+                else
+                    pnode->fSocketRecvReady = false;
+            }
+        }
+
+        if (pnode->hSocket != INVALID_SOCKET && pnode->fSocketSendReady) {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend) {
+                if (!pnode->vSendMsg.empty()) {
+                    SocketSendData(pnode);
+                    fProgress = true;
+                }
+                // A write that could not finish fills the socket buffer, and
+                // the next event comes when it drains
+                pnode->fSocketSendReady = false;
             }
         }
-        if (vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+
+        if (pnode->hSocket == INVALID_SOCKET || (!pnode->fSocketRecvReady && !pnode->fSocketSendReady)) {
+            if (pnode->hSocket == INVALID_SOCKET)
+                fSweep = true;
+            pnode->fSocketQueued = false;
+            vNodesDone.push_back(pnode);
+            vNodesReady[i] = vNodesReady.back();
+            vNodesReady.pop_back();
+        } else {
+            i++;
+        }
+    }
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodesDone)
+            pnode->Release();
+    }
+
+    if (fSweep)
+        DisconnectNodes();
+}
+#endif
+
+void ThreadSocketHandler()
+{
+    BOOST_FOREACH (ListenSocket& hListenSocket, vhListenSocket)
+        RegisterSocketEvents(hListenSocket.socket, &hListenSocket);
+
+    while (true) {
+#ifdef HAVE_SYS_EPOLL_H
+        if (socketEventsMode == SOCKETEVENTS_EPOLL) {
+            ServiceSocketEvents();
+            continue;
         }
+#endif
+
+        //
+        // Disconnect nodes
+        //
+        DisconnectNodes();
 
         //
         // Find which sockets have data to receive
@@ -818,8 +1203,7 @@ void ThreadSocketHandler()
                 }
                 {
                     TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                    if (lockRecv && HasRecvSpace(pnode))
                         FD_SET(pnode->hSocket, &fdsetRecv);
                 }
             }
@@ -845,49 +1229,8 @@ void ThreadSocketHandler()
         // Accept new connections
         //
         BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv)) {
-                struct sockaddr_storage sockaddr;
-                socklen_t len = sizeof(sockaddr);
-                SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
-                CAddress addr;
-                int nInbound = 0;
-
-                if (hSocket != INVALID_SOCKET)
-                    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                        LogPrintf("Warning: Unknown socket family\n");
-
-                bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
-                {
-                    LOCK(cs_vNodes);
-                    BOOST_FOREACH (CNode* pnode, vNodes)
-                        if (pnode->fInbound)
-                            nInbound++;
-                }
-
-                if (hSocket == INVALID_SOCKET) {
-                    int nErr = WSAGetLastError();
-                    if (nErr != WSAEWOULDBLOCK)
-                        LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                } else if (!IsSelectableSocket(hSocket)) {
-                    LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
-                    LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else if (CNode::IsBanned(addr) && !whitelisted) {
-                    LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else {
-                    CNode* pnode = new CNode(hSocket, addr, "", true);
-                    pnode->AddRef();
-                    pnode->fWhitelisted = whitelisted;
-
-                    {
-                        LOCK(cs_vNodes);
-                        vNodes.push_back(pnode);
-                    }
-                }
-            }
+            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+                AcceptConnection(hListenSocket);
         }
 
         //
@@ -910,33 +1253,8 @@ void ThreadSocketHandler()
                 continue;
             if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError)) {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv) {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0) {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        } else if (nBytes == 0) {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        } else if (nBytes < 0) {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                if (lockRecv)
+                    SocketRecvData(pnode);
             }
 
             //
@@ -953,22 +1271,7 @@ void ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60) {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0) {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                } else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL) {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                } else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90 * 60)) {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                } else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros()) {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1450,7 +1753,7 @@ bool BindListenPort(const CService& addrBind, string& strError, bool fWhiteliste
         LogPrintf("%s\n", strError);
         return false;
     }
-    if (!IsSelectableSocket(hListenSocket)) {
+    if (!IsServiceableSocket(hListenSocket)) {
         strError = "Error: Couldn't create a listenable socket for incoming connections";
         LogPrintf("%s\n", strError);
         return false;
@@ -1649,6 +1952,12 @@ public:
             if (hListenSocket.socket != INVALID_SOCKET)
                 if (!CloseSocket(hListenSocket.socket))
                     LogPrintf("CloseSocket(hListenSocket) failed with error %s\n", NetworkErrorString(WSAGetLastError()));
+#ifdef HAVE_SYS_EPOLL_H
+        if (hEpoll != -1)
+            close(hEpoll);
+        hEpoll = -1;
+        vNodesReady.clear();
+#endif
 
         // clean up some globals (to help leak detection)
         BOOST_FOREACH (CNode* pnode, vNodes)
@@ -1698,7 +2007,7 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
         }
 
         // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        mapRelay.insert(std::make_pair(inv, MakeSharedPayload(ss)));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
@@ -1893,7 +2202,7 @@ bool CAddrDB::Read(CAddrMan& addr)
 unsigned int ReceiveFloodSize() { return 1000 * GetArg("-maxreceivebuffer", 5 * 1000); }
 unsigned int SendBufferSize() { return 1000 * GetArg("-maxsendbuffer", 1 * 1000); }
 
-CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), filterAddrKnown(5000, 0.001), filterInventoryKnown(SendBufferSize() / 100, 0.000001)
 {
     nServices = 0;
     hSocket = hSocketIn;
@@ -1914,6 +2223,9 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     fNetworkNode = false;
     fSuccessfullyConnected = false;
     fDisconnect = false;
+    fSocketRecvReady = false;
+    fSocketSendReady = false;
+    fSocketQueued = false;
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
@@ -1921,7 +2233,6 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nStartingHeight = -1;
     fGetAddr = false;
     fRelayTxes = false;
-    setInventoryKnown.max_size(SendBufferSize() / 1000);
     pfilter = new CBloomFilter();
     nPingNonceSent = 0;
     nPingUsecStart = 0;
@@ -2019,26 +2330,44 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
     if (ssSend.size() == 0)
         return;
 
-    // Set the size
-    unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
+    // Set the size and the checksum of the payload
+    assert(ssSend.size() >= CMessageHeader::HEADER_SIZE);
+    CSendMessage msg;
+    msg.payload = MakeSharedPayload(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
+    unsigned int nSize = msg.payload->size();
     memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
-
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-    unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &msg.payload->nChecksum, sizeof(msg.payload->nChecksum));
+    memcpy(msg.pchHeader, &ssSend[0], CMessageHeader::HEADER_SIZE);
+    ssSend.clear();
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    QueueSendMessage(msg);
+
+    LEAVE_CRITICAL_SECTION(cs_vSend);
+}
+
+void CNode::PushSharedMessage(const char* pszCommand, const CSharedPayload& payload)
+{
+    CMessageHeader hdr(pszCommand, payload->size());
+    CSendMessage msg;
+    memcpy(msg.pchHeader, hdr.pchMessageStart, MESSAGE_START_SIZE);
+    memcpy(msg.pchHeader + MESSAGE_START_SIZE, hdr.pchCommand, CMessageHeader::COMMAND_SIZE);
+    memcpy(msg.pchHeader + CMessageHeader::MESSAGE_SIZE_OFFSET, &hdr.nMessageSize, sizeof(hdr.nMessageSize));
+    memcpy(msg.pchHeader + CMessageHeader::CHECKSUM_OFFSET, &payload->nChecksum, sizeof(payload->nChecksum));
+    msg.payload = payload;
+
+    LOCK(cs_vSend);
+    LogPrint("net", "sending: %s (%d bytes, shared) peer=%d\n", SanitizeString(pszCommand), payload->size(), id);
+    QueueSendMessage(msg);
+}
+
+void CNode::QueueSendMessage(const CSendMessage& msg)
+{
+    vSendMsg.push_back(msg);
+    nSendSize += msg.size();
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (vSendMsg.size() == 1)
         SocketSendData(this);
-
-    LEAVE_CRITICAL_SECTION(cs_vSend);
 }
@@ -10,7 +10,6 @@
 #include "compat.h"
 #include "hash.h"
 #include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "random.h"
@@ -20,6 +19,7 @@
 #include "utilstrencodings.h"
 
 #include <deque>
+#include <set>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -28,6 +28,7 @@
 
 #include <boost/filesystem/path.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 
 class CAddrMan;
@@ -60,9 +61,20 @@ static const bool DEFAULT_UPNP = false;
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 
+/** How the socket handler thread waits for socket events */
+enum SocketEventsMode {
+    SOCKETEVENTS_SELECT, //! select() on every socket each round; only sockets below FD_SETSIZE
+    SOCKETEVENTS_EPOLL,  //! edge-triggered epoll, Linux only
+};
+
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
 
+/** The socket events modes this build supports, the default first */
+std::vector<std::string> GetSocketEventsModes();
+/** Choose the socket events mode, before any socket is created; false if it is not supported */
+bool SetSocketEventsMode(const std::string& strMode);
+
 void AddOneShot(std::string strDest);
 bool RecvLine(SOCKET hSocket, std::string& strLine);
 void AddressCurrentlyConnected(const CService& addr);
@@ -78,6 +90,40 @@ void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode* pnode);
 
+/**
+ * A serialized message payload and its checksum. It is never changed once
+ * made, so one payload, such as a relayed transaction or a requested block,
+ * can wait in the send queues of many peers while being serialized and
+ * hashed only once.
+ */
+class CNetPayload
+{
+public:
+    //! The bytes; may be shared with the block file reader cache
+    const boost::shared_ptr<const std::vector<char> > data;
+    const unsigned int nChecksum;
+
+    explicit CNetPayload(const boost::shared_ptr<const std::vector<char> >& dataIn);
+
+    size_t size() const { return data->size(); }
+};
+typedef boost::shared_ptr<const CNetPayload> CSharedPayload;
+
+/** Payload holding a copy of the bytes between pbegin and pend */
+CSharedPayload MakeSharedPayload(CDataStream::const_iterator pbegin, CDataStream::const_iterator pend);
+inline CSharedPayload MakeSharedPayload(const CDataStream& ss)
+{
+    return MakeSharedPayload(ss.begin(), ss.end());
+}
+
+/** A message in the send queue of a node: its own header, and a payload it may share */
+struct CSendMessage {
+    char pchHeader[CMessageHeader::HEADER_SIZE];
+    CSharedPayload payload;
+
+    size_t size() const { return CMessageHeader::HEADER_SIZE + payload->size(); }
+};
+
 typedef int NodeId;
 
 // Signals for message handling
@@ -125,10 +171,11 @@ extern uint64_t nLocalServices;
 extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
 extern int nMaxConnections;
+extern SocketEventsMode socketEventsMode;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSharedPayload> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -221,7 +268,7 @@ public:
     size_t nSendSize;   // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSendMessage> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -249,6 +296,12 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    // Readiness of the socket reported by edge-triggered events and not acted
+    // upon yet, and whether the node waits in the socket handler's ready list.
+    // Only used by the socket handler thread.
+    bool fSocketRecvReady;
+    bool fSocketSendReady;
+    bool fSocketQueued;
     // We use fRelayTxes for two purposes -
     // a) it allows us to not relay tx invs before receiving the peer's version message
     // b) the peer may tell us in their version message that we should not relay tx invs
@@ -288,12 +341,12 @@ public:
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
-    mruset<CAddress> setAddrKnown;
+    CRollingBloomFilter filterAddrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
@@ -368,7 +421,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
-        setAddrKnown.insert(addr);
+        filterAddrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
@@ -376,7 +429,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
-        if (addr.IsValid() && !setAddrKnown.count(addr)) {
+        if (addr.IsValid() && !filterAddrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
             } else {
@@ -390,7 +443,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv);
         }
     }
 
@@ -398,7 +451,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv))
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -414,6 +467,15 @@ public:
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
     void EndMessage() UNLOCK_FUNCTION(cs_vSend);
 
+    /** Queue a message with a payload serialized beforehand, which other peers may share */
+    void PushSharedMessage(const char* pszCommand, const CSharedPayload& payload);
+
+private:
+    // requires LOCK(cs_vSend)
+    void QueueSendMessage(const CSendMessage& msg);
+
+public:
+
     void PushVersion();
 
 
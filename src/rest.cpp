@@ -111,6 +111,9 @@ static bool rest_block(AcceptedConnection* conn,
             throw RESTERR(HTTP_NOT_FOUND, hashStr + " not found");
 
         pblockindex = mapBlockIndex[hash];
+        if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
+            throw RESTERR(HTTP_NOT_FOUND, hashStr + " not available (pruned data)");
+
         if (!ReadBlockFromDisk(block, pblockindex))
             throw RESTERR(HTTP_NOT_FOUND, hashStr + " not found");
     }
@@ -214,6 +217,57 @@ static bool rest_tx(AcceptedConnection* conn,
     return true; // continue to process further HTTP reqs on this cxn
 }
 
+static bool rest_blockhashes(AcceptedConnection* conn,
+    string& strReq,
+    map<string, string>& mapHeaders,
+    bool fRun)
+{
+    vector<string> params;
+    enum RetFormat rf = ParseDataFormat(params, strReq);
+
+    // <high>/<low>, as for the getblockhashes rpc call
+    vector<string> range;
+    boost::split(range, params[0], boost::is_any_of("/"));
+    if (range.size() != 2)
+        throw RESTERR(HTTP_BAD_REQUEST, "Expected /rest/blockhashes/<high>/<low>");
+    int64_t nHigh, nLow;
+    if (!ParseInt64(range[0], &nHigh) || !ParseInt64(range[1], &nLow) ||
+        nLow < 0 || nHigh <= nLow || nHigh > std::numeric_limits<unsigned int>::max())
+        throw RESTERR(HTTP_BAD_REQUEST, "Invalid timestamp range: " + params[0]);
+
+    if (!fTimestampIndex)
+        throw RESTERR(HTTP_NOT_FOUND, "Timestamp index not enabled");
+    vector<pair<uint256, unsigned int> > vHashes;
+    if (!GetTimestampIndex((unsigned int)nHigh, (unsigned int)nLow, false, vHashes))
+        throw RESTERR(HTTP_INTERNAL_SERVER_ERROR, "Unable to read the timestamp index");
+
+    switch (rf) {
+    case RF_HEX: {
+        string strHex;
+        for (unsigned int i = 0; i < vHashes.size(); i++)
+            strHex += vHashes[i].first.GetHex() + "\n";
+        conn->stream() << HTTPReply(HTTP_OK, strHex, fRun, false, "text/plain") << std::flush;
+        return true;
+    }
+
+    case RF_JSON: {
+        Array arrHashes;
+        for (unsigned int i = 0; i < vHashes.size(); i++)
+            arrHashes.push_back(vHashes[i].first.GetHex());
+        string strJSON = write_string(Value(arrHashes), false) + "\n";
+        conn->stream() << HTTPReply(HTTP_OK, strJSON, fRun) << std::flush;
+        return true;
+    }
+
+    default: {
+        throw RESTERR(HTTP_NOT_FOUND, "output format not found (available: .hex, .json)");
+    }
+    }
+
+    // not reached
+    return true; // continue to process further HTTP reqs on this cxn
+}
+
 static const struct {
     const char* prefix;
     bool (*handler)(AcceptedConnection* conn,
@@ -224,6 +278,7 @@ static const struct {
     {"/rest/tx/", rest_tx},
     {"/rest/block/notxdetails/", rest_block_notxdetails},
     {"/rest/block/", rest_block_extended},
+    {"/rest/blockhashes/", rest_blockhashes},
 };
 
 bool HTTPReq_REST(AcceptedConnection* conn,
@@ -7,6 +7,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "base58.h"
 #include "checkpoints.h"
 #include "main.h"
 #include "rpcserver.h"
@@ -69,7 +70,7 @@ Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDe
     BOOST_FOREACH (const CTransaction& tx, block.vtx) {
         if (txDetails) {
             Object objTx;
-            TxToJSON(tx, uint256(0), objTx);
+            TxToJSON(tx, blockindex->GetBlockHash(), objTx);
             txs.push_back(objTx);
         } else
             txs.push_back(tx.GetHash().GetHex());
@@ -90,7 +91,7 @@ Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDe
 }
 
 
-Object blockHeaderToJSON(const CBlock& block, const CBlockIndex* blockindex)
+Object blockHeaderToJSON(const CBlockHeader& block, const CBlockIndex* blockindex)
 {
     Object result;
     result.push_back(Pair("version", block.nVersion));
@@ -169,6 +170,9 @@ Value getrawmempool(const Array& params, bool fHelp)
             "    \"height\" : n,           (numeric) block height when transaction entered pool\n"
             "    \"startingpriority\" : n, (numeric) priority when transaction entered pool\n"
             "    \"currentpriority\" : n,  (numeric) transaction priority now\n"
+            "    \"descendantcount\" : n,  (numeric) number of in-mempool descendant transactions (including this one)\n"
+            "    \"descendantsize\" : n,   (numeric) size of in-mempool descendants (including this one)\n"
+            "    \"descendantfees\" : n,   (numeric) fees of in-mempool descendants (including this one), with prioritisetransaction deltas, in satoshis\n"
             "    \"depends\" : [           (array) unconfirmed transactions used as inputs for this transaction\n"
             "        \"transactionid\",    (string) parent transaction id\n"
             "       ... ]\n"
@@ -184,9 +188,8 @@ Value getrawmempool(const Array& params, bool fHelp)
     if (fVerbose) {
         LOCK(mempool.cs);
         Object o;
-        BOOST_FOREACH (const PAIRTYPE(uint256, CTxMemPoolEntry) & entry, mempool.mapTx) {
-            const uint256& hash = entry.first;
-            const CTxMemPoolEntry& e = entry.second;
+        BOOST_FOREACH (const CTxMemPoolEntry& e, mempool.mapTx) {
+            const uint256& hash = e.GetTx().GetHash();
             Object info;
             info.push_back(Pair("size", (int)e.GetTxSize()));
             info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
@@ -194,6 +197,9 @@ Value getrawmempool(const Array& params, bool fHelp)
             info.push_back(Pair("height", (int)e.GetHeight()));
             info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
             info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
+            info.push_back(Pair("descendantcount", e.GetCountWithDescendants()));
+            info.push_back(Pair("descendantsize", e.GetSizeWithDescendants()));
+            info.push_back(Pair("descendantfees", e.GetModFeesWithDescendants()));
             const CTransaction& tx = e.GetTx();
             set<string> setDepends;
             BOOST_FOREACH (const CTxIn& txin, tx.vin) {
@@ -238,6 +244,71 @@ Value getblockhash(const Array& params, bool fHelp)
     return pblockindex->GetBlockHash().GetHex();
 }
 
+Value getblockhashes(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 2 || params.size() > 3)
+        throw runtime_error(
+            "getblockhashes high low ( options )\n"
+            "\nReturns the hashes of the blocks in best-block-chain with timestamps in a range (requires -timestampindex).\n"
+            "\nArguments:\n"
+            "1. high          (numeric, required) The end of the range, exclusive, in seconds since epoch\n"
+            "2. low           (numeric, required) The start of the range, inclusive, in seconds since epoch\n"
+            "3. options       (object, optional)\n"
+            "    {\n"
+            "      \"noOrphans\":true|false      (boolean) Only include blocks of the active chain\n"
+            "      \"logicalTimes\":true|false   (boolean) Include the logical time of each block\n"
+            "    }\n"
+            "\nResult:\n"
+            "[\n"
+            "  \"hash\"         (string) The block hash\n"
+            "  ,...\n"
+            "]\n"
+            "\nResult (with logicalTimes):\n"
+            "[\n"
+            "  {\n"
+            "    \"blockhash\": \"hash\",    (string) The block hash\n"
+            "    \"logicalts\": n          (numeric) The block time, raised to increase with height\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getblockhashes", "1231614698 1231024505") + HelpExampleCli("getblockhashes", "1231614698 1231024505 '{\"noOrphans\":false, \"logicalTimes\":true}'") +
+            HelpExampleRpc("getblockhashes", "1231614698, 1231024505"));
+
+    int64_t nHigh = params[0].get_int64();
+    int64_t nLow = params[1].get_int64();
+    if (nLow < 0 || nHigh <= nLow || nHigh > std::numeric_limits<unsigned int>::max())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid timestamp range");
+
+    bool fActiveOnly = false;
+    bool fLogicalTimes = false;
+    if (params.size() > 2) {
+        const Object& options = params[2].get_obj();
+        const Value& noOrphans = find_value(options, "noOrphans");
+        if (noOrphans.type() == bool_type)
+            fActiveOnly = noOrphans.get_bool();
+        const Value& logicalTimes = find_value(options, "logicalTimes");
+        if (logicalTimes.type() == bool_type)
+            fLogicalTimes = logicalTimes.get_bool();
+    }
+
+    std::vector<std::pair<uint256, unsigned int> > vHashes;
+    if (!GetTimestampIndex((unsigned int)nHigh, (unsigned int)nLow, fActiveOnly, vHashes))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for block hashes");
+
+    Array result;
+    for (unsigned int i = 0; i < vHashes.size(); i++) {
+        if (fLogicalTimes) {
+            Object item;
+            item.push_back(Pair("blockhash", vHashes[i].first.GetHex()));
+            item.push_back(Pair("logicalts", (int64_t)vHashes[i].second));
+            result.push_back(item);
+        } else
+            result.push_back(vHashes[i].first.GetHex());
+    }
+    return result;
+}
+
 Value getblock(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -285,6 +356,9 @@ Value getblock(const Array& params, bool fHelp)
     CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
 
+    if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
+
     if (!ReadBlockFromDisk(block, pblockindex))
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
 
@@ -332,15 +406,13 @@ Value getblockheader(const Array& params, bool fHelp)
     if (mapBlockIndex.count(hash) == 0)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
 
-    CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
-
-    if (!ReadBlockFromDisk(block, pblockindex))
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+    // Headers are kept in the block index, so this works for pruned blocks too
+    CBlockHeader block = pblockindex->GetBlockHeader();
 
     if (!fVerbose) {
         CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
-        ssBlock << block.GetBlockHeader();
+        ssBlock << block;
         std::string strHex = HexStr(ssBlock.begin(), ssBlock.end());
         return strHex;
     }
@@ -354,15 +426,15 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
         throw runtime_error(
             "gettxoutsetinfo\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "The statistics are maintained incrementally as blocks are connected.\n"
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
             "  \"bestblock\": \"hex\",   (string) the best block hash hex\n"
             "  \"transactions\": n,      (numeric) The number of transactions\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
-            "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
-            "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
+            "  \"bogosize\": n,          (numeric) A database-independent metric for UTXO set size\n"
+            "  \"muhash\": \"hash\",      (string) The MuHash3072 commitment to the UTXO set\n"
             "  \"total_amount\": x.xxx          (numeric) The total amount\n"
             "}\n"
             "\nExamples:\n" +
@@ -371,14 +443,21 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
     Object ret;
 
     CCoinsStats stats;
-    FlushStateToDisk();
+    CCoinsCommitment commitment;
+    if (!pcoinsTip->GetCommitment(commitment)) {
+        // Fall back to scanning the database, which must be up to date
+        FlushStateToDisk();
+    }
     if (pcoinsTip->GetStats(stats)) {
+        BlockMap::iterator mi = mapBlockIndex.find(stats.hashBlock);
+        if (mi != mapBlockIndex.end())
+            stats.nHeight = mi->second->nHeight;
         ret.push_back(Pair("height", (int64_t)stats.nHeight));
         ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
         ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
         ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
-        ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
-        ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
+        ret.push_back(Pair("bogosize", (int64_t)stats.nBogoSize));
+        ret.push_back(Pair("muhash", stats.hashMuHash.GetHex()));
         ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
     }
     return ret;
@@ -459,6 +538,48 @@ Value gettxout(const Array& params, bool fHelp)
     return ret;
 }
 
+Value getspentinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 2)
+        throw runtime_error(
+            "getspentinfo \"txid\" n\n"
+            "\nReturns the input spending a transaction output (requires -spentindex).\n"
+            "\nArguments:\n"
+            "1. \"txid\"       (string, required) The transaction id\n"
+            "2. n              (numeric, required) vout value\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"txid\" : \"id\",          (string) The id of the spending transaction\n"
+            "  \"index\" : n,             (numeric) The spending input\n"
+            "  \"height\" : n,            (numeric) The height of the block containing the spending transaction\n"
+            "  \"value\" : x.xxx,         (numeric) The value of the spent output in BARE\n"
+            "  \"address\" : \"address\"   (string, optional) The address the spent output paid to\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getspentinfo", "\"txid\" 1") + HelpExampleRpc("getspentinfo", "\"txid\", 1"));
+
+    if (!fSpentIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Spent index not enabled; restart with -spentindex -reindex");
+
+    uint256 hash(params[0].get_str());
+    int n = params[1].get_int();
+    if (n < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid output index");
+
+    CSpentIndexValue value;
+    if (!GetSpentIndex(CSpentIndexKey(hash, n), value))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to get spent info");
+
+    Object ret;
+    ret.push_back(Pair("txid", value.txid.GetHex()));
+    ret.push_back(Pair("index", (int)value.inputIndex));
+    ret.push_back(Pair("height", value.blockHeight));
+    ret.push_back(Pair("value", ValueFromAmount(value.satoshis)));
+    if (value.addressType != 0)
+        ret.push_back(Pair("address", CBitcoinAddress(GetAddressIndexDestination(value.addressType, value.addressHash)).ToString()));
+    return ret;
+}
+
 Value verifychain(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 2)
@@ -498,6 +619,8 @@ Value getblockchaininfo(const Array& params, bool fHelp)
             "  \"difficulty\": xxxxxx,     (numeric) the current difficulty\n"
             "  \"verificationprogress\": xxxx, (numeric) estimate of verification progress [0..1]\n"
             "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"pruned\": xx,             (boolean) if the blocks are subject to pruning\n"
+            "  \"pruneheight\": xxxxxx,    (numeric) lowest-height complete block stored, only present if pruning is enabled\n"
             "}\n"
             "\nExamples:\n" +
             HelpExampleCli("getblockchaininfo", "") + HelpExampleRpc("getblockchaininfo", ""));
@@ -510,6 +633,13 @@ Value getblockchaininfo(const Array& params, bool fHelp)
     obj.push_back(Pair("difficulty", (double)GetDifficulty()));
     obj.push_back(Pair("verificationprogress", Checkpoints::GuessVerificationProgress(chainActive.Tip())));
     obj.push_back(Pair("chainwork", chainActive.Tip()->nChainWork.GetHex()));
+    obj.push_back(Pair("pruned", fPruneMode));
+    if (fPruneMode) {
+        CBlockIndex* block = chainActive.Tip();
+        while (block && block->pprev && (block->pprev->nStatus & BLOCK_HAVE_DATA))
+            block = block->pprev;
+        obj.push_back(Pair("pruneheight", block->nHeight));
+    }
     return obj;
 }
 
@@ -621,6 +751,10 @@ Value getmempoolinfo(const Array& params, bool fHelp)
             "{\n"
             "  \"size\": xxxxx                (numeric) Current tx count\n"
             "  \"bytes\": xxxxx               (numeric) Sum of all tx sizes\n"
+            "  \"usage\": xxxxx               (numeric) Total memory usage for the mempool\n"
+            "  \"maxmempool\": xxxxx          (numeric) Maximum memory usage for the mempool\n"
+            "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee for tx to be accepted\n"
+            "  \"loaded\": true|false         (boolean) True if the mempool saved at the last shutdown is fully loaded\n"
             "}\n"
             "\nExamples:\n" +
             HelpExampleCli("getmempoolinfo", "") + HelpExampleRpc("getmempoolinfo", ""));
@@ -628,10 +762,33 @@ Value getmempoolinfo(const Array& params, bool fHelp)
     Object ret;
     ret.push_back(Pair("size", (int64_t)mempool.size()));
     ret.push_back(Pair("bytes", (int64_t)mempool.GetTotalTxSize()));
+    ret.push_back(Pair("usage", (int64_t)mempool.DynamicMemoryUsage()));
+    size_t maxmempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    ret.push_back(Pair("maxmempool", (int64_t)maxmempool));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFee(maxmempool).GetFeePerK())));
+    ret.push_back(Pair("loaded", mempool.IsLoaded()));
 
     return ret;
 }
 
+Value savemempool(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "savemempool\n"
+            "\nSaves the TX memory pool to disk, to be loaded again on the next start.\n"
+            "\nExamples:\n" +
+            HelpExampleCli("savemempool", "") + HelpExampleRpc("savemempool", ""));
+
+    if (!mempool.IsLoaded())
+        throw JSONRPCError(RPC_MISC_ERROR, "The mempool was not loaded yet");
+
+    if (!DumpMempool())
+        throw JSONRPCError(RPC_MISC_ERROR, "Unable to save the mempool to disk");
+
+    return Value::null;
+}
+
 Value invalidateblock(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -49,6 +49,9 @@ static const CRPCConvertParam vRPCConvertParams[] =
         {"getbalance", 1},
         {"getbalance", 2},
         {"getblockhash", 0},
+        {"getblockhashes", 0},
+        {"getblockhashes", 1},
+        {"getblockhashes", 2},
         {"move", 2},
         {"move", 3},
         {"sendfrom", 2},
@@ -83,6 +86,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
         {"sendrawtransaction", 1},
         {"gettxout", 1},
         {"gettxout", 2},
+        {"getspentinfo", 1},
         {"lockunspent", 0},
         {"lockunspent", 1},
         {"importprivkey", 2},
@@ -96,6 +100,10 @@ static const CRPCConvertParam vRPCConvertParams[] =
         {"prioritisetransaction", 1},
         {"prioritisetransaction", 2},
         {"spork", 1},
+        {"getaddressbalance", 0},
+        {"getaddressdeltas", 0},
+        {"getaddresstxids", 0},
+        {"getaddressutxos", 0},
         {"mnbudget", 3},
         {"mnbudget", 4},
         {"mnbudget", 6},
@@ -462,6 +462,237 @@ Value setmocktime(const Array& params, bool fHelp)
     return Value::null;
 }
 
+/** Collect the address index keys of an address string or of an {"addresses": [...]} object */
+static void GetAddressesFromParams(const Array& params, std::vector<std::pair<uint160, int> >& vAddresses)
+{
+    std::vector<std::string> vStrAddresses;
+    if (params[0].type() == str_type) {
+        vStrAddresses.push_back(params[0].get_str());
+    } else if (params[0].type() == obj_type) {
+        Value addressValues = find_value(params[0].get_obj(), "addresses");
+        if (addressValues.type() != array_type)
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Addresses is expected to be an array");
+        BOOST_FOREACH (const Value& address, addressValues.get_array())
+            vStrAddresses.push_back(address.get_str());
+    } else {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
+    }
+
+    BOOST_FOREACH (const std::string& strAddress, vStrAddresses) {
+        CBitcoinAddress address(strAddress);
+        uint160 hashBytes;
+        int type = 0;
+        if (!address.IsValid() || !GetAddressIndexKey(address.Get(), hashBytes, type))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
+        vAddresses.push_back(std::make_pair(hashBytes, type));
+    }
+}
+
+/** Read the optional "start" and "end" heights of an {"addresses": [...]} object */
+static void GetHeightRangeFromParams(const Array& params, int& nStart, int& nEnd)
+{
+    nStart = 0;
+    nEnd = 0;
+    if (params[0].type() != obj_type)
+        return;
+    const Object& obj = params[0].get_obj();
+    Value startValue = find_value(obj, "start");
+    Value endValue = find_value(obj, "end");
+    if (startValue.type() == int_type && endValue.type() == int_type) {
+        nStart = startValue.get_int();
+        nEnd = endValue.get_int();
+        if (nStart <= 0 || nEnd <= 0 || nEnd < nStart)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Start and end are expected to be positive heights with start <= end");
+    } else if (startValue.type() != null_type || endValue.type() != null_type) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Start and end are expected to be given together");
+    }
+}
+
+static std::string GetAddressIndexString(int type, const uint160& hashBytes)
+{
+    return CBitcoinAddress(GetAddressIndexDestination(type, hashBytes)).ToString();
+}
+
+static bool HeightSort(const std::pair<CAddressUnspentKey, CAddressUnspentValue>& a, const std::pair<CAddressUnspentKey, CAddressUnspentValue>& b)
+{
+    return a.second.nHeight < b.second.nHeight;
+}
+
+Value getaddressbalance(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance \"address\"|{\"addresses\": [\"address\",...]}\n"
+            "\nReturns the balance of one or more addresses (requires -addressindex).\n"
+            "\nArguments:\n"
+            "1. \"address\"      (string or object, required) An address, or an object with an array of addresses\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"balance\": n,    (numeric) The current balance in satoshis\n"
+            "  \"received\": n,   (numeric) The total amount received in satoshis, including change\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getaddressbalance", "'{\"addresses\": [\"Bdq3YMtJH7AY7Ls4P2rE3Q6iWM9WjHLDy6\"]}'") + HelpExampleRpc("getaddressbalance", "{\"addresses\": [\"Bdq3YMtJH7AY7Ls4P2rE3Q6iWM9WjHLDy6\"]}"));
+
+    std::vector<std::pair<uint160, int> > vAddresses;
+    GetAddressesFromParams(params, vAddresses);
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressIndex;
+    for (std::vector<std::pair<uint160, int> >::const_iterator it = vAddresses.begin(); it != vAddresses.end(); ++it) {
+        if (!GetAddressIndex(it->first, it->second, vAddressIndex))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    }
+
+    CAmount nBalance = 0;
+    CAmount nReceived = 0;
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = vAddressIndex.begin(); it != vAddressIndex.end(); ++it) {
+        if (it->second > 0)
+            nReceived += it->second;
+        nBalance += it->second;
+    }
+
+    Object result;
+    result.push_back(Pair("balance", nBalance));
+    result.push_back(Pair("received", nReceived));
+    return result;
+}
+
+Value getaddressutxos(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressutxos \"address\"|{\"addresses\": [\"address\",...]}\n"
+            "\nReturns the unspent outputs of one or more addresses (requires -addressindex).\n"
+            "\nArguments:\n"
+            "1. \"address\"      (string or object, required) An address, or an object with an array of addresses\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"address\": \"address\",  (string) The address\n"
+            "    \"txid\": \"hash\",        (string) The transaction id\n"
+            "    \"outputIndex\": n,      (numeric) The output index\n"
+            "    \"script\": \"hex\",       (string) The script of the output\n"
+            "    \"satoshis\": n,         (numeric) The value of the output in satoshis\n"
+            "    \"height\": n            (numeric) The height of the block containing the output\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getaddressutxos", "'{\"addresses\": [\"Bdq3YMtJH7AY7Ls4P2rE3Q6iWM9WjHLDy6\"]}'") + HelpExampleRpc("getaddressutxos", "{\"addresses\": [\"Bdq3YMtJH7AY7Ls4P2rE3Q6iWM9WjHLDy6\"]}"));
+
+    std::vector<std::pair<uint160, int> > vAddresses;
+    GetAddressesFromParams(params, vAddresses);
+
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspentOutputs;
+    for (std::vector<std::pair<uint160, int> >::const_iterator it = vAddresses.begin(); it != vAddresses.end(); ++it) {
+        if (!GetAddressUnspent(it->first, it->second, vUnspentOutputs))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    }
+    std::stable_sort(vUnspentOutputs.begin(), vUnspentOutputs.end(), HeightSort);
+
+    Array result;
+    for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it = vUnspentOutputs.begin(); it != vUnspentOutputs.end(); ++it) {
+        Object output;
+        output.push_back(Pair("address", GetAddressIndexString(it->first.type, it->first.hashBytes)));
+        output.push_back(Pair("txid", it->first.txhash.GetHex()));
+        output.push_back(Pair("outputIndex", (int)it->first.nIndex));
+        output.push_back(Pair("script", HexStr(it->second.script.begin(), it->second.script.end())));
+        output.push_back(Pair("satoshis", it->second.nValue));
+        output.push_back(Pair("height", it->second.nHeight));
+        result.push_back(output);
+    }
+    return result;
+}
+
+Value getaddressdeltas(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressdeltas \"address\"|{\"addresses\": [\"address\",...], \"start\": n, \"end\": n}\n"
+            "\nReturns every balance change of one or more addresses (requires -addressindex).\n"
+            "\nArguments:\n"
+            "1. \"address\"      (string or object, required) An address, or an object with an array of addresses\n"
+            "                  and an optional range of block heights \"start\" to \"end\" (inclusive)\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"satoshis\": n,    (numeric) The change of the balance in satoshis; negative for spends\n"
+            "    \"txid\": \"hash\",   (string) The transaction id\n"
+            "    \"index\": n,       (numeric) The input or output index\n"
+            "    \"blockindex\": n,  (numeric) The position of the transaction in its block\n"
+            "    \"height\": n,      (numeric) The block height\n"
+            "    \"address\": \"address\" (string) The address\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getaddressdeltas", "'{\"addresses\": [\"Bdq3YMtJH7AY7Ls4P2rE3Q6iWM9WjHLDy6\"], \"start\": 1000, \"end\": 2000}'") + HelpExampleRpc("getaddressdeltas", "{\"addresses\": [\"Bdq3YMtJH7AY7Ls4P2rE3Q6iWM9WjHLDy6\"]}"));
+
+    std::vector<std::pair<uint160, int> > vAddresses;
+    GetAddressesFromParams(params, vAddresses);
+    int nStart, nEnd;
+    GetHeightRangeFromParams(params, nStart, nEnd);
+
+    Array result;
+    for (std::vector<std::pair<uint160, int> >::const_iterator it = vAddresses.begin(); it != vAddresses.end(); ++it) {
+        std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressIndex;
+        if (!GetAddressIndex(it->first, it->second, vAddressIndex, nStart, nEnd))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+
+        std::string strAddress = GetAddressIndexString(it->second, it->first);
+        for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator itDelta = vAddressIndex.begin(); itDelta != vAddressIndex.end(); ++itDelta) {
+            Object delta;
+            delta.push_back(Pair("satoshis", itDelta->second));
+            delta.push_back(Pair("txid", itDelta->first.txhash.GetHex()));
+            delta.push_back(Pair("index", (int)itDelta->first.nIndex));
+            delta.push_back(Pair("blockindex", (int)itDelta->first.nTxIndex));
+            delta.push_back(Pair("height", itDelta->first.nHeight));
+            delta.push_back(Pair("address", strAddress));
+            result.push_back(delta);
+        }
+    }
+    return result;
+}
+
+Value getaddresstxids(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddresstxids \"address\"|{\"addresses\": [\"address\",...], \"start\": n, \"end\": n}\n"
+            "\nReturns the ids of the transactions touching one or more addresses, in block order (requires -addressindex).\n"
+            "\nArguments:\n"
+            "1. \"address\"      (string or object, required) An address, or an object with an array of addresses\n"
+            "                  and an optional range of block heights \"start\" to \"end\" (inclusive)\n"
+            "\nResult:\n"
+            "[\n"
+            "  \"transactionid\"  (string) The transaction id\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getaddresstxids", "'{\"addresses\": [\"Bdq3YMtJH7AY7Ls4P2rE3Q6iWM9WjHLDy6\"]}'") + HelpExampleRpc("getaddresstxids", "{\"addresses\": [\"Bdq3YMtJH7AY7Ls4P2rE3Q6iWM9WjHLDy6\"]}"));
+
+    std::vector<std::pair<uint160, int> > vAddresses;
+    GetAddressesFromParams(params, vAddresses);
+    int nStart, nEnd;
+    GetHeightRangeFromParams(params, nStart, nEnd);
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressIndex;
+    for (std::vector<std::pair<uint160, int> >::const_iterator it = vAddresses.begin(); it != vAddresses.end(); ++it) {
+        if (!GetAddressIndex(it->first, it->second, vAddressIndex, nStart, nEnd))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    }
+
+    // Index entries of one address are already in block order; merge those of several
+    std::set<std::pair<std::pair<int, unsigned int>, uint256> > setTxids;
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = vAddressIndex.begin(); it != vAddressIndex.end(); ++it)
+        setTxids.insert(std::make_pair(std::make_pair(it->first.nHeight, it->first.nTxIndex), it->first.txhash));
+
+    Array result;
+    for (std::set<std::pair<std::pair<int, unsigned int>, uint256> >::const_iterator it = setTxids.begin(); it != setTxids.end(); ++it)
+        result.push_back(it->second.GetHex());
+    return result;
+}
+
 #ifdef ENABLE_WALLET
 Value getstakingstatus(const Array& params, bool fHelp)
 {
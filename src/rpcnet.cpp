@@ -10,6 +10,7 @@
 
 #include "clientversion.h"
 #include "main.h"
+#include "msgqueue.h"
 #include "net.h"
 #include "netbase.h"
 #include "protocol.h"
@@ -327,6 +328,53 @@ Value getnettotals(const Array& params, bool fHelp)
     return obj;
 }
 
+Value getmessagequeueinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getmessagequeueinfo\n"
+            "\nReturns the counters of the message handler thread (\"net\", which handles blocks and\n"
+            "transactions) and of the masternode, budget and spork message queues.\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"name\": \"xxx\",       (string) the queue\n"
+            "    \"depth\": n,          (numeric) messages waiting\n"
+            "    \"maxdepth\": n,       (numeric) messages the queue holds at most, 0 if not bounded\n"
+            "    \"peakdepth\": n,      (numeric) most messages that were waiting\n"
+            "    \"processed\": n,      (numeric) messages handled\n"
+            "    \"dropped\": n,        (numeric) messages dropped because the queue was full\n"
+            "    \"avgwait\": x.xxx,    (numeric) average milliseconds from receipt to handling\n"
+            "    \"maxwait\": x.xxx,    (numeric) longest wait in milliseconds\n"
+            "    \"avgtime\": x.xxx,    (numeric) average milliseconds spent handling a message\n"
+            "    \"maxtime\": x.xxx     (numeric) longest handling in milliseconds\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getmessagequeueinfo", "") + HelpExampleRpc("getmessagequeueinfo", ""));
+
+    std::vector<CMessageQueueStats> vStats;
+    GetMessageQueueStats(vStats);
+
+    Array ret;
+    BOOST_FOREACH (const CMessageQueueStats& stats, vStats) {
+        Object obj;
+        obj.push_back(Pair("name", stats.strName));
+        obj.push_back(Pair("depth", (uint64_t)stats.nDepth));
+        obj.push_back(Pair("maxdepth", (uint64_t)stats.nMaxDepth));
+        obj.push_back(Pair("peakdepth", (uint64_t)stats.nPeakDepth));
+        obj.push_back(Pair("processed", stats.nProcessed));
+        obj.push_back(Pair("dropped", stats.nDropped));
+        obj.push_back(Pair("avgwait", stats.nProcessed ? 0.001 * stats.nWaitTotal / stats.nProcessed : 0.0));
+        obj.push_back(Pair("maxwait", 0.001 * stats.nWaitMax));
+        obj.push_back(Pair("avgtime", stats.nProcessed ? 0.001 * stats.nTimeTotal / stats.nProcessed : 0.0));
+        obj.push_back(Pair("maxtime", 0.001 * stats.nTimeMax));
+        ret.push_back(obj);
+    }
+    return ret;
+}
+
 static Array GetNetworksInfo()
 {
     Array networks;
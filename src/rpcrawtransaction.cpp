@@ -58,9 +58,40 @@ void ScriptPubKeyToJSON(const CScript& scriptPubKey, Object& out, bool fIncludeH
     out.push_back(Pair("addresses", a));
 }
 
+/**
+ * Add the value and address of the output an input spends. Confirmed spends are
+ * answered by the spent index; inputs of unconfirmed transactions still spend
+ * outputs of the UTXO set.
+ */
+static void SpentOutputToJSON(const CTxIn& txin, bool fConfirmed, Object& in)
+{
+    CSpentIndexValue spentInfo;
+    if (fConfirmed && GetSpentIndex(CSpentIndexKey(txin.prevout.hash, txin.prevout.n), spentInfo)) {
+        in.push_back(Pair("value", ValueFromAmount(spentInfo.satoshis)));
+        in.push_back(Pair("valueSat", spentInfo.satoshis));
+        if (spentInfo.addressType != 0)
+            in.push_back(Pair("address", CBitcoinAddress(GetAddressIndexDestination(spentInfo.addressType, spentInfo.addressHash)).ToString()));
+        return;
+    }
+
+    if (fConfirmed)
+        return;
+    LOCK(cs_main);
+    const CCoins* coins = pcoinsTip->AccessCoins(txin.prevout.hash);
+    if (!coins || !coins->IsAvailable(txin.prevout.n))
+        return;
+    const CTxOut& txout = coins->vout[txin.prevout.n];
+    in.push_back(Pair("value", ValueFromAmount(txout.nValue)));
+    in.push_back(Pair("valueSat", txout.nValue));
+    CTxDestination dest;
+    if (ExtractDestination(txout.scriptPubKey, dest))
+        in.push_back(Pair("address", CBitcoinAddress(dest).ToString()));
+}
+
 void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
 {
-    entry.push_back(Pair("txid", tx.GetHash().GetHex()));
+    const uint256 txid = tx.GetHash();
+    entry.push_back(Pair("txid", txid.GetHex()));
     entry.push_back(Pair("version", tx.nVersion));
     entry.push_back(Pair("locktime", (int64_t)tx.nLockTime));
     Array vin;
@@ -75,6 +106,8 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
             o.push_back(Pair("asm", txin.scriptSig.ToString()));
             o.push_back(Pair("hex", HexStr(txin.scriptSig.begin(), txin.scriptSig.end())));
             in.push_back(Pair("scriptSig", o));
+            if (fSpentIndex)
+                SpentOutputToJSON(txin, hashBlock != 0, in);
         }
         in.push_back(Pair("sequence", (int64_t)txin.nSequence));
         vin.push_back(in);
@@ -89,6 +122,12 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
         Object o;
         ScriptPubKeyToJSON(txout.scriptPubKey, o, true);
         out.push_back(Pair("scriptPubKey", o));
+        CSpentIndexValue spentInfo;
+        if (hashBlock != 0 && GetSpentIndex(CSpentIndexKey(txid, i), spentInfo)) {
+            out.push_back(Pair("spentTxId", spentInfo.txid.GetHex()));
+            out.push_back(Pair("spentIndex", (int)spentInfo.inputIndex));
+            out.push_back(Pair("spentHeight", spentInfo.blockHeight));
+        }
         vout.push_back(out);
     }
     entry.push_back(Pair("vout", vout));
@@ -141,6 +180,9 @@ Value getrawtransaction(const Array& params, bool fHelp)
             "         \"asm\": \"asm\",  (string) asm\n"
             "         \"hex\": \"hex\"   (string) hex\n"
             "       },\n"
+            "       \"value\": x.xxx,    (numeric) The value of the spent output in BARE (with -spentindex)\n"
+            "       \"valueSat\": n,     (numeric) The value of the spent output in satoshis (with -spentindex)\n"
+            "       \"address\": \"addr\", (string) The address of the spent output (with -spentindex)\n"
             "       \"sequence\": n      (numeric) The script sequence number\n"
             "     }\n"
             "     ,...\n"
@@ -158,7 +200,10 @@ Value getrawtransaction(const Array& params, bool fHelp)
             "           \"bareaddress\"        (string) Bare address\n"
             "           ,...\n"
             "         ]\n"
-            "       }\n"
+            "       },\n"
+            "       \"spentTxId\" : \"id\",         (string) The transaction spending the output, if spent (with -spentindex)\n"
+            "       \"spentIndex\" : n,             (numeric) The input of that transaction\n"
+            "       \"spentHeight\" : n             (numeric) The height of the block containing that transaction\n"
             "     }\n"
             "     ,...\n"
             "  ],\n"
@@ -429,6 +429,7 @@ I ReadVarInt(Stream& is)
 
 #define FLATDATA(obj) REF(CFlatData((char*)&(obj), (char*)&(obj) + sizeof(obj)))
 #define VARINT(obj) REF(WrapVarInt(REF(obj)))
+#define BIGENDIAN32(obj) REF(WrapBigEndian32(REF(obj)))
 #define LIMITED_STRING(obj, n) REF(LimitedString<n>(REF(obj)))
 
 /** 
@@ -498,6 +499,38 @@ public:
     }
 };
 
+/** Wrapper for serializing a 32-bit integer most significant byte first, so database keys sort by its value */
+template <typename I>
+class CBigEndian32
+{
+protected:
+    I& n;
+
+public:
+    CBigEndian32(I& nIn) : n(nIn) {}
+
+    unsigned int GetSerializeSize(int, int) const
+    {
+        return 4;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int, int) const
+    {
+        uint32_t v = (uint32_t)n;
+        unsigned char buf[4] = {(unsigned char)(v >> 24), (unsigned char)(v >> 16), (unsigned char)(v >> 8), (unsigned char)v};
+        s.write((char*)buf, sizeof(buf));
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int, int)
+    {
+        unsigned char buf[4];
+        s.read((char*)buf, sizeof(buf));
+        n = (I)(((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | (uint32_t)buf[3]);
+    }
+};
+
 template <size_t Limit>
 class LimitedString
 {
@@ -539,6 +572,12 @@ CVarInt<I> WrapVarInt(I& n)
     return CVarInt<I>(n);
 }
 
+template <typename I>
+CBigEndian32<I> WrapBigEndian32(I& n)
+{
+    return CBigEndian32<I>(n);
+}
+
 /**
  * Forward declarations
  */
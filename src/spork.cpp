@@ -163,14 +163,21 @@ void ReprocessBlocks(int nBlocks)
     }
 
     CValidationState state;
+    std::vector<CTransaction> vResurrect;
     {
         LOCK(cs_main);
-        DisconnectBlocksAndReprocess(nBlocks);
+        DisconnectBlocksAndReprocess(nBlocks, vResurrect);
     }
 
     if (state.IsValid()) {
         ActivateBestChain(state);
     }
+
+    // Disconnected transactions are checked against the reconnected chain
+    {
+        LOCK(cs_main);
+        ResurrectTransactions(vResurrect);
+    }
 }
 
 
@@ -289,6 +289,57 @@ public:
 };
 
 
+/** Read-only stream over memory owned by someone else, such as a memory-mapped file.
+ *
+ * Unlike CDataStream nothing is copied; the memory must outlive the stream.
+ */
+class CMemoryReader
+{
+private:
+    const char* pbegin;
+    const char* pend;
+    const char* pread;
+
+public:
+    int nType;
+    int nVersion;
+
+    CMemoryReader(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn) : pbegin(pbeginIn), pend(pendIn), pread(pbeginIn), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    size_t size() const { return pend - pread; }
+    bool empty() const { return pread == pend; }
+    size_t GetPos() const { return pread - pbegin; }
+    int GetType() { return nType; }
+    int GetVersion() { return nVersion; }
+
+    CMemoryReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CMemoryReader::read() : end of data");
+        memcpy(pch, pread, nSize);
+        pread += nSize;
+        return (*this);
+    }
+
+    CMemoryReader& ignore(int nSize)
+    {
+        assert(nSize >= 0);
+        if ((size_t)nSize > size())
+            throw std::ios_base::failure("CMemoryReader::ignore() : end of data");
+        pread += nSize;
+        return (*this);
+    }
+
+    template <typename T>
+    CMemoryReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+
 /** Non-refcounted RAII wrapper for FILE*
  *
  * Will automatically close the file when it goes out of scope if not null.
@@ -16,6 +16,7 @@
 #include "serialize.h"
 #include "util.h"
 
+#include <limits>
 #include <stdint.h>
 
 #include <boost/assign/list_of.hpp> // for 'map_list_of()'
@@ -26,13 +27,11 @@
 // Tests this internal-to-main.cpp method:
 extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
 extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-struct COrphanTx {
-    CTransaction tx;
-    NodeId fromPeer;
-};
+extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxBytes);
 extern std::map<uint256, COrphanTx> mapOrphanTransactions;
 extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern std::map<NodeId, COrphanPeer> mapOrphanPeers;
+extern size_t nOrphanBytes;
 
 CService ip(uint32_t i)
 {
@@ -187,13 +186,78 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     }
 
     // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
+    const size_t nNoByteLimit = std::numeric_limits<size_t>::max();
+    LimitOrphanTxSize(40, nNoByteLimit);
     BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
+    LimitOrphanTxSize(10, nNoByteLimit);
     BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
+    LimitOrphanTxSize(0, nNoByteLimit);
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK(mapOrphanPeers.empty());
+    BOOST_CHECK_EQUAL(nOrphanBytes, 0U);
+}
+
+static CTransaction SimpleOrphan()
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.n = 0;
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].scriptSig << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1 * CENT;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(DoS_mapOrphans_limits)
+{
+    const size_t nNoByteLimit = std::numeric_limits<size_t>::max();
+    int64_t nStartTime = GetTime();
+    SetMockTime(nStartTime);
+
+    // 20 orphans from peer 1, then 5 from peer 2
+    std::vector<uint256> vPeer1;
+    for (int i = 0; i < 20; i++) {
+        CTransaction tx = SimpleOrphan();
+        BOOST_CHECK(AddOrphanTx(tx, 1));
+        vPeer1.push_back(tx.GetHash());
+    }
+    for (int i = 0; i < 5; i++)
+        BOOST_CHECK(AddOrphanTx(SimpleOrphan(), 2));
+
+    const size_t nTxSize = mapOrphanTransactions.begin()->second.nTxSize;
+    BOOST_CHECK_EQUAL(nOrphanBytes, 25 * nTxSize);
+    BOOST_CHECK_EQUAL(mapOrphanPeers[1].nBytes, 20 * nTxSize);
+    BOOST_CHECK_EQUAL(mapOrphanPeers[2].nBytes, 5 * nTxSize);
+
+    // A byte budget of 24 orphans gives every peer room for 6: peer 1 loses
+    // its oldest, peer 2 keeps all of its own
+    LimitOrphanTxSize(1000, 24 * nTxSize);
+    BOOST_CHECK_EQUAL(mapOrphanPeers[1].nBytes, 6 * nTxSize);
+    BOOST_CHECK_EQUAL(mapOrphanPeers[2].nBytes, 5 * nTxSize);
+    BOOST_CHECK_EQUAL(nOrphanBytes, 11 * nTxSize);
+    for (int i = 0; i < 20; i++)
+        BOOST_CHECK_EQUAL(mapOrphanTransactions.count(vPeer1[i]), i < 14 ? 0U : 1U);
+
+    // Over the count limit, the peer with the most bytes is evicted from first
+    LimitOrphanTxSize(9, nNoByteLimit);
+    BOOST_CHECK_EQUAL(mapOrphanPeers[1].nBytes, 4 * nTxSize);
+    BOOST_CHECK_EQUAL(mapOrphanPeers[2].nBytes, 5 * nTxSize);
+
+    // Orphans expire
+    SetMockTime(nStartTime + ORPHAN_TX_EXPIRE_TIME - 1);
+    LimitOrphanTxSize(1000, nNoByteLimit);
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 9U);
+    SetMockTime(nStartTime + ORPHAN_TX_EXPIRE_TIME + ORPHAN_TX_EXPIRE_INTERVAL);
+    LimitOrphanTxSize(1000, nNoByteLimit);
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK(mapOrphanPeers.empty());
+    BOOST_CHECK_EQUAL(nOrphanBytes, 0U);
+
+    SetMockTime(0);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,79 @@
+// Copyright (c) 2017-2019 The Bare developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addressindex.h"
+#include "clientversion.h"
+#include "key.h"
+#include "streams.h"
+
+#include <boost/test/unit_test.hpp>
+
+static std::string SerializeKey(const CAddressIndexKey& key)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << key;
+    return ss.str();
+}
+
+BOOST_AUTO_TEST_SUITE(addressindex_tests)
+
+BOOST_AUTO_TEST_CASE(addressindex_key_order)
+{
+    uint160 hashBytes(12345);
+    uint256 txhash(67890);
+
+    // Heights and block positions sort numerically, so the history of an address is one range in height order
+    BOOST_CHECK(SerializeKey(CAddressIndexKey(ADDRESS_TYPE_PUBKEYHASH, hashBytes, 255, 0, txhash, 0, false)) <
+                SerializeKey(CAddressIndexKey(ADDRESS_TYPE_PUBKEYHASH, hashBytes, 256, 0, txhash, 0, false)));
+    BOOST_CHECK(SerializeKey(CAddressIndexKey(ADDRESS_TYPE_PUBKEYHASH, hashBytes, 70000, 255, txhash, 0, false)) <
+                SerializeKey(CAddressIndexKey(ADDRESS_TYPE_PUBKEYHASH, hashBytes, 70000, 256, txhash, 0, false)));
+
+    // A seek key is a prefix of the keys at its height
+    CDataStream ssSeek(SER_DISK, CLIENT_VERSION);
+    ssSeek << CAddressIndexIteratorKey(ADDRESS_TYPE_PUBKEYHASH, hashBytes, 70000);
+    std::string strKey = SerializeKey(CAddressIndexKey(ADDRESS_TYPE_PUBKEYHASH, hashBytes, 70000, 3, txhash, 1, true));
+    BOOST_CHECK_EQUAL(strKey.compare(0, ssSeek.size(), ssSeek.str()), 0);
+
+    CAddressIndexKey keyRead;
+    CDataStream ss(strKey.data(), strKey.data() + strKey.size(), SER_DISK, CLIENT_VERSION);
+    ss >> keyRead;
+    BOOST_CHECK_EQUAL(keyRead.type, ADDRESS_TYPE_PUBKEYHASH);
+    BOOST_CHECK(keyRead.hashBytes == hashBytes);
+    BOOST_CHECK_EQUAL(keyRead.nHeight, 70000);
+    BOOST_CHECK_EQUAL(keyRead.nTxIndex, 3U);
+    BOOST_CHECK(keyRead.txhash == txhash);
+    BOOST_CHECK_EQUAL(keyRead.nIndex, 1U);
+    BOOST_CHECK(keyRead.fSpending);
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_script_keys)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    uint160 hashBytes;
+    int type;
+
+    // Pay to pubkey and pay to pubkey hash share the key hash
+    CScript p2pkh = GetScriptForDestination(pubkey.GetID());
+    BOOST_CHECK(GetScriptAddressIndexKey(p2pkh, hashBytes, type));
+    BOOST_CHECK_EQUAL(type, ADDRESS_TYPE_PUBKEYHASH);
+    BOOST_CHECK(hashBytes == uint160(pubkey.GetID()));
+
+    CScript p2pk = CScript() << ToByteVector(pubkey) << OP_CHECKSIG;
+    BOOST_CHECK(GetScriptAddressIndexKey(p2pk, hashBytes, type));
+    BOOST_CHECK_EQUAL(type, ADDRESS_TYPE_PUBKEYHASH);
+    BOOST_CHECK(hashBytes == uint160(pubkey.GetID()));
+
+    CScript p2sh = GetScriptForDestination(CScriptID(p2pk));
+    BOOST_CHECK(GetScriptAddressIndexKey(p2sh, hashBytes, type));
+    BOOST_CHECK_EQUAL(type, ADDRESS_TYPE_SCRIPTHASH);
+    BOOST_CHECK(GetAddressIndexDestination(type, hashBytes) == CTxDestination(CScriptID(p2pk)));
+
+    // Unspendable and empty outputs are not indexed
+    BOOST_CHECK(!GetScriptAddressIndexKey(CScript() << OP_RETURN, hashBytes, type));
+    BOOST_CHECK(!GetScriptAddressIndexKey(CScript(), hashBytes, type));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
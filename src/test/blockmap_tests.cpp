@@ -0,0 +1,68 @@
+// Copyright (c) 2017-2019 The Bare developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockmap.h"
+#include "chain.h"
+#include "random.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockmap_tests)
+
+BOOST_AUTO_TEST_CASE(blockmap_insert_find)
+{
+    const int nEntries = 20000;
+    std::vector<CBlockIndex> vIndex(nEntries);
+    std::vector<uint256> vHash(nEntries);
+    std::vector<const uint256*> vKeyAddr(nEntries);
+
+    CBlockIndexMap map;
+    for (int i = 0; i < nEntries; i++) {
+        vHash[i] = GetRandHash();
+        std::pair<CBlockIndexMap::iterator, bool> ret = map.insert(std::make_pair(vHash[i], &vIndex[i]));
+        BOOST_CHECK(ret.second);
+        vKeyAddr[i] = &ret.first->first;
+    }
+    BOOST_CHECK_EQUAL(map.size(), (size_t)nEntries);
+
+    for (int i = 0; i < nEntries; i++) {
+        CBlockIndexMap::iterator it = map.find(vHash[i]);
+        BOOST_CHECK(it != map.end());
+        BOOST_CHECK(it->second == &vIndex[i]);
+        // Keys must not move while the table grows
+        BOOST_CHECK(&it->first == vKeyAddr[i]);
+    }
+
+    // Duplicates are not inserted
+    std::pair<CBlockIndexMap::iterator, bool> ret = map.insert(std::make_pair(vHash[0], (CBlockIndex*)NULL));
+    BOOST_CHECK(!ret.second);
+    BOOST_CHECK(ret.first->second == &vIndex[0]);
+
+    // Unknown keys
+    for (int i = 0; i < 1000; i++)
+        BOOST_CHECK(map.find(GetRandHash()) == map.end());
+    BOOST_CHECK_EQUAL(map.count(uint256(0)), 0U);
+
+    // operator[] inserts a NULL entry
+    uint256 hashNew = GetRandHash();
+    BOOST_CHECK(map[hashNew] == NULL);
+    BOOST_CHECK_EQUAL(map.count(hashNew), 1U);
+    BOOST_CHECK_EQUAL(map.size(), (size_t)nEntries + 1);
+
+    // Iteration visits every entry once, in insertion order
+    int n = 0;
+    for (CBlockIndexMap::const_iterator it = map.begin(); it != map.end(); ++it, ++n) {
+        if (n < nEntries)
+            BOOST_CHECK(it->first == vHash[n]);
+    }
+    BOOST_CHECK_EQUAL(n, nEntries + 1);
+
+    map.clear();
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(map.find(vHash[0]) == map.end());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -8,6 +8,8 @@
 #include "clientversion.h"
 #include "key.h"
 #include "merkleblock.h"
+#include "protocol.h"
+#include "random.h"
 #include "serialize.h"
 #include "streams.h"
 #include "uint256.h"
@@ -459,4 +461,58 @@ BOOST_AUTO_TEST_CASE(merkle_block_4_test_update_none)
     BOOST_CHECK(!filter.contains(COutPoint(uint256("0x02981fa052f0481dbc5868f4fc2166035a10f27a03cfd2de67326471df5bc041"), 0)));
 }
 
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    CRollingBloomFilter rb(100, 0.01);
+    std::vector<uint256> vHashes;
+    for (int i = 0; i < 500; i++)
+        vHashes.push_back(GetRandHash());
+
+    // The last 100 inserted are always contained
+    for (int i = 0; i < 100; i++)
+        rb.insert(vHashes[i]);
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK(rb.contains(vHashes[i]));
+
+    // Three more generations later the first 100 are forgotten, but for false positives
+    for (int i = 100; i < 500; i++)
+        rb.insert(vHashes[i]);
+    int nOld = 0;
+    for (int i = 0; i < 100; i++)
+        nOld += rb.contains(vHashes[i]);
+    BOOST_CHECK(nOld <= 10);
+    for (int i = 400; i < 500; i++)
+        BOOST_CHECK(rb.contains(vHashes[i]));
+
+    // The false positive rate stays within bounds however many are inserted
+    int nFalse = 0;
+    for (int i = 0; i < 10000; i++)
+        nFalse += rb.contains(GetRandHash());
+    BOOST_CHECK(nFalse <= 300);
+
+    rb.reset();
+    for (int i = 400; i < 500; i++)
+        BOOST_CHECK(!rb.contains(vHashes[i]));
+}
+
+BOOST_AUTO_TEST_CASE(rolling_bloom_keys)
+{
+    CRollingBloomFilter rb(1000, 0.000001);
+    uint256 hash = GetRandHash();
+
+    // Inventory of one hash but different types is told apart
+    rb.insert(CInv(MSG_TX, hash));
+    BOOST_CHECK(rb.contains(CInv(MSG_TX, hash)));
+    BOOST_CHECK(!rb.contains(CInv(MSG_TXLOCK_REQUEST, hash)));
+    BOOST_CHECK(!rb.contains(CInv(MSG_DSTX, hash)));
+    BOOST_CHECK(!rb.contains(hash));
+
+    std::vector<unsigned char> vKey = ParseHex("03a1c38f0bc5a4ba");
+    rb.insert(vKey);
+    BOOST_CHECK(rb.contains(vKey));
+    BOOST_CHECK(!rb.contains(ParseHex("03a1c38f0bc5a4bb")));
+    rb.insert(std::vector<unsigned char>());
+    BOOST_CHECK(rb.contains(std::vector<unsigned char>()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,119 @@
+// Copyright (c) 2017-2019 The Bare developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+namespace
+{
+boost::mutex csCount;
+unsigned int nChecked = 0;
+
+/** A verification that succeeds unless told otherwise, and counts its runs */
+struct CTestCheck {
+    bool fOk;
+    int nId;
+
+    CTestCheck(bool fOkIn = true) : fOk(fOkIn), nId(-1) {}
+
+    bool operator()()
+    {
+        boost::unique_lock<boost::mutex> lock(csCount);
+        nChecked++;
+        return fOk;
+    }
+
+    void swap(CTestCheck& check)
+    {
+        std::swap(fOk, check.fOk);
+        std::swap(nId, check.nId);
+    }
+};
+
+/** Runs a queue with a number of worker threads for the duration of a test */
+struct CTestQueue {
+    CCheckQueue<CTestCheck> queue;
+    boost::thread_group threads;
+
+    CTestQueue(int nThreads, unsigned int nBatchSize) : queue(nBatchSize, 4)
+    {
+        for (int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&CCheckQueue<CTestCheck>::Thread, &queue));
+    }
+
+    ~CTestQueue()
+    {
+        threads.interrupt_all();
+        threads.join_all();
+    }
+};
+} // anon namespace
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+BOOST_AUTO_TEST_CASE(checkqueue_all_ok)
+{
+    // More workers than queues, so some share one
+    CTestQueue test(6, 16);
+    for (unsigned int nChecks = 0; nChecks < 2000; nChecks += 97) {
+        nChecked = 0;
+        CCheckQueueControl<CTestCheck> control(&test.queue);
+        for (unsigned int i = 0; i < nChecks; i += 10) {
+            std::vector<CTestCheck> vChecks(std::min(10U, nChecks - i));
+            control.Add(vChecks);
+        }
+        BOOST_CHECK(control.Wait());
+        BOOST_CHECK_EQUAL(nChecked, nChecks);
+        BOOST_CHECK(test.queue.IsIdle());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_failure)
+{
+    CTestQueue test(3, 8);
+    for (unsigned int nFail = 0; nFail < 1000; nFail += 111) {
+        nChecked = 0;
+        CCheckQueueControl<CTestCheck> control(&test.queue);
+        std::vector<CTestCheck> vChecks(1000);
+        vChecks[nFail].fOk = false;
+        vChecks[nFail].nId = nFail;
+        control.Add(vChecks);
+        // The failed verification is handed back
+        CTestCheck checkFailed;
+        BOOST_CHECK(!control.Wait(&checkFailed));
+        BOOST_CHECK(!checkFailed.fOk);
+        BOOST_CHECK_EQUAL(checkFailed.nId, (int)nFail);
+        BOOST_CHECK(nChecked <= 1000U);
+        BOOST_CHECK(test.queue.IsIdle());
+    }
+
+    // The queue is reusable after failures
+    nChecked = 0;
+    CCheckQueueControl<CTestCheck> control(&test.queue);
+    std::vector<CTestCheck> vChecks(500);
+    control.Add(vChecks);
+    CTestCheck checkFailed;
+    BOOST_CHECK(control.Wait(&checkFailed));
+    BOOST_CHECK_EQUAL(checkFailed.nId, -1);
+    BOOST_CHECK_EQUAL(nChecked, 500U);
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_no_workers)
+{
+    // The master alone does all the work
+    CTestQueue test(0, 128);
+    nChecked = 0;
+    CCheckQueueControl<CTestCheck> control(&test.queue);
+    std::vector<CTestCheck> vChecks(300);
+    control.Add(vChecks);
+    BOOST_CHECK(control.Wait());
+    BOOST_CHECK_EQUAL(nChecked, 300U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,6 +3,8 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "hash.h"
+#include "muhash.h"
+#include "streams.h"
 #include "utilstrencodings.h"
 
 #include <vector>
@@ -46,4 +48,43 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(muhash)
+{
+    uint256 a = Hash(BEGIN(""), END("")), b(1), c(2);
+
+    // Insertion order does not matter, and removal cancels insertion
+    CMuHash3072 abc, cba, ac;
+    abc.Insert(a).Insert(b).Insert(c);
+    cba.Insert(c).Insert(b).Insert(a);
+    ac.Insert(a).Insert(b).Insert(c).Remove(b);
+    BOOST_CHECK(abc.Finalize() == cba.Finalize());
+    BOOST_CHECK(ac.Finalize() != abc.Finalize());
+
+    CMuHash3072 acDirect;
+    acDirect.Insert(c).Insert(a);
+    BOOST_CHECK(ac.Finalize() == acDirect.Finalize());
+
+    CMuHash3072 empty, emptied;
+    emptied.Insert(a).Remove(a);
+    BOOST_CHECK(empty.Finalize() == emptied.Finalize());
+
+    // Combining hashes behaves like set union and difference
+    CMuHash3072 onlyB;
+    onlyB.Insert(b);
+    CMuHash3072 combined = acDirect;
+    combined *= onlyB;
+    BOOST_CHECK(combined.Finalize() == abc.Finalize());
+    combined /= onlyB;
+    BOOST_CHECK(combined.Finalize() == ac.Finalize());
+
+    // The unfinalized state survives serialization
+    CDataStream ss(SER_DISK, PROTOCOL_VERSION);
+    ss << ac;
+    BOOST_CHECK_EQUAL(ss.size(), 2 * CNum3072::BYTE_SIZE);
+    CMuHash3072 acRead;
+    ss >> acRead;
+    acRead.Insert(b);
+    BOOST_CHECK(acRead.Finalize() == abc.Finalize());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
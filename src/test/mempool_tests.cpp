@@ -99,4 +99,167 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+/** A transaction spending output n of prev, paying nValue to a trivial script */
+static CMutableTransaction SpendTx(const uint256& hashPrev, uint32_t n, CAmount nValue, int nOutputs = 1)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vin[0].prevout = COutPoint(hashPrev, n);
+    tx.vout.resize(nOutputs);
+    for (int i = 0; i < nOutputs; i++) {
+        tx.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[i].nValue = nValue;
+    }
+    return tx;
+}
+
+static const CTxMemPoolEntry* GetEntry(CTxMemPool& pool, const CTransaction& tx)
+{
+    CTxMemPool::txiter it = pool.mapTx.find(tx.GetHash());
+    return it == pool.mapTx.end() ? NULL : &(*it);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolDescendantStateTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CTransaction txParent = SpendTx(uint256(1), 0, 10000LL, 2);
+    CTransaction txChild1 = SpendTx(txParent.GetHash(), 0, 5000LL);
+    CTransaction txChild2 = SpendTx(txParent.GetHash(), 1, 5000LL);
+    CTransaction txGrandChild = SpendTx(txChild1.GetHash(), 0, 1000LL);
+
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 100, 0, 0.0, 1));
+    pool.addUnchecked(txChild1.GetHash(), CTxMemPoolEntry(txChild1, 200, 0, 0.0, 1));
+    pool.addUnchecked(txChild2.GetHash(), CTxMemPoolEntry(txChild2, 300, 0, 0.0, 1));
+    pool.addUnchecked(txGrandChild.GetHash(), CTxMemPoolEntry(txGrandChild, 400, 0, 0.0, 1));
+
+    const CTxMemPoolEntry* parent = GetEntry(pool, txParent);
+    BOOST_CHECK_EQUAL(parent->GetCountWithDescendants(), 4U);
+    BOOST_CHECK_EQUAL(parent->GetModFeesWithDescendants(), 1000);
+    BOOST_CHECK_EQUAL(parent->GetSizeWithDescendants(), GetEntry(pool, txParent)->GetTxSize() + GetEntry(pool, txChild1)->GetTxSize() +
+                                                           GetEntry(pool, txChild2)->GetTxSize() + GetEntry(pool, txGrandChild)->GetTxSize());
+    BOOST_CHECK_EQUAL(GetEntry(pool, txChild1)->GetCountWithDescendants(), 2U);
+    BOOST_CHECK_EQUAL(GetEntry(pool, txChild1)->GetModFeesWithDescendants(), 600);
+
+    // Fee deltas count for the transaction and its ancestors
+    pool.PrioritiseTransaction(txGrandChild.GetHash(), txGrandChild.GetHash().ToString(), 0, 1000);
+    BOOST_CHECK_EQUAL(GetEntry(pool, txGrandChild)->GetModifiedFee(), 1400);
+    BOOST_CHECK_EQUAL(GetEntry(pool, txChild1)->GetModFeesWithDescendants(), 1600);
+    BOOST_CHECK_EQUAL(GetEntry(pool, txParent)->GetModFeesWithDescendants(), 2000);
+    pool.PrioritiseTransaction(txGrandChild.GetHash(), txGrandChild.GetHash().ToString(), 0, -1000);
+
+    // Removal takes the removed transactions out of the ancestors' statistics
+    std::list<CTransaction> removed;
+    pool.remove(txChild1, removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 2U);
+    BOOST_CHECK(removed.front() == txChild1);
+    BOOST_CHECK_EQUAL(GetEntry(pool, txParent)->GetCountWithDescendants(), 2U);
+    BOOST_CHECK_EQUAL(GetEntry(pool, txParent)->GetModFeesWithDescendants(), 400);
+
+    // Parents returning to the pool after their children, as after a reorganization
+    pool.remove(txParent, removed, false);
+    BOOST_CHECK_EQUAL(pool.size(), 1U);
+    pool.addUnchecked(txChild1.GetHash(), CTxMemPoolEntry(txChild1, 200, 0, 0.0, 1));
+    pool.addUnchecked(txGrandChild.GetHash(), CTxMemPoolEntry(txGrandChild, 400, 0, 0.0, 1));
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 100, 0, 0.0, 1));
+    BOOST_CHECK_EQUAL(GetEntry(pool, txParent)->GetCountWithDescendants(), 4U);
+    BOOST_CHECK_EQUAL(GetEntry(pool, txParent)->GetModFeesWithDescendants(), 1000);
+
+    // Recursive removal reports parents before their children
+    removed.clear();
+    pool.remove(txParent, removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 4U);
+    BOOST_CHECK(removed.front() == txParent);
+    BOOST_CHECK(removed.back() == txGrandChild);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+    CTransaction tx1 = SpendTx(uint256(1), 0, 10000LL);
+    CTransaction tx2 = SpendTx(uint256(2), 0, 10000LL);
+    CTransaction tx3 = SpendTx(uint256(3), 0, 10000LL);
+    // A low fee parent with a high fee child scores as the two together
+    CTransaction tx4 = SpendTx(tx3.GetHash(), 0, 9000LL);
+
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000, 0, 0.0, 1));
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 5000, 0, 0.0, 1));
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 0, 0, 0.0, 1));
+    pool.addUnchecked(tx4.GetHash(), CTxMemPoolEntry(tx4, 30000, 0, 0.0, 1));
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), 0);
+
+    // Nothing is evicted while the pool fits
+    pool.TrimToSize(pool.DynamicMemoryUsage());
+    BOOST_CHECK_EQUAL(pool.size(), 4U);
+
+    // tx2 pays the lowest rate, its size is about that of each other transaction
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 3U);
+    BOOST_CHECK(!pool.exists(tx2.GetHash()));
+    BOOST_CHECK(pool.exists(tx3.GetHash()));
+
+    // The minimum fee rate rose above that of tx2
+    CFeeRate feeRateEvicted(5000, GetEntry(pool, tx1)->GetTxSize());
+    BOOST_CHECK(pool.GetMinFee(1) > feeRateEvicted);
+
+    // Then tx1, whose rate is below that of tx3 with tx4
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 2U);
+    BOOST_CHECK(!pool.exists(tx1.GetHash()));
+
+    // Which go together
+    pool.TrimToSize(1);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+
+    // Entries expire by the time they entered the pool
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000, 100, 0.0, 1));
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 10000, 200, 0.0, 1));
+    BOOST_CHECK_EQUAL(pool.Expire(150), 1);
+    BOOST_CHECK(pool.exists(tx2.GetHash()));
+}
+
+BOOST_AUTO_TEST_CASE(MempoolDisconnectTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // Two disconnected blocks, the second spending the first
+    CMutableTransaction txCoinbase1, txCoinbase2;
+    txCoinbase1.vin.resize(1);
+    txCoinbase1.vin[0].scriptSig = CScript() << OP_1;
+    txCoinbase1.vout.resize(1);
+    txCoinbase2 = txCoinbase1;
+    txCoinbase2.vin[0].scriptSig = CScript() << OP_2;
+    CTransaction txA = SpendTx(uint256(1), 0, 10000LL, 2);
+    CTransaction txB = SpendTx(txA.GetHash(), 0, 10000LL);
+    std::deque<CTransaction> dequeDisconnected;
+    dequeDisconnected.push_back(txCoinbase1);
+    dequeDisconnected.push_back(txA);
+    dequeDisconnected.push_back(txCoinbase2);
+    dequeDisconnected.push_back(txB);
+
+    // Pool transactions depending on either block, and one that does not
+    CTransaction txC = SpendTx(txA.GetHash(), 1, 5000LL);
+    CTransaction txD = SpendTx(txC.GetHash(), 0, 5000LL);
+    CTransaction txE = SpendTx(txB.GetHash(), 0, 5000LL);
+    CTransaction txF = SpendTx(uint256(2), 0, 5000LL);
+    pool.addUnchecked(txD.GetHash(), CTxMemPoolEntry(txD, 0, 0, 0.0, 1));
+    pool.addUnchecked(txC.GetHash(), CTxMemPoolEntry(txC, 0, 0, 0.0, 1));
+    pool.addUnchecked(txE.GetHash(), CTxMemPoolEntry(txE, 0, 0, 0.0, 1));
+    pool.addUnchecked(txF.GetHash(), CTxMemPoolEntry(txF, 0, 0, 0.0, 1));
+
+    // Block transactions come back oldest first without coinbases, then their dependents, parents first
+    std::vector<CTransaction> vResurrect;
+    pool.removeForDisconnect(dequeDisconnected, vResurrect);
+    BOOST_REQUIRE_EQUAL(vResurrect.size(), 5U);
+    BOOST_CHECK(vResurrect[0] == txA);
+    BOOST_CHECK(vResurrect[1] == txB);
+    BOOST_CHECK(vResurrect[2] == txC);
+    BOOST_CHECK(vResurrect[3] == txD);
+    BOOST_CHECK(vResurrect[4] == txE);
+    BOOST_CHECK_EQUAL(pool.size(), 1U);
+    BOOST_CHECK(pool.exists(txF.GetHash()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,137 @@
+// Copyright (c) 2017-2019 The Bare developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "msgqueue.h"
+#include "net.h"
+#include "util.h"
+#include "utiltime.h"
+#include "version.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+static std::vector<std::string> vHandled;
+
+static void TestHandler(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
+{
+    int n;
+    vRecv >> n;
+    vHandled.push_back(strprintf("%s %d %d", strCommand, pfrom->GetId(), n));
+}
+
+static CDataStream TestMessage(int n)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << n;
+    return ss;
+}
+
+BOOST_AUTO_TEST_SUITE(msgqueue_tests)
+
+BOOST_AUTO_TEST_CASE(msgqueue_order)
+{
+    vHandled.clear();
+    CNode node1(INVALID_SOCKET, CAddress(), "", true);
+    CNode node2(INVALID_SOCKET, CAddress(), "", true);
+    CMessageQueue queue("test", TestHandler, 100);
+
+    BOOST_CHECK(!queue.ProcessNext(false));
+    BOOST_CHECK(queue.Push(&node1, "mnb", TestMessage(1), GetTimeMicros()));
+    BOOST_CHECK(queue.Push(&node2, "mnp", TestMessage(2), GetTimeMicros()));
+    BOOST_CHECK(queue.Push(&node1, "dseg", TestMessage(3), GetTimeMicros()));
+    BOOST_CHECK_EQUAL(queue.size(), 3U);
+    // Queued messages keep their node alive
+    BOOST_CHECK_EQUAL(node1.GetRefCount(), 2);
+    BOOST_CHECK_EQUAL(node2.GetRefCount(), 1);
+
+    while (queue.ProcessNext(false)) {
+    }
+    BOOST_CHECK_EQUAL(vHandled.size(), 3U);
+    BOOST_CHECK_EQUAL(vHandled[0], strprintf("mnb %d 1", node1.GetId()));
+    BOOST_CHECK_EQUAL(vHandled[1], strprintf("mnp %d 2", node2.GetId()));
+    BOOST_CHECK_EQUAL(vHandled[2], strprintf("dseg %d 3", node1.GetId()));
+    BOOST_CHECK_EQUAL(node1.GetRefCount(), 0);
+    BOOST_CHECK_EQUAL(node2.GetRefCount(), 0);
+
+    CMessageQueueStats stats;
+    queue.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.strName, "test");
+    BOOST_CHECK_EQUAL(stats.nDepth, 0U);
+    BOOST_CHECK_EQUAL(stats.nPeakDepth, 3U);
+    BOOST_CHECK_EQUAL(stats.nProcessed, 3U);
+    BOOST_CHECK_EQUAL(stats.nDropped, 0U);
+    BOOST_CHECK(stats.nWaitMax >= 0 && stats.nWaitTotal >= stats.nWaitMax);
+}
+
+BOOST_AUTO_TEST_CASE(msgqueue_bounds)
+{
+    vHandled.clear();
+    std::vector<CNode*> vNodesTest;
+    for (unsigned int i = 0; i < MESSAGE_QUEUE_PEER_SHARE + 1; i++)
+        vNodesTest.push_back(new CNode(INVALID_SOCKET, CAddress(), "", true));
+    // Each peer may fill a share of two
+    CMessageQueue queue("test", TestHandler, 2 * MESSAGE_QUEUE_PEER_SHARE);
+
+    BOOST_CHECK(queue.Push(vNodesTest[0], "mnb", TestMessage(0), GetTimeMicros()));
+    BOOST_CHECK(queue.Push(vNodesTest[0], "mnb", TestMessage(1), GetTimeMicros()));
+    BOOST_CHECK(!queue.Push(vNodesTest[0], "mnb", TestMessage(2), GetTimeMicros()));
+    BOOST_CHECK_EQUAL(vNodesTest[0]->GetRefCount(), 2);
+    for (unsigned int i = 1; i < MESSAGE_QUEUE_PEER_SHARE; i++) {
+        BOOST_CHECK(queue.Push(vNodesTest[i], "mnb", TestMessage(0), GetTimeMicros()));
+        BOOST_CHECK(queue.Push(vNodesTest[i], "mnb", TestMessage(1), GetTimeMicros()));
+    }
+    // Full, though the last peer has not used its share
+    BOOST_CHECK(!queue.Push(vNodesTest.back(), "mnb", TestMessage(0), GetTimeMicros()));
+    BOOST_CHECK_EQUAL(vNodesTest.back()->GetRefCount(), 0);
+
+    // Handling a message makes room again
+    BOOST_CHECK(queue.ProcessNext(false));
+    BOOST_CHECK(queue.Push(vNodesTest.back(), "mnb", TestMessage(0), GetTimeMicros()));
+    BOOST_CHECK(!queue.Push(vNodesTest[0], "mnb", TestMessage(3), GetTimeMicros()));
+
+    CMessageQueueStats stats;
+    queue.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nDepth, 2 * MESSAGE_QUEUE_PEER_SHARE);
+    BOOST_CHECK_EQUAL(stats.nMaxDepth, 2 * MESSAGE_QUEUE_PEER_SHARE);
+    BOOST_CHECK_EQUAL(stats.nDropped, 3U);
+
+    while (queue.ProcessNext(false)) {
+    }
+    BOOST_CHECK_EQUAL(vHandled.size(), 2 * MESSAGE_QUEUE_PEER_SHARE + 1);
+    BOOST_FOREACH (CNode* pnode, vNodesTest) {
+        BOOST_CHECK_EQUAL(pnode->GetRefCount(), 0);
+        delete pnode;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(msgqueue_disconnect_malformed)
+{
+    vHandled.clear();
+    CNode node1(INVALID_SOCKET, CAddress(), "", true);
+    CMessageQueue queue("test", TestHandler, 100);
+
+    // Messages of peers that are going away are not handled
+    BOOST_CHECK(queue.Push(&node1, "mnb", TestMessage(1), GetTimeMicros()));
+    node1.fDisconnect = true;
+    BOOST_CHECK(queue.ProcessNext(false));
+    BOOST_CHECK(vHandled.empty());
+    node1.fDisconnect = false;
+
+    // A message too short for its handler does not stop the queue
+    BOOST_CHECK(queue.Push(&node1, "mnb", CDataStream(SER_NETWORK, PROTOCOL_VERSION), GetTimeMicros()));
+    BOOST_CHECK(queue.Push(&node1, "mnb", TestMessage(2), GetTimeMicros()));
+    BOOST_CHECK(queue.ProcessNext(false));
+    BOOST_CHECK(queue.ProcessNext(false));
+    BOOST_CHECK_EQUAL(vHandled.size(), 1U);
+    BOOST_CHECK_EQUAL(node1.GetRefCount(), 0);
+
+    CMessageQueueStats stats;
+    queue.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nProcessed, 3U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,141 @@
+// Copyright (c) 2017-2019 The Bare developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "net.h"
+#include "hash.h"
+#include "protocol.h"
+#include "serialize.h"
+#include "streams.h"
+#include "version.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+#ifndef WIN32
+
+/** Read what the node wrote to the other end of its socket pair, without blocking */
+static void ReadAvailable(SOCKET hSocket, std::vector<char>& vch)
+{
+    char pchBuf[0x10000];
+    int nBytes;
+    while ((nBytes = recv(hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT)) > 0)
+        vch.insert(vch.end(), pchBuf, pchBuf + nBytes);
+}
+
+/** Parse one message off the front of ss and check it */
+static void CheckMessage(CDataStream& ss, const std::string& strCommand, const std::vector<char>& vchPayload)
+{
+    CMessageHeader hdr;
+    ss >> hdr;
+    BOOST_CHECK(hdr.IsValid());
+    BOOST_CHECK_EQUAL(hdr.GetCommand(), strCommand);
+    BOOST_REQUIRE_EQUAL(hdr.nMessageSize, vchPayload.size());
+    std::vector<char> vch(vchPayload.size());
+    if (!vch.empty())
+        ss.read(&vch[0], vch.size());
+    BOOST_CHECK(vch == vchPayload);
+    uint256 hash = Hash(vch.begin(), vch.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    BOOST_CHECK_EQUAL(hdr.nChecksum, nChecksum);
+}
+
+BOOST_AUTO_TEST_CASE(net_send_shared_payload)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    CNode node(fds[0], CAddress(), "", true);
+
+    CDataStream ssPayload(SER_NETWORK, PROTOCOL_VERSION);
+    ssPayload << std::string("shared payload") << 1234;
+    std::vector<char> vchShared(ssPayload.begin(), ssPayload.end());
+    CSharedPayload payload = MakeSharedPayload(ssPayload);
+    BOOST_CHECK_EQUAL(payload->size(), vchShared.size());
+
+    CDataStream ssPing(SER_NETWORK, PROTOCOL_VERSION);
+    ssPing << (uint64_t)42;
+    std::vector<char> vchPing(ssPing.begin(), ssPing.end());
+
+    node.PushSharedMessage("tx", payload);
+    node.PushMessage("ping", (uint64_t)42);
+    node.PushMessage("verack");
+    node.PushSharedMessage("tx", payload);
+
+    // Everything fit in the socket buffer, and the queue let go of the payload
+    BOOST_CHECK(node.vSendMsg.empty());
+    BOOST_CHECK_EQUAL(node.nSendSize, 0U);
+    BOOST_CHECK_EQUAL(payload.use_count(), 1);
+
+    std::vector<char> vchRecv;
+    ReadAvailable(fds[1], vchRecv);
+    CDataStream ss(vchRecv, SER_NETWORK, PROTOCOL_VERSION);
+    CheckMessage(ss, "tx", vchShared);
+    CheckMessage(ss, "ping", vchPing);
+    CheckMessage(ss, "verack", std::vector<char>());
+    CheckMessage(ss, "tx", vchShared);
+    BOOST_CHECK(ss.empty());
+    close(fds[1]);
+}
+
+BOOST_AUTO_TEST_CASE(net_send_partial)
+{
+    int fds[2][2];
+    std::vector<CNode*> vNodesTest;
+    for (int i = 0; i < 2; i++) {
+        BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]) == 0);
+        vNodesTest.push_back(new CNode(fds[i][0], CAddress(), "", true));
+    }
+
+    // Larger than any socket buffer, so it goes out in pieces
+    std::vector<char> vchBig(4000000);
+    for (size_t i = 0; i < vchBig.size(); i++)
+        vchBig[i] = (char)(i * 7919);
+    CDataStream ssBig(vchBig, SER_NETWORK, PROTOCOL_VERSION);
+    CSharedPayload payload = MakeSharedPayload(ssBig);
+
+    for (int i = 0; i < 2; i++) {
+        vNodesTest[i]->PushSharedMessage("block", payload);
+        vNodesTest[i]->PushMessage("ping", (uint64_t)i);
+    }
+    // Both queues hold the one payload
+    BOOST_CHECK_EQUAL(payload.use_count(), 3);
+
+    for (int i = 0; i < 2; i++) {
+        CNode* pnode = vNodesTest[i];
+        BOOST_CHECK(!pnode->vSendMsg.empty());
+        BOOST_CHECK(pnode->nSendSize > 0);
+
+        std::vector<char> vchRecv;
+        for (int n = 0; n < 100000 && !pnode->vSendMsg.empty(); n++) {
+            ReadAvailable(fds[i][1], vchRecv);
+            LOCK(pnode->cs_vSend);
+            SocketSendData(pnode);
+        }
+        ReadAvailable(fds[i][1], vchRecv);
+        BOOST_CHECK(pnode->vSendMsg.empty());
+        BOOST_CHECK_EQUAL(pnode->nSendSize, 0U);
+        BOOST_CHECK_EQUAL(pnode->nSendOffset, 0U);
+
+        CDataStream ss(vchRecv, SER_NETWORK, PROTOCOL_VERSION);
+        CheckMessage(ss, "block", vchBig);
+        CDataStream ssPing(SER_NETWORK, PROTOCOL_VERSION);
+        ssPing << (uint64_t)i;
+        CheckMessage(ss, "ping", std::vector<char>(ssPing.begin(), ssPing.end()));
+        BOOST_CHECK(ss.empty());
+    }
+    BOOST_CHECK_EQUAL(payload.use_count(), 1);
+
+    for (int i = 0; i < 2; i++) {
+        delete vNodesTest[i];
+        close(fds[i][1]);
+    }
+}
+
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,110 @@
+// Copyright (c) 2017-2019 The Bare developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "spentindex.h"
+#include "clientversion.h"
+#include "streams.h"
+#include "txdb.h"
+
+#include <utility>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(spentindex_tests)
+
+BOOST_AUTO_TEST_CASE(spentindex_serialize)
+{
+    CSpentIndexKey key(uint256(12345), 7);
+    CSpentIndexValue value(uint256(67890), 3, 70000, 5 * COIN, 1, uint160(4242));
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << key << value;
+    // txid and output index, then txid, input index, height, value, address type and hash
+    BOOST_CHECK_EQUAL(ss.size(), 32U + 4U + 32U + 4U + 4U + 8U + 4U + 20U);
+
+    CSpentIndexKey keyRead;
+    CSpentIndexValue valueRead;
+    ss >> keyRead >> valueRead;
+    BOOST_CHECK(ss.empty());
+    BOOST_CHECK(keyRead.txid == key.txid);
+    BOOST_CHECK_EQUAL(keyRead.outputIndex, 7U);
+    BOOST_CHECK(valueRead.txid == value.txid);
+    BOOST_CHECK_EQUAL(valueRead.inputIndex, 3U);
+    BOOST_CHECK_EQUAL(valueRead.blockHeight, 70000);
+    BOOST_CHECK_EQUAL(valueRead.satoshis, 5 * COIN);
+    BOOST_CHECK_EQUAL(valueRead.addressType, 1);
+    BOOST_CHECK(valueRead.addressHash == value.addressHash);
+    BOOST_CHECK(!valueRead.IsNull());
+    BOOST_CHECK(CSpentIndexValue().IsNull());
+}
+
+BOOST_AUTO_TEST_CASE(spentindex_update)
+{
+    CSpentIndexKey key1(uint256(1), 0);
+    CSpentIndexKey key2(uint256(1), 1);
+    CSpentIndexValue value(uint256(2), 0, 100, COIN, 0, uint160(0));
+    CSpentIndexValue valueRead;
+
+    // Connecting a block records its spends
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > vSpent;
+    vSpent.push_back(std::make_pair(key1, value));
+    vSpent.push_back(std::make_pair(key2, value));
+    BOOST_CHECK(pblocktree->UpdateSpentIndex(vSpent));
+    BOOST_CHECK(pblocktree->ReadSpentIndex(key1, valueRead));
+    BOOST_CHECK(valueRead.txid == value.txid);
+    BOOST_CHECK_EQUAL(valueRead.blockHeight, 100);
+    BOOST_CHECK(pblocktree->ReadSpentIndex(key2, valueRead));
+
+    // Disconnecting it writes null values, which erase them
+    vSpent.clear();
+    vSpent.push_back(std::make_pair(key1, CSpentIndexValue()));
+    BOOST_CHECK(pblocktree->UpdateSpentIndex(vSpent));
+    BOOST_CHECK(!pblocktree->ReadSpentIndex(key1, valueRead));
+    BOOST_CHECK(pblocktree->ReadSpentIndex(key2, valueRead));
+
+    vSpent.clear();
+    vSpent.push_back(std::make_pair(key2, CSpentIndexValue()));
+    BOOST_CHECK(pblocktree->UpdateSpentIndex(vSpent));
+    BOOST_CHECK(!pblocktree->ReadSpentIndex(key2, valueRead));
+}
+
+BOOST_AUTO_TEST_CASE(spentindex_disconnect_batch)
+{
+    // Block 1 creates an output at key2 that block 2 spends, and spends key1 itself
+    CSpentIndexKey key1(uint256(11), 0);
+    CSpentIndexKey key2(uint256(12), 0);
+    CSpentIndexValue valueRead;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > vSpent;
+    vSpent.push_back(std::make_pair(key1, CSpentIndexValue(uint256(12), 0, 1, COIN, 0, uint160(0))));
+    vSpent.push_back(std::make_pair(key2, CSpentIndexValue(uint256(13), 0, 2, COIN, 0, uint160(0))));
+    BOOST_CHECK(pblocktree->UpdateSpentIndex(vSpent));
+    CTimestampIndexKey keyTime1(1000, uint256(101));
+    CTimestampIndexKey keyTime2(1001, uint256(102));
+    BOOST_CHECK(pblocktree->WriteTimestampIndex(keyTime1, 1000));
+    BOOST_CHECK(pblocktree->WriteTimestampIndex(keyTime2, 1001));
+
+    // Disconnecting both blocks collects their changes, tip first
+    CIndexUpdates updates;
+    BOOST_CHECK(updates.empty());
+    updates.vSpentIndex.push_back(std::make_pair(key2, CSpentIndexValue()));
+    updates.vTimestampIndexErase.push_back(keyTime2);
+    updates.vSpentIndex.push_back(std::make_pair(key1, CSpentIndexValue()));
+    updates.vTimestampIndexErase.push_back(keyTime1);
+    BOOST_CHECK(!updates.empty());
+
+    // Nothing changes until the batch is written
+    unsigned int nLogicalTime;
+    BOOST_CHECK(pblocktree->ReadSpentIndex(key1, valueRead));
+    BOOST_CHECK(pblocktree->ReadSpentIndex(key2, valueRead));
+    BOOST_CHECK(pblocktree->ReadTimestampIndexEntry(keyTime2, nLogicalTime));
+
+    BOOST_CHECK(pblocktree->WriteIndexUpdates(updates));
+    BOOST_CHECK(!pblocktree->ReadSpentIndex(key1, valueRead));
+    BOOST_CHECK(!pblocktree->ReadSpentIndex(key2, valueRead));
+    BOOST_CHECK(!pblocktree->ReadTimestampIndexEntry(keyTime1, nLogicalTime));
+    BOOST_CHECK(!pblocktree->ReadTimestampIndexEntry(keyTime2, nLogicalTime));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
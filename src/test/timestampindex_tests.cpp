@@ -0,0 +1,125 @@
+// Copyright (c) 2017-2019 The Bare developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "timestampindex.h"
+#include "chain.h"
+#include "clientversion.h"
+#include "main.h"
+#include "streams.h"
+#include "txdb.h"
+
+#include <utility>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+static std::string SerializeKey(const CTimestampIndexKey& key)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << key;
+    return ss.str();
+}
+
+BOOST_AUTO_TEST_SUITE(timestampindex_tests)
+
+BOOST_AUTO_TEST_CASE(timestampindex_key_order)
+{
+    // Timestamps sort numerically, so a time range is one key range
+    BOOST_CHECK(SerializeKey(CTimestampIndexKey(255, uint256(2))) < SerializeKey(CTimestampIndexKey(256, uint256(1))));
+    BOOST_CHECK(SerializeKey(CTimestampIndexKey(0xffff, uint256(2))) < SerializeKey(CTimestampIndexKey(0x10000, uint256(1))));
+
+    // A seek key is a prefix of the keys at its time
+    CDataStream ssSeek(SER_DISK, CLIENT_VERSION);
+    ssSeek << CTimestampIndexIteratorKey(1500000000);
+    std::string strKey = SerializeKey(CTimestampIndexKey(1500000000, uint256(3)));
+    BOOST_CHECK_EQUAL(strKey.compare(0, ssSeek.size(), ssSeek.str()), 0);
+
+    CTimestampIndexKey keyRead;
+    CDataStream ss(strKey.data(), strKey.data() + strKey.size(), SER_DISK, CLIENT_VERSION);
+    ss >> keyRead;
+    BOOST_CHECK_EQUAL(keyRead.timestamp, 1500000000U);
+    BOOST_CHECK(keyRead.blockHash == uint256(3));
+}
+
+BOOST_AUTO_TEST_CASE(timestampindex_range)
+{
+    fTimestampIndex = true;
+
+    // A chain whose second block goes back in time
+    uint256 hashes[3] = {uint256(1001), uint256(1002), uint256(1003)};
+    unsigned int times[3] = {1000, 990, 1005};
+    CBlockIndex blocks[3];
+    for (int i = 0; i < 3; i++) {
+        blocks[i].phashBlock = &hashes[i];
+        blocks[i].pprev = i > 0 ? &blocks[i - 1] : NULL;
+        blocks[i].nHeight = i;
+        blocks[i].nTime = times[i];
+        BOOST_CHECK(pblocktree->WriteTimestampIndex(CTimestampIndexKey(times[i], hashes[i]), GetLogicalTimestamp(&blocks[i])));
+    }
+
+    // The low end of a range is inclusive, the high end exclusive; entries come in time order
+    std::vector<std::pair<uint256, unsigned int> > vHashes;
+    BOOST_CHECK(GetTimestampIndex(1005, 990, false, vHashes));
+    BOOST_REQUIRE_EQUAL(vHashes.size(), 2U);
+    BOOST_CHECK(vHashes[0].first == hashes[1]);
+    BOOST_CHECK(vHashes[1].first == hashes[0]);
+
+    // Logical times increase with height
+    BOOST_CHECK_EQUAL(vHashes[0].second, 1001U);
+    BOOST_CHECK_EQUAL(vHashes[1].second, 1000U);
+
+    vHashes.clear();
+    BOOST_CHECK(GetTimestampIndex(1006, 991, false, vHashes));
+    BOOST_REQUIRE_EQUAL(vHashes.size(), 2U);
+    BOOST_CHECK(vHashes[0].first == hashes[0]);
+    BOOST_CHECK(vHashes[1].first == hashes[2]);
+    BOOST_CHECK_EQUAL(vHashes[1].second, 1005U);
+
+    vHashes.clear();
+    BOOST_CHECK(GetTimestampIndex(1000, 991, false, vHashes));
+    BOOST_CHECK(vHashes.empty());
+
+    // None of these blocks is in the active chain
+    BOOST_CHECK(GetTimestampIndex(1006, 990, true, vHashes));
+    BOOST_CHECK(vHashes.empty());
+
+    for (int i = 0; i < 3; i++)
+        BOOST_CHECK(pblocktree->EraseTimestampIndex(CTimestampIndexKey(times[i], hashes[i])));
+    vHashes.clear();
+    BOOST_CHECK(GetTimestampIndex(1006, 990, false, vHashes));
+    BOOST_CHECK(vHashes.empty());
+
+    fTimestampIndex = false;
+}
+
+BOOST_AUTO_TEST_CASE(timestampindex_no_orphans)
+{
+    fTimestampIndex = true;
+
+    // The genesis block is active, a block of the same time that is not in the block index is not
+    const CBlockIndex* pgenesis = chainActive.Genesis();
+    BOOST_REQUIRE(pgenesis);
+    CTimestampIndexKey keyGenesis(pgenesis->nTime, pgenesis->GetBlockHash());
+    CTimestampIndexKey keyOrphan(pgenesis->nTime, uint256(1004));
+    BOOST_CHECK(pblocktree->WriteTimestampIndex(keyGenesis, pgenesis->nTime));
+    BOOST_CHECK(pblocktree->WriteTimestampIndex(keyOrphan, pgenesis->nTime));
+
+    std::vector<std::pair<uint256, unsigned int> > vHashes;
+    BOOST_CHECK(GetTimestampIndex(pgenesis->nTime + 1, pgenesis->nTime, false, vHashes));
+    BOOST_CHECK_EQUAL(vHashes.size(), 2U);
+
+    vHashes.clear();
+    BOOST_CHECK(GetTimestampIndex(pgenesis->nTime + 1, pgenesis->nTime, true, vHashes));
+    BOOST_REQUIRE_EQUAL(vHashes.size(), 1U);
+    BOOST_CHECK(vHashes[0].first == pgenesis->GetBlockHash());
+
+    BOOST_CHECK(pblocktree->EraseTimestampIndex(keyGenesis));
+    BOOST_CHECK(pblocktree->EraseTimestampIndex(keyOrphan));
+
+    // Without the index there is nothing to query
+    fTimestampIndex = false;
+    BOOST_CHECK(!GetTimestampIndex(pgenesis->nTime + 1, pgenesis->nTime, false, vHashes));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,52 @@
+// Copyright (c) 2017-2019 The Bare developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TIMESTAMPINDEX_H
+#define BITCOIN_TIMESTAMPINDEX_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+/**
+ * A block of the active chain, keyed by its timestamp. Block times are not
+ * monotonic in height, so the blocks of a time range are found by a scan
+ * over these keys rather than by bisecting the chain.
+ *
+ * The value of an entry is the logical time of the block: its timestamp,
+ * raised to one second past the logical time of its predecessor where block
+ * times go backwards. Logical times increase with height.
+ */
+struct CTimestampIndexKey {
+    unsigned int timestamp;
+    uint256 blockHash;
+
+    CTimestampIndexKey() : timestamp(0), blockHash(0) {}
+    CTimestampIndexKey(unsigned int timestampIn, const uint256& blockHashIn) : timestamp(timestampIn), blockHash(blockHashIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(BIGENDIAN32(timestamp));
+        READWRITE(blockHash);
+    }
+};
+
+/** Prefix of CTimestampIndexKey for seeking to the first block at or after a time */
+struct CTimestampIndexIteratorKey {
+    unsigned int timestamp;
+
+    CTimestampIndexIteratorKey(unsigned int timestampIn) : timestamp(timestampIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(BIGENDIAN32(timestamp));
+    }
+};
+
+#endif // BITCOIN_TIMESTAMPINDEX_H
@@ -28,8 +28,20 @@ void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
     batch.Write('B', hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe)
+void static BatchWriteCommitment(CLevelDBBatch& batch, const uint256& hash, const CCoinsCommitment& commitment)
 {
+    batch.Write('M', make_pair(hash, commitment));
+}
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe), fHaveCommitment(false)
+{
+    // The commitment is only usable if it was written together with the current
+    // best block; a chainstate last written by an older version has to be rescanned.
+    pair<uint256, CCoinsCommitment> stored;
+    if (db.Read('M', stored) && stored.first == GetBestBlock()) {
+        commitment = stored.second;
+        fHaveCommitment = true;
+    }
 }
 
 bool CCoinsViewDB::GetCoins(const uint256& txid, CCoins& coins) const
@@ -66,6 +78,8 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
     }
     if (hashBlock != uint256(0))
         BatchWriteHashBestChain(batch, hashBlock);
+    if (fHaveCommitment)
+        BatchWriteCommitment(batch, hashBlock != uint256(0) ? hashBlock : GetBestBlock(), commitment);
 
     LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
     return db.WriteBatch(batch);
@@ -80,6 +94,11 @@ bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
     return Write(make_pair('b', blockindex.GetBlockHash()), blockindex);
 }
 
+bool CBlockTreeDB::ReadBlockIndex(const uint256& hash, CDiskBlockIndex& blockindex)
+{
+    return Read(make_pair('b', hash), blockindex);
+}
+
 bool CBlockTreeDB::WriteBlockFileInfo(int nFile, const CBlockFileInfo& info)
 {
     return Write(make_pair('f', nFile), info);
@@ -114,7 +133,20 @@ bool CBlockTreeDB::ReadLastBlockFile(int& nFile)
     return Read('l', nFile);
 }
 
-bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
+bool CCoinsViewDB::GetCommitment(CCoinsCommitment& commitmentOut) const
+{
+    if (fHaveCommitment)
+        commitmentOut = commitment;
+    return fHaveCommitment;
+}
+
+void CCoinsViewDB::SetCommitment(const CCoinsCommitment& commitmentIn)
+{
+    commitment = commitmentIn;
+    fHaveCommitment = true;
+}
+
+bool CCoinsViewDB::ScanCoins(CCoinsCommitment& commitmentOut) const
 {
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
@@ -122,10 +154,6 @@ bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
     boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
     pcursor->SeekToFirst();
 
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = GetBestBlock();
-    ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
@@ -140,31 +168,47 @@ bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
                 ssValue >> coins;
                 uint256 txhash;
                 ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
+                commitmentOut.nTransactions++;
                 for (unsigned int i = 0; i < coins.vout.size(); i++) {
                     const CTxOut& out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i + 1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
+                    if (!out.IsNull())
+                        commitmentOut.AddCoin(COutPoint(txhash, i), out, coins.nHeight, coins.fCoinBase);
                 }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
             }
             pcursor->Next();
         } catch (std::exception& e) {
             return error("%s : Deserialize or I/O error - %s", __func__, e.what());
         }
     }
-    stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
-    stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
+    return true;
+}
+
+bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
+{
+    CCoinsCommitment current;
+    if (fHaveCommitment)
+        current = commitment;
+    else if (!ScanCoins(current))
+        return false;
+
+    stats.hashBlock = GetBestBlock();
+    stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
+    current.GetStats(stats);
+    return true;
+}
+
+bool CCoinsViewDB::RebuildCommitment()
+{
+    CCoinsCommitment scanned;
+    if (!ScanCoins(scanned))
+        return false;
+
+    CLevelDBBatch batch;
+    BatchWriteCommitment(batch, GetBestBlock(), scanned);
+    if (!db.WriteBatch(batch, true))
+        return false;
+    commitment = scanned;
+    fHaveCommitment = true;
     return true;
 }
 
@@ -181,6 +225,184 @@ bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos>
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> >& vect)
+{
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = vect.begin(); it != vect.end(); it++)
+        batch.Write(make_pair('a', it->first), it->second);
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> >& vect)
+{
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = vect.begin(); it != vect.end(); it++)
+        batch.Erase(make_pair('a', it->first));
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::ReadAddressIndex(const uint160& hashBytes, int type, std::vector<std::pair<CAddressIndexKey, CAmount> >& vect, int nStart, int nEnd)
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('a', CAddressIndexIteratorKey(type, hashBytes, nStart > 0 ? nStart : 0));
+    pcursor->Seek(ssKeySet.str());
+
+    for (; pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() == 0 || slKey[0] != 'a')
+            break;
+        try {
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressIndexKey key;
+            ssKey >> chType >> key;
+            if (key.type != type || key.hashBytes != hashBytes || (nEnd > 0 && key.nHeight > nEnd))
+                break;
+
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            CAmount nValue;
+            ssValue >> nValue;
+            vect.push_back(make_pair(key, nValue));
+        } catch (const std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    return true;
+}
+
+bool CBlockTreeDB::UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vect)
+{
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it = vect.begin(); it != vect.end(); it++) {
+        if (it->second.IsNull())
+            batch.Erase(make_pair('u', it->first));
+        else
+            batch.Write(make_pair('u', it->first), it->second);
+    }
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::ReadAddressUnspentIndex(const uint160& hashBytes, int type, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vect)
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('u', make_pair((unsigned char)type, hashBytes));
+    pcursor->Seek(ssKeySet.str());
+
+    for (; pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() == 0 || slKey[0] != 'u')
+            break;
+        try {
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressUnspentKey key;
+            ssKey >> chType >> key;
+            if (key.type != type || key.hashBytes != hashBytes)
+                break;
+
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            CAddressUnspentValue value;
+            ssValue >> value;
+            vect.push_back(make_pair(key, value));
+        } catch (const std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    return true;
+}
+
+bool CBlockTreeDB::ReadSpentIndex(const CSpentIndexKey& key, CSpentIndexValue& value)
+{
+    return Read(make_pair('p', key), value);
+}
+
+bool CBlockTreeDB::UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >& vect)
+{
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >::const_iterator it = vect.begin(); it != vect.end(); it++) {
+        if (it->second.IsNull())
+            batch.Erase(make_pair('p', it->first));
+        else
+            batch.Write(make_pair('p', it->first), it->second);
+    }
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::WriteTimestampIndex(const CTimestampIndexKey& key, unsigned int nLogicalTime)
+{
+    return Write(make_pair('s', key), nLogicalTime);
+}
+
+bool CBlockTreeDB::EraseTimestampIndex(const CTimestampIndexKey& key)
+{
+    return Erase(make_pair('s', key));
+}
+
+bool CBlockTreeDB::ReadTimestampIndexEntry(const CTimestampIndexKey& key, unsigned int& nLogicalTime)
+{
+    return Read(make_pair('s', key), nLogicalTime);
+}
+
+bool CBlockTreeDB::ReadTimestampIndex(unsigned int nHigh, unsigned int nLow, std::vector<std::pair<uint256, unsigned int> >& vHashes)
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('s', CTimestampIndexIteratorKey(nLow));
+    pcursor->Seek(ssKeySet.str());
+
+    for (; pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() == 0 || slKey[0] != 's')
+            break;
+        try {
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CTimestampIndexKey key;
+            ssKey >> chType >> key;
+            if (key.timestamp >= nHigh)
+                break;
+
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            unsigned int nLogicalTime;
+            ssValue >> nLogicalTime;
+            vHashes.push_back(make_pair(key.blockHash, nLogicalTime));
+        } catch (const std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    return true;
+}
+
+bool CBlockTreeDB::WriteIndexUpdates(const CIndexUpdates& updates)
+{
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = updates.vAddressIndexErase.begin(); it != updates.vAddressIndexErase.end(); it++)
+        batch.Erase(make_pair('a', it->first));
+    for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it = updates.vAddressUnspentIndex.begin(); it != updates.vAddressUnspentIndex.end(); it++) {
+        if (it->second.IsNull())
+            batch.Erase(make_pair('u', it->first));
+        else
+            batch.Write(make_pair('u', it->first), it->second);
+    }
+    for (std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >::const_iterator it = updates.vSpentIndex.begin(); it != updates.vSpentIndex.end(); it++) {
+        if (it->second.IsNull())
+            batch.Erase(make_pair('p', it->first));
+        else
+            batch.Write(make_pair('p', it->first), it->second);
+    }
+    for (std::vector<CTimestampIndexKey>::const_iterator it = updates.vTimestampIndexErase.begin(); it != updates.vTimestampIndexErase.end(); it++)
+        batch.Erase(make_pair('s', *it));
+    return WriteBatch(batch);
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string& name, bool fValue)
 {
     return Write(std::make_pair('F', name), fValue ? '1' : '0');
@@ -195,67 +417,129 @@ bool CBlockTreeDB::ReadFlag(const std::string& name, bool& fValue)
     return true;
 }
 
-bool CBlockTreeDB::LoadBlockIndexGuts()
+namespace
 {
-    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
-
-    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
-    ssKeySet << make_pair('b', uint256(0));
-    pcursor->Seek(ssKeySet.str());
-
-    // Load mapBlockIndex
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
+/** A block index record decoded by one of the loader threads */
+struct CLoadedBlockIndex {
+    uint256 hash;
+    uint256 hashPrev;
+    COutPoint prevoutStake;
+    unsigned int nStakeTime;
+    CBlockIndex* pindex;
+};
+
+/**
+ * Decode all block index records whose hash starts with a serialized byte in
+ * [nBegin, nEnd). The keys are ordered by that byte, so every thread can walk
+ * its own contiguous range of the database.
+ */
+void LoadBlockIndexRange(CBlockTreeDB* pdb, int nBegin, int nEnd, std::vector<CLoadedBlockIndex>* pvLoaded, std::string* pstrError)
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(pdb->NewIterator());
+    std::string strStart(1, 'b');
+    strStart.push_back((char)nBegin);
+    pcursor->Seek(strStart);
+
+    for (; pcursor->Valid(); pcursor->Next()) {
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() < 2 || slKey[0] != 'b' || (unsigned char)slKey[1] >= nEnd)
+            break;
         try {
-            leveldb::Slice slKey = pcursor->key();
             CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
             char chType;
-            ssKey >> chType;
-            if (chType == 'b') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
-
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->pnext = InsertBlockIndex(diskindex.hashNext);
-                pindexNew->nHeight = diskindex.nHeight;
-                pindexNew->nFile = diskindex.nFile;
-                pindexNew->nDataPos = diskindex.nDataPos;
-                pindexNew->nUndoPos = diskindex.nUndoPos;
-                pindexNew->nVersion = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime = diskindex.nTime;
-                pindexNew->nBits = diskindex.nBits;
-                pindexNew->nNonce = diskindex.nNonce;
-                pindexNew->nStatus = diskindex.nStatus;
-                pindexNew->nTx = diskindex.nTx;
-
-                //Proof Of Stake
-                pindexNew->nMint = diskindex.nMint;
-                pindexNew->nMoneySupply = diskindex.nMoneySupply;
-                pindexNew->nFlags = diskindex.nFlags;
-                pindexNew->nStakeModifier = diskindex.nStakeModifier;
-                pindexNew->prevoutStake = diskindex.prevoutStake;
-                pindexNew->nStakeTime = diskindex.nStakeTime;
-                pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
-
-                if (pindexNew->nHeight <= Params().LAST_POW_BLOCK() && !pindexNew->hashMerkleRoot.EqualTo(0)) {
-                    if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits))
-                        return error("LoadBlockIndex() : CheckProofOfWork failed: %s", pindexNew->ToString());
+            CLoadedBlockIndex loaded;
+            ssKey >> chType >> loaded.hash;
+
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            CDiskBlockIndex diskindex;
+            ssValue >> diskindex;
+
+            // Entries that passed the header checks before are trusted to be
+            // stored under their own hash; only the others are hashed again.
+            if (!diskindex.IsValid(BLOCK_VALID_TREE) && diskindex.GetBlockHash() != loaded.hash) {
+                *pstrError = strprintf("block index entry %s is stored under the wrong hash", loaded.hash.ToString());
+                return;
+            }
+            if (diskindex.nHeight <= Params().LAST_POW_BLOCK() && !diskindex.hashMerkleRoot.EqualTo(0)) {
+                if (!CheckProofOfWork(loaded.hash, diskindex.nBits)) {
+                    *pstrError = strprintf("CheckProofOfWork failed: %s", diskindex.ToString());
+                    return;
                 }
-                // ppcoin: build setStakeSeen
-                if (pindexNew->IsProofOfStake())
-                    setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
-
-                pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
             }
+
+            // Construct block index object
+            CBlockIndex* pindexNew = AllocateBlockIndex();
+            pindexNew->nHeight = diskindex.nHeight;
+            pindexNew->nFile = diskindex.nFile;
+            pindexNew->nDataPos = diskindex.nDataPos;
+            pindexNew->nUndoPos = diskindex.nUndoPos;
+            pindexNew->nVersion = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime = diskindex.nTime;
+            pindexNew->nBits = diskindex.nBits;
+            pindexNew->nNonce = diskindex.nNonce;
+            pindexNew->nStatus = diskindex.nStatus;
+            pindexNew->nTx = diskindex.nTx;
+
+            //Proof Of Stake; the cold fields stay on disk
+            pindexNew->nFlags = diskindex.nFlags;
+            pindexNew->nStakeModifier = diskindex.nStakeModifier;
+
+            loaded.hashPrev = diskindex.hashPrev;
+            loaded.prevoutStake = diskindex.prevoutStake;
+            loaded.nStakeTime = diskindex.nStakeTime;
+            loaded.pindex = pindexNew;
+            pvLoaded->push_back(loaded);
         } catch (std::exception& e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            *pstrError = strprintf("Deserialize or I/O error - %s", e.what());
+            return;
+        }
+    }
+}
+} // anon namespace
+
+bool CBlockTreeDB::LoadBlockIndexGuts()
+{
+    // Decode the records in parallel
+    int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), 16));
+    std::vector<std::vector<CLoadedBlockIndex> > vvLoaded(nThreads);
+    std::vector<std::string> vstrError(nThreads);
+    boost::thread_group threads;
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&LoadBlockIndexRange, this, i * 256 / nThreads, (i + 1) * 256 / nThreads, &vvLoaded[i], &vstrError[i]));
+    threads.join_all();
+
+    size_t nLoaded = 0;
+    for (int i = 0; i < nThreads; i++) {
+        if (!vstrError[i].empty())
+            return error("%s : %s", __func__, vstrError[i]);
+        nLoaded += vvLoaded[i].size();
+    }
+
+    // Load mapBlockIndex; all entries go in before they are linked, so a
+    // placeholder is only created for a parent that is missing from the database
+    mapBlockIndex.reserve(mapBlockIndex.size() + nLoaded);
+    for (int i = 0; i < nThreads; i++) {
+        BOOST_FOREACH (CLoadedBlockIndex& loaded, vvLoaded[i]) {
+            std::pair<BlockMap::iterator, bool> ret = mapBlockIndex.insert(make_pair(loaded.hash, loaded.pindex));
+            if (!ret.second) {
+                // Already referenced before loading, fill in the existing entry
+                *ret.first->second = *loaded.pindex;
+                loaded.pindex = ret.first->second;
+            }
+            loaded.pindex->phashBlock = &ret.first->first;
+        }
+    }
+    for (int i = 0; i < nThreads; i++) {
+        boost::this_thread::interruption_point();
+        BOOST_FOREACH (const CLoadedBlockIndex& loaded, vvLoaded[i]) {
+            CBlockIndex* pindexNew = loaded.pindex;
+            pindexNew->pprev = InsertBlockIndex(loaded.hashPrev);
+
+            // ppcoin: build setStakeSeen
+            if (pindexNew->IsProofOfStake())
+                setStakeSeen.insert(make_pair(loaded.prevoutStake, loaded.nStakeTime));
         }
     }
 
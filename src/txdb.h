@@ -6,8 +6,11 @@
 #ifndef BITCOIN_TXDB_H
 #define BITCOIN_TXDB_H
 
+#include "addressindex.h"
 #include "leveldbwrapper.h"
 #include "main.h"
+#include "spentindex.h"
+#include "timestampindex.h"
 
 #include <map>
 #include <string>
@@ -30,6 +33,10 @@ class CCoinsViewDB : public CCoinsView
 protected:
     CLevelDBWrapper db;
 
+    //! Running commitment as of the best block; only valid if fHaveCommitment
+    CCoinsCommitment commitment;
+    bool fHaveCommitment;
+
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
@@ -38,6 +45,31 @@ public:
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
     bool GetStats(CCoinsStats& stats) const;
+    bool GetCommitment(CCoinsCommitment& commitment) const;
+    void SetCommitment(const CCoinsCommitment& commitment);
+
+    //! Build the running commitment from a full scan of the database and store it with the best block
+    bool RebuildCommitment();
+
+private:
+    bool ScanCoins(CCoinsCommitment& commitmentOut) const;
+};
+
+/**
+ * Index changes of disconnected blocks. They are collected for a whole
+ * batch of blocks and written in one go once the batch has succeeded, so
+ * a failed reorganization leaves the indexes matching the chain.
+ */
+struct CIndexUpdates {
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressIndexErase;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vAddressUnspentIndex;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > vSpentIndex;
+    std::vector<CTimestampIndexKey> vTimestampIndexErase;
+
+    bool empty() const
+    {
+        return vAddressIndexErase.empty() && vAddressUnspentIndex.empty() && vSpentIndex.empty() && vTimestampIndexErase.empty();
+    }
 };
 
 /** Access to the block database (blocks/index/) */
@@ -52,6 +84,7 @@ private:
 
 public:
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
+    bool ReadBlockIndex(const uint256& hash, CDiskBlockIndex& blockindex);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo& fileinfo);
     bool WriteBlockFileInfo(int nFile, const CBlockFileInfo& fileinfo);
     bool ReadLastBlockFile(int& nFile);
@@ -60,6 +93,23 @@ public:
     bool ReadReindexing(bool& fReindex);
     bool ReadTxIndex(const uint256& txid, CDiskTxPos& pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >& list);
+    bool WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> >& vect);
+    bool EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> >& vect);
+    //! Read the balance changes of an address, optionally limited to the heights [nStart, nEnd]
+    bool ReadAddressIndex(const uint160& hashBytes, int type, std::vector<std::pair<CAddressIndexKey, CAmount> >& vect, int nStart = 0, int nEnd = 0);
+    //! Add unspent outputs, or erase the entries whose value is null
+    bool UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vect);
+    bool ReadAddressUnspentIndex(const uint160& hashBytes, int type, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vect);
+    bool ReadSpentIndex(const CSpentIndexKey& key, CSpentIndexValue& value);
+    //! Record spends, or erase the entries whose value is null
+    bool UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >& vect);
+    bool WriteTimestampIndex(const CTimestampIndexKey& key, unsigned int nLogicalTime);
+    bool EraseTimestampIndex(const CTimestampIndexKey& key);
+    bool ReadTimestampIndexEntry(const CTimestampIndexKey& key, unsigned int& nLogicalTime);
+    //! Read the hashes and logical times of the indexed blocks with timestamps in [nLow, nHigh)
+    bool ReadTimestampIndex(unsigned int nHigh, unsigned int nLow, std::vector<std::pair<uint256, unsigned int> >& vHashes);
+    //! Apply collected index changes in one batch, in the order they were collected
+    bool WriteIndexUpdates(const CIndexUpdates& updates);
     bool WriteFlag(const std::string& name, bool fValue);
     bool ReadFlag(const std::string& name, bool& fValue);
     bool LoadBlockIndexGuts();
@@ -16,16 +16,50 @@
 
 using namespace std;
 
-CTxMemPoolEntry::CTxMemPoolEntry() : nFee(0), nTxSize(0), nModSize(0), nTime(0), dPriority(0.0)
+/** Heap memory taken by an allocation of nAlloc bytes, including malloc's rounding and header */
+static inline size_t MallocUsage(size_t nAlloc)
+{
+    if (nAlloc == 0)
+        return 0;
+    if (sizeof(void*) == 8)
+        return ((nAlloc + 31) >> 4) << 4;
+    return ((nAlloc + 15) >> 3) << 3;
+}
+
+/** Heap memory of a node of a red-black tree (std::set, std::map, ordered index) holding T */
+template <typename T>
+static inline size_t TreeNodeUsage()
+{
+    return MallocUsage(sizeof(T) + 3 * sizeof(void*) + sizeof(int));
+}
+
+/** Heap memory owned by a transaction: its inputs, outputs and their scripts */
+static size_t TransactionUsage(const CTransaction& tx)
+{
+    size_t nUsage = MallocUsage(tx.vin.capacity() * sizeof(CTxIn)) + MallocUsage(tx.vout.capacity() * sizeof(CTxOut));
+    BOOST_FOREACH (const CTxIn& txin, tx.vin)
+        nUsage += MallocUsage(txin.scriptSig.capacity());
+    BOOST_FOREACH (const CTxOut& txout, tx.vout)
+        nUsage += MallocUsage(txout.scriptPubKey.capacity());
+    return nUsage;
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry() : nFee(0), nTxSize(0), nModSize(0), nUsageSize(0), nTime(0), dPriority(0.0), nFeeDelta(0),
+                                     nCountWithDescendants(1), nSizeWithDescendants(0), nModFeesWithDescendants(0)
 {
     nHeight = MEMPOOL_HEIGHT;
 }
 
-CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight) : tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight)
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight) : tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight), nFeeDelta(0)
 {
     nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
 
     nModSize = tx.CalculateModifiedSize(nTxSize);
+    nUsageSize = TransactionUsage(tx);
+
+    nCountWithDescendants = 1;
+    nSizeWithDescendants = nTxSize;
+    nModFeesWithDescendants = nFee;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -42,6 +76,28 @@ CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
     return dResult;
 }
 
+void CTxMemPoolEntry::UpdateDescendantState(int64_t nSizeDiff, CAmount nFeeDiff, int64_t nCountDiff)
+{
+    nSizeWithDescendants += nSizeDiff;
+    assert(int64_t(nSizeWithDescendants) > 0);
+    nModFeesWithDescendants += nFeeDiff;
+    nCountWithDescendants += nCountDiff;
+    assert(int64_t(nCountWithDescendants) > 0);
+}
+
+void CTxMemPoolEntry::SetDescendantState(uint64_t nSize, CAmount nFees, uint64_t nCount)
+{
+    nSizeWithDescendants = nSize;
+    nModFeesWithDescendants = nFees;
+    nCountWithDescendants = nCount;
+}
+
+void CTxMemPoolEntry::UpdateFeeDelta(CAmount nNewFeeDelta)
+{
+    nModFeesWithDescendants += nNewFeeDelta - nFeeDelta;
+    nFeeDelta = nNewFeeDelta;
+}
+
 /**
  * Keep track of fee/priority for transactions confirmed within N blocks
  */
@@ -355,7 +411,13 @@ public:
 
 
 CTxMemPool::CTxMemPool(const CFeeRate& _minRelayFee) : nTransactionsUpdated(0),
-                                                       minRelayFee(_minRelayFee)
+                                                       minRelayFee(_minRelayFee),
+                                                       totalTxSize(0),
+                                                       cachedInnerUsage(0),
+                                                       rollingMinimumFeeRate(0),
+                                                       lastRollingFeeUpdate(GetTime()),
+                                                       blockSinceLastRollingFeeBump(false),
+                                                       fLoaded(false)
 {
     // Sanity checks off by default for performance, because otherwise
     // accepting transactions becomes O(N^2) where N is the number
@@ -401,6 +463,83 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
 }
 
 
+void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
+{
+    setEntries& parents = mapLinks[entry].parents;
+    if (add ? parents.insert(parent).second : parents.erase(parent) != 0) {
+        if (add)
+            cachedInnerUsage += TreeNodeUsage<txiter>();
+        else
+            cachedInnerUsage -= TreeNodeUsage<txiter>();
+    }
+}
+
+void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+{
+    setEntries& children = mapLinks[entry].children;
+    if (add ? children.insert(child).second : children.erase(child) != 0) {
+        if (add)
+            cachedInnerUsage += TreeNodeUsage<txiter>();
+        else
+            cachedInnerUsage -= TreeNodeUsage<txiter>();
+    }
+}
+
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolParents(txiter entry) const
+{
+    AssertLockHeld(cs);
+    txlinksMap::const_iterator it = mapLinks.find(entry);
+    assert(it != mapLinks.end());
+    return it->second.parents;
+}
+
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolChildren(txiter entry) const
+{
+    AssertLockHeld(cs);
+    txlinksMap::const_iterator it = mapLinks.find(entry);
+    assert(it != mapLinks.end());
+    return it->second.children;
+}
+
+void CTxMemPool::CalculateAncestors(txiter entry, setEntries& setAncestors) const
+{
+    std::vector<txiter> vWork(GetMemPoolParents(entry).begin(), GetMemPoolParents(entry).end());
+    while (!vWork.empty()) {
+        txiter it = vWork.back();
+        vWork.pop_back();
+        if (!setAncestors.insert(it).second)
+            continue;
+        const setEntries& parents = GetMemPoolParents(it);
+        vWork.insert(vWork.end(), parents.begin(), parents.end());
+    }
+}
+
+void CTxMemPool::CalculateDescendants(txiter entry, setEntries& setDescendants) const
+{
+    std::vector<txiter> vWork(1, entry);
+    while (!vWork.empty()) {
+        txiter it = vWork.back();
+        vWork.pop_back();
+        if (!setDescendants.insert(it).second)
+            continue;
+        const setEntries& children = GetMemPoolChildren(it);
+        vWork.insert(vWork.end(), children.begin(), children.end());
+    }
+}
+
+void CTxMemPool::RecalculateDescendantState(txiter it)
+{
+    setEntries setDescendants;
+    CalculateDescendants(it, setDescendants);
+    uint64_t nSize = 0;
+    CAmount nFees = 0;
+    BOOST_FOREACH (txiter desc, setDescendants) {
+        nSize += desc->GetTxSize();
+        nFees += desc->GetModifiedFee();
+    }
+    mapTx.modify(it, set_descendant_state(nSize, nFees, setDescendants.size()));
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry)
 {
     // Add to memory pool without checking anything.
@@ -408,25 +547,121 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry)
     // all the appropriate checks.
     LOCK(cs);
     {
-        mapTx[hash] = entry;
-        const CTransaction& tx = mapTx[hash].GetTx();
-        for (unsigned int i = 0; i < tx.vin.size(); i++)
+        txiter newit = mapTx.insert(entry).first;
+        mapLinks.insert(make_pair(newit, TxLinks()));
+        cachedInnerUsage += newit->DynamicMemoryUsage() + TreeNodeUsage<std::pair<txiter, TxLinks> >();
+
+        // Apply a prioritisation made before the transaction entered the pool
+        std::map<uint256, std::pair<double, CAmount> >::const_iterator pos = mapDeltas.find(hash);
+        if (pos != mapDeltas.end() && pos->second.second != 0)
+            mapTx.modify(newit, update_fee_delta(pos->second.second));
+
+        const CTransaction& tx = newit->GetTx();
+        for (unsigned int i = 0; i < tx.vin.size(); i++) {
             mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+            txiter parent = mapTx.find(tx.vin[i].prevout.hash);
+            if (parent != mapTx.end()) {
+                UpdateParent(newit, parent, true);
+                UpdateChild(parent, newit, true);
+            }
+        }
+
+        // Transactions returning to the pool after a reorganization may find
+        // their children there already.
+        bool fHasChildren = false;
+        for (unsigned int i = 0; i < tx.vout.size(); i++) {
+            std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.find(COutPoint(hash, i));
+            if (it == mapNextTx.end())
+                continue;
+            txiter child = mapTx.find(it->second.ptx->GetHash());
+            assert(child != mapTx.end());
+            UpdateParent(child, newit, true);
+            UpdateChild(newit, child, true);
+            fHasChildren = true;
+        }
+
+        setEntries setAncestors;
+        CalculateAncestors(newit, setAncestors);
+        if (!fHasChildren) {
+            BOOST_FOREACH (txiter ancestor, setAncestors)
+                mapTx.modify(ancestor, update_descendant_state(newit->GetTxSize(), newit->GetModifiedFee(), 1));
+        } else {
+            // The descendants of the new entry may be descendants of its ancestors already
+            RecalculateDescendantState(newit);
+            BOOST_FOREACH (txiter ancestor, setAncestors)
+                RecalculateDescendantState(ancestor);
+        }
+
         nTransactionsUpdated++;
         totalTxSize += entry.GetTxSize();
     }
     return true;
 }
 
+void CTxMemPool::removeUnchecked(txiter it, std::list<CTransaction>& removed)
+{
+    const CTransaction& tx = it->GetTx();
+    BOOST_FOREACH (const CTxIn& txin, tx.vin)
+        mapNextTx.erase(txin.prevout);
+
+    const TxLinks& links = mapLinks[it];
+    BOOST_FOREACH (txiter parent, links.parents)
+        UpdateChild(parent, it, false);
+    BOOST_FOREACH (txiter child, links.children)
+        UpdateParent(child, it, false);
+    cachedInnerUsage -= (links.parents.size() + links.children.size()) * TreeNodeUsage<txiter>();
+    cachedInnerUsage -= it->DynamicMemoryUsage() + TreeNodeUsage<std::pair<txiter, TxLinks> >();
+    mapLinks.erase(it);
+
+    removed.push_back(tx);
+    totalTxSize -= it->GetTxSize();
+    mapTx.erase(it);
+    nTransactionsUpdated++;
+}
+
+namespace
+{
+struct CompareFirst {
+    template <typename T>
+    bool operator()(const T& a, const T& b) const
+    {
+        return a.first < b.first;
+    }
+};
+} // anon namespace
+
+void CTxMemPool::RemoveStaged(const setEntries& stage, std::list<CTransaction>& removed)
+{
+    AssertLockHeld(cs);
+    // Take the removed entries out of the descendant statistics of the
+    // ancestors that stay. A child has more ancestors than any of its
+    // parents, so sorting by their number puts parents first.
+    std::vector<std::pair<size_t, txiter> > vOrder;
+    vOrder.reserve(stage.size());
+    BOOST_FOREACH (txiter it, stage) {
+        setEntries setAncestors;
+        CalculateAncestors(it, setAncestors);
+        BOOST_FOREACH (txiter ancestor, setAncestors) {
+            if (!stage.count(ancestor))
+                mapTx.modify(ancestor, update_descendant_state(-(int64_t)it->GetTxSize(), -it->GetModifiedFee(), -1));
+        }
+        vOrder.push_back(std::make_pair(setAncestors.size(), it));
+    }
+    std::stable_sort(vOrder.begin(), vOrder.end(), CompareFirst());
+    for (size_t i = 0; i < vOrder.size(); i++)
+        removeUnchecked(vOrder[i].second, removed);
+}
 
 void CTxMemPool::remove(const CTransaction& origTx, std::list<CTransaction>& removed, bool fRecursive)
 {
     // Remove transaction from memory pool
     {
         LOCK(cs);
-        std::deque<uint256> txToRemove;
-        txToRemove.push_back(origTx.GetHash());
-        if (fRecursive && !mapTx.count(origTx.GetHash())) {
+        setEntries txToRemove;
+        txiter origit = mapTx.find(origTx.GetHash());
+        if (origit != mapTx.end()) {
+            txToRemove.insert(origit);
+        } else if (fRecursive) {
             // If recursively removing but origTx isn't in the mempool
             // be sure to remove any children that are in the pool. This can
             // happen during chain re-orgs if origTx isn't re-accepted into
@@ -435,43 +670,42 @@ void CTxMemPool::remove(const CTransaction& origTx, std::list<CTransaction>& rem
                 std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
                 if (it == mapNextTx.end())
                     continue;
-                txToRemove.push_back(it->second.ptx->GetHash());
+                txiter nextit = mapTx.find(it->second.ptx->GetHash());
+                assert(nextit != mapTx.end());
+                txToRemove.insert(nextit);
             }
         }
-        while (!txToRemove.empty()) {
-            uint256 hash = txToRemove.front();
-            txToRemove.pop_front();
-            if (!mapTx.count(hash))
-                continue;
-            const CTransaction& tx = mapTx[hash].GetTx();
-            if (fRecursive) {
-                for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
-                    if (it == mapNextTx.end())
-                        continue;
-                    txToRemove.push_back(it->second.ptx->GetHash());
-                }
-            }
-            BOOST_FOREACH (const CTxIn& txin, tx.vin)
-                mapNextTx.erase(txin.prevout);
-
-            removed.push_back(tx);
-            totalTxSize -= mapTx[hash].GetTxSize();
-            mapTx.erase(hash);
-            nTransactionsUpdated++;
+        setEntries setAllRemoves;
+        if (fRecursive) {
+            BOOST_FOREACH (txiter it, txToRemove)
+                CalculateDescendants(it, setAllRemoves);
+        } else {
+            setAllRemoves.swap(txToRemove);
         }
+        RemoveStaged(setAllRemoves, removed);
     }
 }
 
+void CTxMemPool::removeForDisconnect(const std::deque<CTransaction>& vtx, std::vector<CTransaction>& vResurrect)
+{
+    std::list<CTransaction> listDependent;
+    BOOST_FOREACH (const CTransaction& tx, vtx) {
+        if (!tx.IsCoinBase() && !tx.IsCoinStake())
+            vResurrect.push_back(tx);
+        remove(tx, listDependent, true);
+    }
+    vResurrect.insert(vResurrect.end(), listDependent.begin(), listDependent.end());
+}
+
 void CTxMemPool::removeCoinbaseSpends(const CCoinsViewCache* pcoins, unsigned int nMemPoolHeight)
 {
     // Remove transactions spending a coinbase which are now immature
     LOCK(cs);
     list<CTransaction> transactionsToRemove;
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
-        const CTransaction& tx = it->second.GetTx();
+    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+        const CTransaction& tx = it->GetTx();
         BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
+            indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end())
                 continue;
             const CCoins* coins = pcoins->AccessCoins(txin.prevout.hash);
@@ -512,9 +746,9 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
     LOCK(cs);
     std::vector<CTxMemPoolEntry> entries;
     BOOST_FOREACH (const CTransaction& tx, vtx) {
-        uint256 hash = tx.GetHash();
-        if (mapTx.count(hash))
-            entries.push_back(mapTx[hash]);
+        txiter it = mapTx.find(tx.GetHash());
+        if (it != mapTx.end())
+            entries.push_back(*it);
     }
     minerPolicyEstimator->seenBlock(entries, nBlockHeight, minRelayFee);
     BOOST_FOREACH (const CTransaction& tx, vtx) {
@@ -523,15 +757,22 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
         removeConflicts(tx, conflicts);
         ClearPrioritisation(tx.GetHash());
     }
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = true;
 }
 
 
 void CTxMemPool::clear()
 {
     LOCK(cs);
+    mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
     totalTxSize = 0;
+    cachedInnerUsage = 0;
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = false;
+    rollingMinimumFeeRate = 0;
     ++nTransactionsUpdated;
 }
 
@@ -547,19 +788,27 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
     CCoinsViewCache mempoolDuplicate(const_cast<CCoinsViewCache*>(pcoins));
 
     LOCK(cs);
+    uint64_t innerUsage = 0;
     list<const CTxMemPoolEntry*> waitingOnDependants;
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         unsigned int i = 0;
-        checkTotal += it->second.GetTxSize();
-        const CTransaction& tx = it->second.GetTx();
+        checkTotal += it->GetTxSize();
+        const CTransaction& tx = it->GetTx();
+        txlinksMap::const_iterator linksiter = mapLinks.find(it);
+        assert(linksiter != mapLinks.end());
+        const TxLinks& links = linksiter->second;
+        innerUsage += it->DynamicMemoryUsage() + TreeNodeUsage<std::pair<txiter, TxLinks> >() +
+                      (links.parents.size() + links.children.size()) * TreeNodeUsage<txiter>();
         bool fDependsWait = false;
+        setEntries setParentCheck;
         BOOST_FOREACH (const CTxIn& txin, tx.vin) {
             // Check that every mempool transaction's inputs refer to available coins, or other mempool tx's.
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
+            indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end()) {
-                const CTransaction& tx2 = it2->second.GetTx();
+                const CTransaction& tx2 = it2->GetTx();
                 assert(tx2.vout.size() > txin.prevout.n && !tx2.vout[txin.prevout.n].IsNull());
                 fDependsWait = true;
+                setParentCheck.insert(it2);
             } else {
                 const CCoins* coins = pcoins->AccessCoins(txin.prevout.hash);
                 assert(coins && coins->IsAvailable(txin.prevout.n));
@@ -571,8 +820,30 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
             assert(it3->second.n == i);
             i++;
         }
+        assert(setParentCheck == GetMemPoolParents(it));
+
+        // Check the children and the descendant statistics
+        setEntries setChildrenCheck;
+        for (unsigned int n = 0; n < tx.vout.size(); n++) {
+            std::map<COutPoint, CInPoint>::const_iterator itNext = mapNextTx.find(COutPoint(it->GetTx().GetHash(), n));
+            if (itNext != mapNextTx.end())
+                setChildrenCheck.insert(mapTx.find(itNext->second.ptx->GetHash()));
+        }
+        assert(setChildrenCheck == GetMemPoolChildren(it));
+        setEntries setDescendants;
+        CalculateDescendants(it, setDescendants);
+        uint64_t nSizeCheck = 0;
+        CAmount nFeesCheck = 0;
+        BOOST_FOREACH (txiter desc, setDescendants) {
+            nSizeCheck += desc->GetTxSize();
+            nFeesCheck += desc->GetModifiedFee();
+        }
+        assert(it->GetCountWithDescendants() == setDescendants.size());
+        assert(it->GetSizeWithDescendants() == nSizeCheck);
+        assert(it->GetModFeesWithDescendants() == nFeesCheck);
+
         if (fDependsWait)
-            waitingOnDependants.push_back(&it->second);
+            waitingOnDependants.push_back(&(*it));
         else {
             CValidationState state;
             CTxUndo undo;
@@ -598,15 +869,16 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
     }
     for (std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
         uint256 hash = it->second.ptx->GetHash();
-        map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(hash);
-        const CTransaction& tx = it2->second.GetTx();
+        indexed_transaction_set::const_iterator it2 = mapTx.find(hash);
         assert(it2 != mapTx.end());
+        const CTransaction& tx = it2->GetTx();
         assert(&tx == it->second.ptx);
         assert(tx.vin.size() > it->second.n);
         assert(it->first == it->second.ptx->vin[it->second.n].prevout);
     }
 
     assert(totalTxSize == checkTotal);
+    assert(innerUsage == cachedInnerUsage);
 }
 
 void CTxMemPool::queryHashes(vector<uint256>& vtxid)
@@ -615,19 +887,31 @@ void CTxMemPool::queryHashes(vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
-        vtxid.push_back((*mi).first);
+    for (indexed_transaction_set::const_iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+        vtxid.push_back(mi->GetTx().GetHash());
 }
 
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
-    map<uint256, CTxMemPoolEntry>::const_iterator i = mapTx.find(hash);
+    indexed_transaction_set::const_iterator i = mapTx.find(hash);
     if (i == mapTx.end()) return false;
-    result = i->second.GetTx();
+    result = i->GetTx();
     return true;
 }
 
+bool CTxMemPool::IsLoaded() const
+{
+    LOCK(cs);
+    return fLoaded;
+}
+
+void CTxMemPool::SetIsLoaded(bool fLoadedIn)
+{
+    LOCK(cs);
+    fLoaded = fLoadedIn;
+}
+
 CFeeRate CTxMemPool::estimateFee(int nBlocks) const
 {
     LOCK(cs);
@@ -677,6 +961,14 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const string strHash,
         std::pair<double, CAmount>& deltas = mapDeltas[hash];
         deltas.first += dPriorityDelta;
         deltas.second += nFeeDelta;
+        txiter it = mapTx.find(hash);
+        if (it != mapTx.end() && nFeeDelta != 0) {
+            mapTx.modify(it, update_fee_delta(deltas.second));
+            setEntries setAncestors;
+            CalculateAncestors(it, setAncestors);
+            BOOST_FOREACH (txiter ancestor, setAncestors)
+                mapTx.modify(ancestor, update_descendant_state(0, nFeeDelta, 0));
+        }
     }
     LogPrintf("PrioritiseTransaction: %s priority += %f, fee += %d\n", strHash, dPriorityDelta, FormatMoney(nFeeDelta));
 }
@@ -698,6 +990,93 @@ void CTxMemPool::ClearPrioritisation(const uint256 hash)
     mapDeltas.erase(hash);
 }
 
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    // Every entry is a node in each of the four indexes of mapTx, sharing one allocation
+    size_t nEntryUsage = MallocUsage(sizeof(CTxMemPoolEntry) + 4 * (3 * sizeof(void*) + sizeof(int)));
+    return mapTx.size() * nEntryUsage + mapNextTx.size() * TreeNodeUsage<std::pair<COutPoint, CInPoint> >() +
+           mapDeltas.size() * TreeNodeUsage<std::pair<uint256, std::pair<double, CAmount> > >() + cachedInnerUsage;
+}
+
+CFeeRate CTxMemPool::GetMinFee(size_t sizelimit) const
+{
+    LOCK(cs);
+    if (!blockSinceLastRollingFeeBump || rollingMinimumFeeRate == 0)
+        return CFeeRate(rollingMinimumFeeRate);
+
+    int64_t time = GetTime();
+    if (time > lastRollingFeeUpdate + 10) {
+        // Decay faster while the pool is well below its limit
+        double halflife = ROLLING_FEE_HALFLIFE;
+        if (DynamicMemoryUsage() < sizelimit / 4)
+            halflife /= 4;
+        else if (DynamicMemoryUsage() < sizelimit / 2)
+            halflife /= 2;
+
+        rollingMinimumFeeRate = rollingMinimumFeeRate / pow(2.0, (time - lastRollingFeeUpdate) / halflife);
+        lastRollingFeeUpdate = time;
+
+        if (rollingMinimumFeeRate < minRelayFee.GetFeePerK() / 2) {
+            rollingMinimumFeeRate = 0;
+            return CFeeRate(0);
+        }
+    }
+    return std::max(CFeeRate(rollingMinimumFeeRate), minRelayFee);
+}
+
+void CTxMemPool::trackPackageRemoved(const CFeeRate& rate)
+{
+    AssertLockHeld(cs);
+    if (rate.GetFeePerK() > rollingMinimumFeeRate) {
+        rollingMinimumFeeRate = rate.GetFeePerK();
+        blockSinceLastRollingFeeBump = false;
+    }
+}
+
+void CTxMemPool::TrimToSize(size_t sizelimit)
+{
+    LOCK(cs);
+    unsigned int nTxnRemoved = 0;
+    CFeeRate maxFeeRateRemoved(0);
+    while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
+        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
+
+        // Require a fee rate above that of the evicted package to enter the
+        // pool again, so that it cannot be replaced by one paying as little.
+        CFeeRate removed(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
+        removed = CFeeRate(removed.GetFeePerK() + minRelayFee.GetFeePerK());
+        trackPackageRemoved(removed);
+        maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
+
+        setEntries stage;
+        CalculateDescendants(mapTx.project<0>(it), stage);
+        nTxnRemoved += stage.size();
+        std::list<CTransaction> txn;
+        RemoveStaged(stage, txn);
+    }
+
+    if (maxFeeRateRemoved > CFeeRate(0))
+        LogPrint("mempool", "Removed %u txn, rolling minimum fee bumped to %s\n", nTxnRemoved, maxFeeRateRemoved.ToString());
+}
+
+int CTxMemPool::Expire(int64_t time)
+{
+    LOCK(cs);
+    indexed_transaction_set::index<entry_time>::type::iterator it = mapTx.get<entry_time>().begin();
+    setEntries toremove;
+    while (it != mapTx.get<entry_time>().end() && it->GetTime() < time) {
+        toremove.insert(mapTx.project<0>(it));
+        it++;
+    }
+    setEntries stage;
+    BOOST_FOREACH (txiter removeit, toremove)
+        CalculateDescendants(removeit, stage);
+    std::list<CTransaction> removed;
+    RemoveStaged(stage, removed);
+    return stage.size();
+}
+
 
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView* baseIn, CTxMemPool& mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) {}
 
@@ -6,13 +6,19 @@
 #ifndef BITCOIN_TXMEMPOOL_H
 #define BITCOIN_TXMEMPOOL_H
 
+#include <deque>
 #include <list>
+#include <set>
 
 #include "amount.h"
 #include "coins.h"
 #include "primitives/transaction.h"
 #include "sync.h"
 
+#include <boost/multi_index/identity.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index_container.hpp>
+
 class CAutoFile;
 
 inline double AllowFreeThreshold()
@@ -31,6 +37,9 @@ inline bool AllowFree(double dPriority)
 /** Fake height value used in CCoins to signify they are only in the memory pool (since 0.8) */
 static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
+/** Half-life in seconds of the minimum fee rate raised by evictions */
+static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+
 /**
  * CTxMemPool stores these:
  */
@@ -41,9 +50,16 @@ private:
     CAmount nFee;         //! Cached to avoid expensive parent-transaction lookups
     size_t nTxSize;       //! ... and avoid recomputing tx size
     size_t nModSize;      //! ... and modified size for priority
+    size_t nUsageSize;    //! ... and the heap memory used by the transaction
     int64_t nTime;        //! Local time when entering the mempool
     double dPriority;     //! Priority when entering the mempool
     unsigned int nHeight; //! Chain height when entering the mempool
+    CAmount nFeeDelta;    //! Fee delta set with PrioritiseTransaction
+
+    //! Statistics of this transaction and its in-pool descendants
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    CAmount nModFeesWithDescendants;
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight);
@@ -56,6 +72,122 @@ public:
     size_t GetTxSize() const { return nTxSize; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
+
+    //! The fee including the delta set with PrioritiseTransaction
+    CAmount GetModifiedFee() const { return nFee + nFeeDelta; }
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    CAmount GetModFeesWithDescendants() const { return nModFeesWithDescendants; }
+
+    //! Adjust the descendant statistics for a descendant that entered or left the pool
+    void UpdateDescendantState(int64_t nSizeDiff, CAmount nFeeDiff, int64_t nCountDiff);
+    void SetDescendantState(uint64_t nSize, CAmount nFees, uint64_t nCount);
+    void UpdateFeeDelta(CAmount nNewFeeDelta);
+};
+
+/** Modifiers for the entries of CTxMemPool::mapTx, which can only be changed through modify() */
+struct update_descendant_state {
+    int64_t nSizeDiff;
+    CAmount nFeeDiff;
+    int64_t nCountDiff;
+
+    update_descendant_state(int64_t _nSizeDiff, CAmount _nFeeDiff, int64_t _nCountDiff) : nSizeDiff(_nSizeDiff), nFeeDiff(_nFeeDiff), nCountDiff(_nCountDiff) {}
+    void operator()(CTxMemPoolEntry& e) { e.UpdateDescendantState(nSizeDiff, nFeeDiff, nCountDiff); }
+};
+
+struct set_descendant_state {
+    uint64_t nSize;
+    CAmount nFees;
+    uint64_t nCount;
+
+    set_descendant_state(uint64_t _nSize, CAmount _nFees, uint64_t _nCount) : nSize(_nSize), nFees(_nFees), nCount(_nCount) {}
+    void operator()(CTxMemPoolEntry& e) { e.SetDescendantState(nSize, nFees, nCount); }
+};
+
+struct update_fee_delta {
+    CAmount nFeeDelta;
+
+    update_fee_delta(CAmount _nFeeDelta) : nFeeDelta(_nFeeDelta) {}
+    void operator()(CTxMemPoolEntry& e) { e.UpdateFeeDelta(nFeeDelta); }
+};
+
+/** Extracts the txid of a mempool entry, the key of the primary index */
+struct mempoolentry_txid {
+    typedef uint256 result_type;
+    result_type operator()(const CTxMemPoolEntry& entry) const
+    {
+        return entry.GetTx().GetHash();
+    }
+};
+
+/**
+ * Sort an entry by the higher of its own modified fee rate and that of it
+ * together with its descendants, lowest first: the order in which entries
+ * are evicted. A low fee parent of a high fee child is evicted only together
+ * with the child.
+ */
+class CompareTxMemPoolEntryByDescendantScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double aFees, aSize, bFees, bSize;
+        GetScore(a, aFees, aSize);
+        GetScore(b, bFees, bSize);
+        // Avoid division by rewriting (a/b > c/d) as (a*d > c*b).
+        double f1 = aFees * bSize;
+        double f2 = bFees * aSize;
+        if (f1 == f2)
+            return a.GetTime() > b.GetTime();
+        return f1 < f2;
+    }
+
+    //! The fees and size of whichever of the entry alone or with its descendants pays the higher rate
+    static void GetScore(const CTxMemPoolEntry& e, double& dFees, double& dSize)
+    {
+        double f1 = (double)e.GetModifiedFee() * e.GetSizeWithDescendants();
+        double f2 = (double)e.GetModFeesWithDescendants() * e.GetTxSize();
+        if (f2 > f1) {
+            dFees = e.GetModFeesWithDescendants();
+            dSize = e.GetSizeWithDescendants();
+        } else {
+            dFees = e.GetModifiedFee();
+            dSize = e.GetTxSize();
+        }
+    }
+};
+
+/** Sort an entry by its own modified fee rate, highest first: the order block assembly considers entries in */
+class CompareTxMemPoolEntryByScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double f1 = (double)a.GetModifiedFee() * b.GetTxSize();
+        double f2 = (double)b.GetModifiedFee() * a.GetTxSize();
+        if (f1 == f2)
+            return b.GetTx().GetHash() < a.GetTx().GetHash();
+        return f1 > f2;
+    }
+};
+
+/** Sort an entry by the time it entered the pool, oldest first */
+class CompareTxMemPoolEntryByEntryTime
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        return a.GetTime() < b.GetTime();
+    }
+};
+
+// Tags of the secondary indexes of CTxMemPool::mapTx
+struct descendant_score {
+};
+struct entry_time {
+};
+struct mining_score {
 };
 
 class CMinerPolicyEstimator;
@@ -90,9 +222,50 @@ public:
  * are added to the pool: if a new transaction double-spends
  * an input of a transaction in the pool, it is dropped,
  * as are non-standard transactions.
+ *
+ * mapTx indexes the entries by txid, by descendant score (for eviction), by
+ * entry time (for expiry) and by fee rate (for block assembly). Every entry
+ * keeps the size and fees of its in-pool descendants, and mapLinks its
+ * in-pool parents and children. When the pool outgrows its memory limit the
+ * entries with the lowest descendant score are evicted with their
+ * descendants, and the minimum fee rate to enter the pool rises above theirs,
+ * decaying again over time.
  */
 class CTxMemPool
 {
+public:
+    typedef boost::multi_index_container<
+        CTxMemPoolEntry,
+        boost::multi_index::indexed_by<
+            // sorted by txid
+            boost::multi_index::ordered_unique<mempoolentry_txid>,
+            // sorted by fee rate with descendants
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<descendant_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByDescendantScore>,
+            // sorted by entry time
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<entry_time>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByEntryTime>,
+            // sorted by fee rate
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<mining_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByScore> > >
+        indexed_transaction_set;
+
+    typedef indexed_transaction_set::nth_index<0>::type::iterator txiter;
+
+    struct CompareIteratorByHash {
+        bool operator()(const txiter& a, const txiter& b) const
+        {
+            return a->GetTx().GetHash() < b->GetTx().GetHash();
+        }
+    };
+    typedef std::set<txiter, CompareIteratorByHash> setEntries;
+
 private:
     bool fSanityCheck; //! Normally false, true if -checkmempool or -regtest
     unsigned int nTransactionsUpdated;
@@ -100,10 +273,36 @@ private:
 
     CFeeRate minRelayFee; //! Passed to constructor to avoid dependency on main
     uint64_t totalTxSize; //! sum of all mempool tx' byte sizes
+    uint64_t cachedInnerUsage; //! sum of the dynamic memory usage of all entries and their links
+
+    //! Minimum fee rate to enter the pool after evictions, in satoshis per 1000 bytes
+    mutable double rollingMinimumFeeRate;
+    mutable int64_t lastRollingFeeUpdate;
+    mutable bool blockSinceLastRollingFeeBump;
+
+    bool fLoaded; //! Whether the transactions saved at the last shutdown were loaded
+
+    struct TxLinks {
+        setEntries parents;
+        setEntries children;
+    };
+    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
+    txlinksMap mapLinks;
+
+    void UpdateParent(txiter entry, txiter parent, bool add);
+    void UpdateChild(txiter entry, txiter child, bool add);
+
+    //! Recompute the descendant statistics of an entry from its descendants
+    void RecalculateDescendantState(txiter it);
+    //! Remove a set of entries, with any of their descendants, and report them parents first
+    void RemoveStaged(const setEntries& stage, std::list<CTransaction>& removed);
+    void removeUnchecked(txiter it, std::list<CTransaction>& removed);
+    //! Raise the minimum fee rate after evicting entries paying rate
+    void trackPackageRemoved(const CFeeRate& rate);
 
 public:
     mutable CCriticalSection cs;
-    std::map<uint256, CTxMemPoolEntry> mapTx;
+    indexed_transaction_set mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
@@ -124,12 +323,46 @@ public:
     void removeCoinbaseSpends(const CCoinsViewCache* pcoins, unsigned int nMemPoolHeight);
     void removeConflicts(const CTransaction& tx, std::list<CTransaction>& removed);
     void removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight, std::list<CTransaction>& conflicts);
+    /**
+     * Take out the transactions spending outputs of disconnected transactions, given
+     * oldest first. Appends the disconnected transactions other than coinbases and
+     * coinstakes to vResurrect, then the removed ones, parents before children.
+     */
+    void removeForDisconnect(const std::deque<CTransaction>& vtx, std::vector<CTransaction>& vResurrect);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
     void pruneSpent(const uint256& hash, CCoins& coins);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
 
+    //! The in-pool parents and children of an entry; cs must be held
+    const setEntries& GetMemPoolParents(txiter entry) const;
+    const setEntries& GetMemPoolChildren(txiter entry) const;
+
+    //! Add all in-pool ancestors of an entry to setAncestors, excluding the entry itself; cs must be held
+    void CalculateAncestors(txiter entry, setEntries& setAncestors) const;
+    //! Add an entry and all its in-pool descendants to setDescendants; cs must be held
+    void CalculateDescendants(txiter entry, setEntries& setDescendants) const;
+
+    /**
+     * Evict the entries with the lowest descendant score, with their
+     * descendants, until the pool uses at most sizelimit bytes.
+     */
+    void TrimToSize(size_t sizelimit);
+
+    /** Remove the entries that entered the pool before time, with their descendants. Returns how many were removed. */
+    int Expire(int64_t time);
+
+    /**
+     * The minimum fee rate to enter a pool limited to sizelimit bytes: zero
+     * until entries were evicted, then above theirs, decaying with a half-life
+     * of ROLLING_FEE_HALFLIFE after the next block.
+     */
+    CFeeRate GetMinFee(size_t sizelimit) const;
+
+    //! Estimated heap memory used by the pool
+    size_t DynamicMemoryUsage() const;
+
     /** Affect CreateNewBlock prioritisation of transactions */
     void PrioritiseTransaction(const uint256 hash, const std::string strHash, double dPriorityDelta, const CAmount& nFeeDelta);
     void ApplyDeltas(const uint256 hash, double& dPriorityDelta, CAmount& nFeeDelta);
@@ -154,6 +387,10 @@ public:
 
     bool lookup(uint256 hash, CTransaction& result) const;
 
+    //! Whether loading the transactions saved at the last shutdown has finished
+    bool IsLoaded() const;
+    void SetIsLoaded(bool fLoadedIn);
+
     /** Estimate fee rate needed to get into the next nBlocks */
     CFeeRate estimateFee(int nBlocks) const;
 